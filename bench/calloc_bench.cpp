@@ -0,0 +1,52 @@
+/// 大块calloc引起的缺页次数：交给原始calloc时新映射的零页不用写，只有保护区和头部所在的页会缺页
+/// 和malloc加memset比较，后者相当于原来Windows挂钩的写法，每一页都要写一遍
+/// 分别直接运行和用LD_PRELOAD加载libmemory_watcher.so运行
+///
+///     g++ -std=c++17 -O2 -o calloc_bench bench/calloc_bench.cpp
+///     ./calloc_bench
+///     LD_PRELOAD=./libmemory_watcher.so ./calloc_bench
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <chrono>
+
+static long minor_faults()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+void* volatile _sink; /// 防止编译器把分配和释放一起优化掉
+
+void* (*volatile _memset)(void*, int, size_t) = memset; /// 否则malloc加memset会被合并成calloc
+
+int main()
+{
+    printf("size MB, calloc faults, calloc us, malloc+memset faults, malloc+memset us\n");
+    for (size_t size = 1 << 20; size <= ((size_t)1 << 30); size <<= 2) {
+        long faults = minor_faults();
+        auto start = std::chrono::steady_clock::now();
+        void* data = calloc(size, 1);
+        _sink = data;
+        double calloc_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        long calloc_faults = minor_faults() - faults;
+        free(data);
+
+        faults = minor_faults();
+        start = std::chrono::steady_clock::now();
+        data = malloc(size);
+        if (data != nullptr) {
+            _memset(data, 0, size);
+        }
+        _sink = data;
+        double memset_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        long memset_faults = minor_faults() - faults;
+        free(data);
+
+        printf("%zu, %ld, %.0f, %ld, %.0f\n", size >> 20, calloc_faults, calloc_us, memset_faults, memset_us);
+    }
+    return 0;
+}
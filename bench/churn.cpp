@@ -0,0 +1,55 @@
+/// 多线程分配吞吐：每个线程保留64个存活块，每次随机释放一块再申请一块
+/// Linux下用LD_PRELOAD加载libmemory_watcher.so运行，线程数从1翻倍到max_threads
+///
+///     g++ -std=c++17 -O2 -o churn bench/churn.cpp -lpthread
+///     LD_PRELOAD=./libmemory_watcher.so ./churn 64 4000000
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#define LIVE_COUNT 64
+
+static void churn(uint32_t seed, long count)
+{
+    void* live[LIVE_COUNT] = {};
+    for (long i = 0; i < count; i++) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t slot = (seed >> 8) & (LIVE_COUNT - 1);
+        free(live[slot]);
+        live[slot] = malloc(16 + ((seed >> 16) & 511));
+    }
+
+    for (auto p : live) {
+        free(p);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : 64;
+    long total = argc > 2 ? atol(argv[2]) : 4000000;
+
+    printf("threads, ns per malloc+free, M pairs/s\n");
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        /// 总次数固定，线程越多每个线程做得越少
+        long count = total / threads;
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> workers;
+        for (int i = 0; i < threads; i++) {
+            workers.emplace_back(churn, 12345u + i, count);
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        double pairs = (double)count * threads;
+        printf("%d, %.0f, %.2f\n", threads, seconds * 1e9 / pairs, pairs / seconds / 1e6);
+    }
+    return 0;
+}
@@ -0,0 +1,56 @@
+/// 反复按1.5倍扩大一块内存的耗时，每个线程从16字节长到上限后释放，重复若干轮
+/// 分别直接运行、加载库运行和加载库开启异步模式运行，大块扩展时原始的realloc可以用mremap搬移
+///
+///     g++ -std=c++17 -O2 -o realloc_bench bench/realloc_bench.cpp -lpthread
+///     ./realloc_bench 4 20 64
+///     LD_PRELOAD=./libmemory_watcher.so ./realloc_bench 4 20 64
+///     MEMORY_WATCHER_ASYNC=1 LD_PRELOAD=./libmemory_watcher.so ./realloc_bench 4 20 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+void* volatile _sink; /// 防止编译器把整个循环优化掉
+
+static void grow(int rounds, size_t max_size)
+{
+    for (int r = 0; r < rounds; r++) {
+        char* data = nullptr;
+        size_t used = 0;
+        for (size_t size = 16; size <= max_size; size += size / 2) {
+            char* next = (char*)realloc(data, size);
+            if (next == nullptr)
+                break;
+
+            /// 和追加数据的程序一样只写新增的部分，搬移旧内容的开销都算在realloc上
+            memset(next + used, (int)r, size - used);
+            used = size;
+            data = next;
+            _sink = data;
+        }
+        free(data);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    int rounds = argc > 2 ? atoi(argv[2]) : 20;
+    size_t max_size = (size_t)(argc > 3 ? atoi(argv[3]) : 64) << 20;
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back(grow, rounds, max_size);
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("threads %d, rounds %d, max %zu MB, %.2f s\n", threads, rounds, max_size >> 20, seconds);
+    return 0;
+}
@@ -0,0 +1,69 @@
+/// 保护区填充加检查的耗时，逐字节循环和redzone.cpp按CPU选择的实现比较
+/// 逐字节循环相当于原来的写法，编译时关掉自动向量化，redzone.cpp里的SIMD实现用的是intrinsics，不受影响
+///
+///     g++ -std=c++17 -O2 -fno-tree-vectorize -I. -o redzone_bench bench/redzone_bench.cpp redzone.cpp
+
+#include <stdio.h>
+#include <chrono>
+#include "platform.h"
+#include "redzone.h"
+
+static void fill_bytes(uint8_t* data, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        data[i] = GUARD_NUM;
+    }
+}
+
+static bool check_bytes(const uint8_t* data, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        if (data[i] != GUARD_NUM)
+            return false;
+    }
+    return true;
+}
+
+template <typename F>
+static double measure(long count, F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < count; i++) {
+        f(i);
+    }
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / count;
+}
+
+int main()
+{
+    redzone_initialize();
+
+    static uint8_t buffer[REDZONE_MAX_SIZE + 64];
+    volatile bool ok = true;
+
+    static const size_t sizes[] = { 16, 64, 256, 1024, 4096, REDZONE_MAX_SIZE };
+
+    printf("size, bytes ns, %s ns, speedup\n", redzone_kernel());
+    for (size_t size : sizes) {
+        long count = 200000000 / (long)(size + 16);
+
+        /// 起始地址每次错开，保护区和用户指针一样不一定对齐
+        double bytes = measure(count, [&](long i) {
+            uint8_t* data = buffer + (i & 7) + 1;
+            fill_bytes(data, size);
+            _ReadWriteBarrier();
+            ok = ok & check_bytes(data, size);
+        });
+
+        double simd = measure(count, [&](long i) {
+            uint8_t* data = buffer + (i & 7) + 1;
+            redzone_fill(data, size);
+            _ReadWriteBarrier();
+            ok = ok & redzone_check(data, size);
+        });
+
+        printf("%zu, %.1f, %.1f, %.1fx\n", size, bytes, simd, bytes / simd);
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,109 @@
+/// 堆栈表的插入和查找速度：新堆栈插入、已有堆栈插入（分配路径上最常见的情况）、按id取回并解码
+/// 直接链接堆栈表的源文件，不要链接挂钩的文件，否则测试程序自己的malloc也会被挂钩
+///
+///     g++ -std=c++17 -O2 -I. -o stack_table_bench bench/stack_table_bench.cpp stack_table.cpp stack_trie.cpp virtual_memory.cpp callstack.cpp unwind_cache.cpp -ldl -lpthread
+///     ./stack_table_bench        按帧编码
+///     ./stack_table_bench trie   字典树
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "stack_table.h"
+
+#define STACK_COUNT 200000
+
+#define REPEAT_COUNT 5
+
+/// 16帧的合成堆栈：外层几帧在少数调用链之间共享，最内层每条都不同，和真实程序的分布接近
+static void make_stack(FastCallStack& call_stack, uint32_t i)
+{
+    call_stack.clear();
+    for (uint32_t depth = 0; depth < 16; depth++) {
+        SIZE_T pc = 0x400000 + 0x1000 * depth;
+        if (depth == 0) {
+            pc += (SIZE_T)i * 16;
+        } else if (depth < 4) {
+            pc += (i % 1024) * 8 + depth;
+        } else if (depth < 8) {
+            pc += (i % 64) * 16;
+        }
+        call_stack.push_back(pc);
+    }
+}
+
+static double now()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template <typename F>
+static double run_threads(int threads, F f)
+{
+    double start = now();
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back(f, t);
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    return now() - start;
+}
+
+int main(int argc, char** argv)
+{
+    bool trie = argc > 1 && strcmp(argv[1], "trie") == 0;
+
+    printf("mode, threads, new ns, existing ns, find+decode ns, stack_count, saved_size\n");
+    for (int threads : { 1, 4, 16 }) {
+        stack_table* table = new stack_table();
+        if (trie && !table->set_trie(true)) {
+            printf("trie unavailable\n");
+            return 1;
+        }
+
+        std::vector<uint32_t> ids(STACK_COUNT);
+        double insert_new = run_threads(threads, [&](int t) {
+            FastCallStack call_stack;
+            for (uint32_t i = t; i < STACK_COUNT; i += threads) {
+                make_stack(call_stack, i);
+                ids[i] = table->insert(call_stack);
+            }
+        });
+
+        double insert_existing = run_threads(threads, [&](int t) {
+            FastCallStack call_stack;
+            for (int r = 0; r < REPEAT_COUNT; r++) {
+                for (uint32_t i = t; i < STACK_COUNT; i += threads) {
+                    make_stack(call_stack, i);
+                    table->release(table->insert(call_stack));
+                }
+            }
+        });
+
+        double start = now();
+        size_t frames = 0;
+        FastCallStack call_stack;
+        for (int r = 0; r < REPEAT_COUNT; r++) {
+            for (uint32_t i = 0; i < STACK_COUNT; i++) {
+                call_stack.clear();
+                table->decode(table->find(ids[i]), call_stack);
+                frames += call_stack.size();
+            }
+        }
+        double decode = now() - start;
+
+        printf("%s, %d, %.0f, %.0f, %.0f, %u, %lld\n", trie ? "trie" : "flat", threads,
+            insert_new * 1e9 / STACK_COUNT, insert_existing * 1e9 / (STACK_COUNT * REPEAT_COUNT),
+            decode * 1e9 / (STACK_COUNT * REPEAT_COUNT), table->stack_count(), (long long)table->saved_size());
+
+        if (frames != (size_t)STACK_COUNT * REPEAT_COUNT * 16) {
+            printf("decode mismatch\n");
+            return 1;
+        }
+        delete table;
+    }
+    return 0;
+}
@@ -0,0 +1,26 @@
+#!/bin/sh
+# 同一个程序分别按帧编码和字典树保存堆栈，比较堆栈占用的内存
+# 退出时的统计里stack_frames是不同堆栈的帧数和占用的字节数，字典树模式下另有stack_nodes
+#
+#     sh bench/stack_trie_memory.sh ./libmemory_watcher.so [程序 参数...]
+#
+# 不指定程序时运行一段python3的json编解码
+
+library=$1
+shift
+if [ $# -eq 0 ]; then
+    # pyenv之类的包装脚本在加载库时也会被记录，直接运行解释器
+    python=$(python3 -c 'import sys; print(sys.executable)')
+    set -- "$python" -c 'import json; data = [{"id": i, "tags": [str(j) for j in range(i % 17)]} for i in range(20000)]; json.loads(json.dumps(data))'
+fi
+
+echo "depth, mode, stack_count, frames, bytes, nodes"
+for depth in 16 64; do
+    for trie in 0 1; do
+        MEMORY_WATCHER_STACK_DEPTH=$depth MEMORY_WATCHER_STACK_TRIE=$trie LD_PRELOAD=$library "$@" 2>&1 >/dev/null | awk -v depth=$depth -v trie=$trie '
+            /^stack_count,/ { count = $2 }
+            /^stack_frames,/ { frames = $2; bytes = $3 }
+            /^stack_nodes,/ { nodes = $2 }
+            END { gsub(",", "", frames); gsub(",", "", count); printf "%d, %s, %s, %s, %s, %s\n", depth, trie ? "trie" : "flat", count, frames, bytes, nodes == "" ? "-" : nodes }'
+    done
+done
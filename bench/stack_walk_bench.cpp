@@ -0,0 +1,70 @@
+/// 16帧调用链上三种回溯方式的耗时：帧指针、按.eh_frame规则缓存、backtrace
+/// 程序和库都要带帧指针编译，否则帧指针回溯在第一帧就停止
+///
+///     g++ -std=c++17 -O2 -fno-omit-frame-pointer -I. -o stack_walk_bench bench/stack_walk_bench.cpp callstack.cpp unwind_cache.cpp virtual_memory.cpp -ldl -lpthread
+///     ./stack_walk_bench
+
+#include <stdio.h>
+#include <chrono>
+#include <thread>
+#include "callstack.h"
+#include "unwind_cache.h"
+
+#define WALK_DEPTH 16
+
+#define WALK_COUNT 200000
+
+struct walk_result
+{
+    double _ns;
+
+    UINT32 _frames;
+};
+
+template <typename T>
+static walk_result walk(long count)
+{
+    walk_result result = { 0, 0 };
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < count; i++) {
+        T call_stack;
+        call_stack.getstacktrace(WALK_DEPTH, nullptr);
+        result._frames = call_stack.size();
+    }
+    result._ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / count;
+    return result;
+}
+
+static void measure(const char* thread)
+{
+    /// 安全的回溯慢得多，次数减少
+    walk_result fast = walk<FastCallStack>(WALK_COUNT);
+    walk_result cached = walk<CachedCallStack>(WALK_COUNT);
+    walk_result safe = walk<SafeCallStack>(WALK_COUNT / 20);
+
+    printf("%s, %.0f ns (%u), %.0f ns (%u), %.0f ns (%u)\n", thread,
+        fast._ns, fast._frames, cached._ns, cached._frames, safe._ns, safe._frames);
+}
+
+/// 每层一个不内联的函数，回溯时至少有WALK_DEPTH帧
+__attribute__((noinline)) static void nest(int depth, const char* thread)
+{
+    if (depth > 0) {
+        nest(depth - 1, thread);
+    } else {
+        measure(thread);
+    }
+    __asm__ __volatile__("" ::: "memory"); /// 阻止尾调用优化
+}
+
+int main()
+{
+    unwind_cache_initialize();
+
+    printf("thread, fast (frames), cached (frames), safe (frames)\n");
+    nest(WALK_DEPTH, "main");
+
+    std::thread worker(nest, WALK_DEPTH, "new");
+    worker.join();
+    return 0;
+}
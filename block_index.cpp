@@ -0,0 +1,235 @@
+#include "block_index.h"
+#include "virtual_memory.h"
+
+#define INITIAL_BITS 12 /// 初始4096个位置
+
+#define MIGRATE_STEP 16 /// 每次操作迁移的位置数
+
+block_index::block_index()
+{
+    _old_table._entries = nullptr;
+    _old_table._mask = 0;
+    _old_table._shift = 0;
+    _migrate_pos = 0;
+    _count = 0;
+
+    if (!table_init(_table, INITIAL_BITS)) {
+        _table._entries = nullptr;
+        _table._mask = 0;
+        _table._shift = 0;
+    }
+}
+
+block_index::~block_index()
+{
+    table_free(_table);
+    table_free(_old_table);
+}
+
+uint64_t block_index::hash(const void* ptr)
+{
+    /// murmur3 fmix64，高位用作下标，低位用作分片
+    uint64_t h = (uint64_t)(uintptr_t)ptr;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+memory_block* block_index::find(const void* ptr)
+{
+    uintptr_t key = (uintptr_t)ptr;
+    uint64_t h = hash(ptr);
+
+    entry* e = table_find(_table, key, h);
+    if (e != nullptr)
+        return e->_block;
+
+    if (_old_table._entries != nullptr) {
+        e = table_find(_old_table, key, h);
+        if (e != nullptr)
+            return e->_block;
+    }
+
+    return nullptr;
+}
+
+bool block_index::insert(const void* ptr, memory_block* block)
+{
+    migrate(MIGRATE_STEP);
+
+    /// 装载率超过3/4时扩容
+    if ((uint64_t)(_count + 1) * 4 > (uint64_t)(_table._mask + 1) * 3) {
+        grow();
+    }
+
+    if (_table._entries == nullptr || _count >= _table._mask)
+        return false;
+
+    table_insert(_table, (uintptr_t)ptr, hash(ptr), block);
+    _count++;
+    return true;
+}
+
+memory_block* block_index::erase(const void* ptr)
+{
+    migrate(MIGRATE_STEP);
+
+    uintptr_t key = (uintptr_t)ptr;
+    uint64_t h = hash(ptr);
+
+    entry* e = table_find(_table, key, h);
+    if (e != nullptr) {
+        memory_block* block = e->_block;
+        table_erase(_table, e);
+        _count--;
+        return block;
+    }
+
+    if (_old_table._entries != nullptr) {
+        /// 旧表只做标记，不做移动，避免影响迁移进度
+        e = table_find(_old_table, key, h);
+        if (e != nullptr && e->_block != nullptr) {
+            memory_block* block = e->_block;
+            e->_block = nullptr;
+            _count--;
+            return block;
+        }
+    }
+
+    return nullptr;
+}
+
+bool block_index::table_init(table& t, uint32_t bits)
+{
+    t._entries = (entry*)virtual_alloc(sizeof(entry) << bits);
+    if (t._entries == nullptr)
+        return false;
+
+    t._mask = (1u << bits) - 1;
+    t._shift = 64 - bits;
+    return true;
+}
+
+void block_index::table_free(table& t)
+{
+    virtual_free(t._entries, sizeof(entry) * ((size_t)t._mask + 1));
+    t._entries = nullptr;
+    t._mask = 0;
+    t._shift = 0;
+}
+
+block_index::entry* block_index::table_find(const table& t, uintptr_t key, uint64_t h)
+{
+    if (t._entries == nullptr)
+        return nullptr;
+
+    uint32_t pos = (uint32_t)(h >> t._shift);
+    for (uint32_t dist = 0; dist <= t._mask; dist++) {
+        entry* e = &t._entries[(pos + dist) & t._mask];
+        if (e->_key == key)
+            return e;
+
+        if (e->_key == 0)
+            return nullptr;
+
+        /// robin hood: 遇到离家更近的元素说明不存在
+        uint32_t home = (uint32_t)(hash((const void*)e->_key) >> t._shift);
+        if (((pos + dist - home) & t._mask) < dist)
+            return nullptr;
+    }
+
+    return nullptr;
+}
+
+void block_index::table_insert(table& t, uintptr_t key, uint64_t h, memory_block* block)
+{
+    entry curr = { key, block };
+    uint32_t pos = (uint32_t)(h >> t._shift);
+    uint32_t dist = 0;
+    for (;;) {
+        entry* e = &t._entries[pos];
+        if (e->_key == 0) {
+            *e = curr;
+            return;
+        }
+
+        uint32_t home = (uint32_t)(hash((const void*)e->_key) >> t._shift);
+        uint32_t e_dist = (pos - home) & t._mask;
+        if (e_dist < dist) {
+            entry temp = *e;
+            *e = curr;
+            curr = temp;
+            dist = e_dist;
+        }
+
+        pos = (pos + 1) & t._mask;
+        dist++;
+    }
+}
+
+void block_index::table_erase(table& t, entry* e)
+{
+    /// 后移删除，不留墓碑
+    uint32_t pos = (uint32_t)(e - t._entries);
+    for (;;) {
+        uint32_t next = (pos + 1) & t._mask;
+        entry* n = &t._entries[next];
+        if (n->_key == 0 ||
+            (uint32_t)(hash((const void*)n->_key) >> t._shift) == next) {
+            t._entries[pos]._key = 0;
+            t._entries[pos]._block = nullptr;
+            return;
+        }
+
+        t._entries[pos] = *n;
+        pos = next;
+    }
+}
+
+void block_index::grow()
+{
+    /// 上一次迁移还没完成，先完成它
+    if (_old_table._entries != nullptr) {
+        migrate(_old_table._mask + 1);
+    }
+
+    table next;
+    uint32_t bits = 64 - _table._shift + 1;
+    if (_table._entries == nullptr) {
+        bits = INITIAL_BITS;
+    }
+
+    if (!table_init(next, bits))
+        return;
+
+    _old_table = _table;
+    _table = next;
+    _migrate_pos = 0;
+
+    if (_old_table._entries == nullptr) {
+        _old_table._mask = 0;
+        _old_table._shift = 0;
+    }
+}
+
+void block_index::migrate(uint32_t count)
+{
+    if (_old_table._entries == nullptr)
+        return;
+
+    for (uint32_t i = 0; i < count && _migrate_pos <= _old_table._mask; i++, _migrate_pos++) {
+        entry* e = &_old_table._entries[_migrate_pos];
+        if (e->_block != nullptr) {
+            table_insert(_table, e->_key, hash((const void*)e->_key), e->_block);
+            e->_block = nullptr; /// 保留键，查找时可以继续探测
+        }
+    }
+
+    if (_migrate_pos > _old_table._mask) {
+        table_free(_old_table);
+        _migrate_pos = 0;
+    }
+}
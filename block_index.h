@@ -0,0 +1,81 @@
+#pragma once
+#include <stdint.h>
+
+struct memory_block;
+
+/// 以完整指针为键的开放寻址索引(robin hood)
+/// 扩容时新旧两张表并存，每次操作迁移一小段，不会一次性停顿
+class block_index
+{
+public:
+    block_index();
+
+    ~block_index();
+
+    static uint64_t hash(const void* ptr);
+
+    memory_block* find(const void* ptr);
+
+    bool insert(const void* ptr, memory_block* block); /// 调用者保证ptr不在表里，不检查重复
+
+    memory_block* erase(const void* ptr);
+
+    uint32_t size() const { return _count; }
+
+    template<class F>
+    void for_each(F func)
+    {
+        for (uint32_t i = 0; i <= _table._mask; i++) {
+            if (_table._entries[i]._key != 0) {
+                func(_table._entries[i]._block);
+            }
+        }
+
+        for (uint32_t i = _migrate_pos; _old_table._entries != nullptr && i <= _old_table._mask; i++) {
+            if (_old_table._entries[i]._block != nullptr) {
+                func(_old_table._entries[i]._block);
+            }
+        }
+    }
+private:
+    struct entry
+    {
+        uintptr_t _key; /// 0表示空位
+
+        memory_block* _block; /// 旧表中为nullptr表示已迁移或已删除
+    };
+
+    struct table
+    {
+        entry* _entries;
+
+        uint32_t _mask;
+
+        uint32_t _shift;
+    };
+
+    static bool table_init(table& t, uint32_t bits);
+
+    static void table_free(table& t);
+
+    static entry* table_find(const table& t, uintptr_t key, uint64_t h);
+
+    static void table_insert(table& t, uintptr_t key, uint64_t h, memory_block* block);
+
+    static void table_erase(table& t, entry* e);
+
+    void grow();
+
+    void migrate(uint32_t count);
+
+    table _table;
+
+    table _old_table; /// 正在迁移的旧表
+
+    uint32_t _migrate_pos;
+
+    uint32_t _count;
+private:
+    block_index(const block_index&);
+    block_index& operator=(const block_index&);
+};
@@ -0,0 +1,243 @@
+#include <new>
+#include "block_pool.h"
+#include "memory_watcher.h"
+#include "virtual_memory.h"
+
+#define SLAB_SIZE (64 * 1024) /// 每次向系统申请的大小
+
+static block_pool* _the_pool = nullptr;
+
+struct block_thread_cache
+{
+    block_magazine* _loaded;
+
+    block_magazine* _previous;
+
+    bool _registered;
+};
+
+static __declspec(thread) block_thread_cache _thread_cache;
+
+block_pool::block_pool()
+{
+    InitializeCriticalSectionAndSpinCount(&_mutex, 100);
+    _full_magazines = nullptr;
+    _empty_magazines = nullptr;
+    _chunks = nullptr;
+    _magazine_arena = nullptr;
+    _magazine_arena_left = 0;
+    _block_count = 0;
+    _shutdown = false;
+
+    _the_pool = this;
+    _fls_index = FlsAlloc(on_thread_exit);
+}
+
+block_pool::~block_pool()
+{
+    _shutdown = true;
+    if (_fls_index != FLS_OUT_OF_INDEXES) {
+        FlsFree(_fls_index);
+    }
+
+    while (_chunks != nullptr) {
+        chunk* next = _chunks->_next;
+        virtual_free(_chunks, _chunks->_size);
+        _chunks = next;
+    }
+
+    _the_pool = nullptr;
+    DeleteCriticalSection(&_mutex);
+}
+
+block_thread_cache* block_pool::get_thread_cache()
+{
+    return &_thread_cache;
+}
+
+memory_block* block_pool::alloc()
+{
+    block_thread_cache* cache = get_thread_cache();
+
+    block_magazine* loaded = cache->_loaded;
+    if (loaded != nullptr && loaded->_count > 0)
+        return loaded->_blocks[--loaded->_count];
+
+    block_magazine* previous = cache->_previous;
+    if (previous != nullptr && previous->_count > 0) {
+        cache->_loaded = previous;
+        cache->_previous = loaded;
+        return previous->_blocks[--previous->_count];
+    }
+
+    /// 两个弹匣都空了，从仓库换一个满的
+    register_thread(cache);
+
+    EnterCriticalSection(&_mutex);
+    if (_full_magazines == nullptr) {
+        grow_blocks();
+    }
+
+    block_magazine* full = _full_magazines;
+    if (full != nullptr) {
+        _full_magazines = full->_next;
+
+        if (previous != nullptr) {
+            previous->_next = _empty_magazines;
+            _empty_magazines = previous;
+        }
+
+        cache->_previous = loaded;
+        cache->_loaded = full;
+    }
+    LeaveCriticalSection(&_mutex);
+
+    if (full == nullptr)
+        return nullptr;
+
+    return full->_blocks[--full->_count];
+}
+
+void block_pool::free(memory_block* block)
+{
+    block_thread_cache* cache = get_thread_cache();
+
+    block_magazine* loaded = cache->_loaded;
+    if (loaded != nullptr && loaded->_count < MAGAZINE_SIZE) {
+        loaded->_blocks[loaded->_count++] = block;
+        return;
+    }
+
+    block_magazine* previous = cache->_previous;
+    if (previous != nullptr && previous->_count < MAGAZINE_SIZE) {
+        cache->_loaded = previous;
+        cache->_previous = loaded;
+        previous->_blocks[previous->_count++] = block;
+        return;
+    }
+
+    /// 两个弹匣都满了，把一个满的交给仓库，换一个空的
+    register_thread(cache);
+
+    EnterCriticalSection(&_mutex);
+    block_magazine* empty = _empty_magazines;
+    if (empty != nullptr) {
+        _empty_magazines = empty->_next;
+    } else {
+        empty = new_magazine();
+    }
+
+    if (empty != nullptr) {
+        if (previous != nullptr) {
+            previous->_next = _full_magazines;
+            _full_magazines = previous;
+        }
+
+        cache->_previous = loaded;
+        cache->_loaded = empty;
+    }
+    LeaveCriticalSection(&_mutex);
+
+    /// 系统内存耗尽，只能丢弃这条记录
+    if (empty == nullptr)
+        return;
+
+    empty->_blocks[empty->_count++] = block;
+}
+
+void block_pool::register_thread(block_thread_cache* cache)
+{
+    if (!cache->_registered && _fls_index != FLS_OUT_OF_INDEXES) {
+        cache->_registered = true;
+        FlsSetValue(_fls_index, cache);
+    }
+}
+
+void WINAPI block_pool::on_thread_exit(PVOID data)
+{
+    block_pool* pool = _the_pool;
+    block_thread_cache* cache = (block_thread_cache*)data;
+    if (pool == nullptr || pool->_shutdown || cache == nullptr)
+        return;
+
+    /// 线程退出时把弹匣还给仓库
+    EnterCriticalSection(&pool->_mutex);
+    block_magazine* magazines[2] = { cache->_loaded, cache->_previous };
+    for (auto magazine : magazines) {
+        if (magazine == nullptr)
+            continue;
+
+        if (magazine->_count > 0) {
+            magazine->_next = pool->_full_magazines;
+            pool->_full_magazines = magazine;
+        } else {
+            magazine->_next = pool->_empty_magazines;
+            pool->_empty_magazines = magazine;
+        }
+    }
+    LeaveCriticalSection(&pool->_mutex);
+
+    cache->_loaded = nullptr;
+    cache->_previous = nullptr;
+    cache->_registered = false;
+}
+
+bool block_pool::grow_blocks()
+{
+    memory_block* blocks = (memory_block*)alloc_chunk(SLAB_SIZE);
+    if (blocks == nullptr)
+        return false;
+
+    size_t count = (SLAB_SIZE - sizeof(chunk)) / sizeof(memory_block);
+    _block_count += (uint32_t)count;
+
+    /// 把新的slab切分装进弹匣
+    block_magazine* magazine = nullptr;
+    for (size_t i = 0; i < count; i++) {
+        if (magazine == nullptr || magazine->_count == MAGAZINE_SIZE) {
+            magazine = new_magazine();
+            if (magazine == nullptr)
+                break;
+
+            magazine->_next = _full_magazines;
+            _full_magazines = magazine;
+        }
+
+        magazine->_blocks[magazine->_count++] = new (blocks + i) memory_block;
+    }
+
+    return true;
+}
+
+block_magazine* block_pool::new_magazine()
+{
+    if (_magazine_arena_left < sizeof(block_magazine)) {
+        _magazine_arena = (uint8_t*)alloc_chunk(SLAB_SIZE);
+        if (_magazine_arena == nullptr) {
+            _magazine_arena_left = 0;
+            return nullptr;
+        }
+
+        _magazine_arena_left = SLAB_SIZE - sizeof(chunk);
+    }
+
+    block_magazine* magazine = (block_magazine*)_magazine_arena;
+    _magazine_arena += sizeof(block_magazine);
+    _magazine_arena_left -= sizeof(block_magazine);
+
+    magazine->_next = nullptr;
+    magazine->_count = 0;
+    return magazine;
+}
+
+void* block_pool::alloc_chunk(size_t size)
+{
+    chunk* header = (chunk*)virtual_alloc(size);
+    if (header == nullptr)
+        return nullptr;
+
+    header->_size = size;
+    header->_next = _chunks;
+    _chunks = header;
+    return header + 1;
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <stdint.h>
+#include "platform.h"
+
+struct memory_block;
+
+struct block_thread_cache;
+
+#define MAGAZINE_SIZE 64 /// 每个弹匣容纳的记录数
+
+struct block_magazine
+{
+    block_magazine* _next;
+
+    uint32_t _count;
+
+    memory_block* _blocks[MAGAZINE_SIZE];
+};
+
+/// memory_block的slab分配器，内存直接向系统申请，不够时增长
+/// 每个线程持有两个弹匣，常见情况下分配和释放都不加锁，只在弹匣空或满时和仓库交换
+/// 线程缓存是全局的，进程内只应有一个实例
+class block_pool
+{
+public:
+    block_pool();
+
+    ~block_pool();
+
+    memory_block* alloc();
+
+    void free(memory_block* block);
+
+    uint32_t block_count() const { return _block_count; } /// 已经从系统申请的记录数
+private:
+    struct chunk
+    {
+        chunk* _next;
+
+        size_t _size;
+    };
+
+    static block_thread_cache* get_thread_cache();
+
+    static void WINAPI on_thread_exit(PVOID data);
+
+    void register_thread(block_thread_cache* cache);
+
+    bool grow_blocks();
+
+    block_magazine* new_magazine();
+
+    void* alloc_chunk(size_t size);
+
+    CRITICAL_SECTION _mutex; /// 保护下面的仓库
+
+    block_magazine* _full_magazines; /// 非空的弹匣
+
+    block_magazine* _empty_magazines;
+
+    chunk* _chunks;
+
+    uint8_t* _magazine_arena;
+
+    size_t _magazine_arena_left;
+
+    uint32_t _block_count;
+
+    DWORD _fls_index; /// 只用来在线程退出时归还弹匣
+
+    volatile bool _shutdown;
+private:
+    block_pool(const block_pool&);
+    block_pool& operator=(const block_pool&);
+};
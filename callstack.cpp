@@ -23,13 +23,25 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include <cassert>
-#include <windows.h>
 #include <stdio.h>
+#include "platform.h"
 #include "callstack.h"  // This class' header.
+#ifdef _WIN32
 #include "dbghelpapi.h" // Provides symbol handling services.
+#else
+#include <cxxabi.h>     // Provides __cxa_demangle() for function names.
+#include <stdlib.h>     // Provides free() for the demangled names.
+#include <dlfcn.h>      // Provides dladdr() for symbol lookup.
+#include <execinfo.h>   // Provides backtrace() for stack walking.
+#include <link.h>       // Provides ElfW(Sym) for the sizes of functions.
+#include <pthread.h>    // Provides pthread_getattr_np() for the stack bounds.
+#include "unwind_cache.h" // Provides the cached unwind rules.
+#endif
 
 #define MAXSYMBOLNAMELENGTH 256
 
+#ifdef _WIN32
+
 // Imported global variables.
 #define currentprocess GetCurrentProcess()
 #define currentthread  GetCurrentThread()
@@ -43,6 +55,9 @@
 #define SPREG Esp
 
 #define FRAMEPOINTER(fp) __asm mov fp, BPREG // Copies the current frame pointer to the supplied variable.
+#else
+#define FRAMEPOINTER(fp) fp = (SIZE_T*)__builtin_frame_address(0)
+#endif // _WIN32
 
 #define MAXREPORTLENGTH 511 
 
@@ -54,7 +69,11 @@ VOID report(LPCWSTR format, ...)
     WCHAR   messagew[MAXREPORTLENGTH + 1];
 
     va_start(args, format);
+#ifdef _WIN32
     _vsnwprintf_s(messagew, MAXREPORTLENGTH + 1, _TRUNCATE, format, args);
+#else
+    vswprintf(messagew, MAXREPORTLENGTH + 1, format, args);
+#endif
     va_end(args);
     messagew[MAXREPORTLENGTH] = L'\0';
 
@@ -95,7 +114,7 @@ CallStack::~CallStack ()
 //
 SIZE_T CallStack::operator [] (UINT32 index) const
 {
-    return m_frames[index % CALLSTACKCHUNKSIZE];
+    return m_frames[index % CALLSTACKMAXDEPTH];
 }
 
 // clear - Resets the CallStack, returning it to a state where no frames have
@@ -124,13 +143,15 @@ VOID CallStack::clear ()
 //     Library which is single-threaded. Therefore, calls to this function must
 //     be synchronized.
 //
-//  - showinternalframes (IN): If true, then all frames in the CallStack will be
-//      dumped. Otherwise, frames internal to the heap will not be dumped.
+//  - showinternalframes (IN): Unused. Frames internal to the heap are left out
+//      when the stack is captured (see addskiprange), so every frame in the
+//      CallStack is dumped.
 //
 //  Return Value:
 //
 //    None.
 //
+#ifdef _WIN32
 VOID CallStack::dump(BOOL showinternalframes) const
 {
     DWORD            displacement;
@@ -148,6 +169,7 @@ VOID CallStack::dump(BOOL showinternalframes) const
     functioninfo->SizeOfStruct = sizeof(SYMBOL_INFO);
     functioninfo->MaxNameLen = MAXSYMBOLNAMELENGTH;
     sourceinfo.SizeOfStruct = sizeof(IMAGEHLP_LINE64);
+    (void)showinternalframes;
 
     // Iterate through each frame in the call stack.
     OutputDebugStringW(L"\n");
@@ -155,19 +177,7 @@ VOID CallStack::dump(BOOL showinternalframes) const
         // Try to get the source file and line number associated with
         // this program counter address.
         programcounter = (*this)[frame];
-        if ((foundline = pSymGetLineFromAddrW64(currentprocess, programcounter, &displacement, &sourceinfo)) == TRUE) {
-            if (!showinternalframes) {
-                _wcslwr_s(sourceinfo.FileName, wcslen(sourceinfo.FileName) + 1);
-                if (wcsstr(sourceinfo.FileName, L"afxmem.cpp") ||
-                    wcsstr(sourceinfo.FileName, L"dbgheap.c") ||
-                    wcsstr(sourceinfo.FileName, L"malloc.c") ||
-                    wcsstr(sourceinfo.FileName, L"new.cpp") ||
-                    wcsstr(sourceinfo.FileName, L"newaop.cpp")) {
-                    // Don't show frames in files internal to the heap.
-                    continue;
-                }
-            }
-        }
+        foundline = pSymGetLineFromAddrW64(currentprocess, programcounter, &displacement, &sourceinfo);
 
         // Try to get the name of the function containing this program
         // counter address.
@@ -189,12 +199,273 @@ VOID CallStack::dump(BOOL showinternalframes) const
     }
     OutputDebugStringW(L"\n");
 }
+#else
+VOID CallStack::dump(BOOL showinternalframes) const
+{
+    CHAR             buffer [MAXREPORTLENGTH + 1];
+    UINT32           frame;
+    Dl_info          info;
+    SIZE_T           programcounter;
+
+    // Without the Debug Help Library, symbols come from the dynamic symbol
+    // tables only. Frames in executables built without -rdynamic will show the
+    // module and offset instead of a function name.
+    (void)showinternalframes;
+
+    OutputDebugStringW(L"\n");
+    for (frame = 0; frame < m_size; frame++) {
+        programcounter = (*this)[frame];
+        if (dladdr((void*)programcounter, &info) && info.dli_sname != NULL) {
+            snprintf(buffer, sizeof(buffer), "    %p %s (%s+0x%lx)\n", (void*)programcounter,
+                     info.dli_fname, info.dli_sname, (unsigned long)(programcounter - (SIZE_T)info.dli_saddr));
+        }
+        else if (info.dli_fname != NULL) {
+            snprintf(buffer, sizeof(buffer), "    %p %s (+0x%lx) (Function name unavailable)\n", (void*)programcounter,
+                     info.dli_fname, (unsigned long)(programcounter - (SIZE_T)info.dli_fbase));
+        }
+        else {
+            snprintf(buffer, sizeof(buffer), "    %p (Function name unavailable)\n", (void*)programcounter);
+        }
+        OutputDebugStringA(buffer);
+    }
+    OutputDebugStringW(L"\n");
+}
+#endif // _WIN32
+
+// getfunctionname - Looks up the name of the function containing a program
+//   counter address. C++ names are returned demangled, as they would appear
+//   in a dumped CallStack.
+//
+//   Note: On Windows the symbol handler must be initialized prior to calling
+//     this function, and calls must be synchronized, just like dump.
+//
+//  - programcounter (IN): The program counter address to look up.
+//
+//  - name (OUT): Receives the function name, truncated to fit.
+//
+//  - size (IN): Size of the name buffer, in characters.
+//
+//  Return Value:
+//
+//    Returns TRUE if a function name was found, FALSE otherwise.
+//
+#ifdef _WIN32
+BOOL getfunctionname (SIZE_T programcounter, CHAR *name, SIZE_T size)
+{
+    DWORD64          displacement64;
+    SYMBOL_INFO     *functioninfo;
+    BYTE             symbolbuffer [sizeof(SYMBOL_INFO) + (MAXSYMBOLNAMELENGTH * sizeof(WCHAR)) - 1] = { 0 };
+
+    functioninfo = (SYMBOL_INFO*)&symbolbuffer;
+    functioninfo->SizeOfStruct = sizeof(SYMBOL_INFO);
+    functioninfo->MaxNameLen = MAXSYMBOLNAMELENGTH;
+
+    if (size == 0 || !pSymFromAddrW(currentprocess, programcounter, &displacement64, functioninfo)) {
+        return FALSE;
+    }
+
+    if (WideCharToMultiByte(CP_ACP, 0, functioninfo->Name, -1, name, (int)size, NULL, NULL) == 0) {
+        // The name did not fit; keep what was converted.
+        name[size - 1] = '\0';
+    }
+    return TRUE;
+}
+#else
+BOOL getfunctionname (SIZE_T programcounter, CHAR *name, SIZE_T size)
+{
+    CHAR            *demangled;
+    Dl_info          info;
+    int              status;
+
+    if (size == 0 || !dladdr((void*)programcounter, &info) || info.dli_sname == NULL) {
+        return FALSE;
+    }
+
+    // The demangler allocates with malloc. Callers are inside the watcher, so
+    // the allocation is not recorded.
+    demangled = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+    snprintf(name, size, "%s", (status == 0 && demangled != NULL) ? demangled : info.dli_sname);
+    free(demangled);
+    return TRUE;
+}
+#endif // _WIN32
+
+// The skip list. Ranges are kept sorted by start address and never overlap, so
+// a frame is checked with a binary search. The list is only modified before the
+// heap functions are hooked, so the walkers read it without a lock.
+struct skiprange
+{
+    SIZE_T start;
+    SIZE_T end;
+};
+
+static skiprange skipranges [CALLSTACKMAXSKIPRANGES];
+static UINT32    skipcount;
+
+// addskiprange - Adds an address range to the skip list. Frames whose program
+//   counter falls inside the range will not be stored by the stack walkers.
+//   Overlapping or adjacent ranges are merged.
+//
+//  - start (IN): The first address of the range.
+//
+//  - end (IN): The address just past the end of the range.
+//
+//  Return Value:
+//
+//    Returns TRUE if the range was added, FALSE if the range is empty or the
+//    list is full.
+//
+BOOL addskiprange (SIZE_T start, SIZE_T end)
+{
+    UINT32 first;
+    UINT32 last;
+    UINT32 index;
+
+    if (start >= end) {
+        return FALSE;
+    }
+
+    // Find the ranges that overlap or touch the new one.
+    for (first = 0; (first < skipcount) && (skipranges[first].end < start); first++);
+    for (last = first; (last < skipcount) && (skipranges[last].start <= end); last++);
+
+    if (first < last) {
+        // Merge them all into the first one.
+        if (skipranges[first].start < start) {
+            start = skipranges[first].start;
+        }
+        if (skipranges[last - 1].end > end) {
+            end = skipranges[last - 1].end;
+        }
+        skipranges[first].start = start;
+        skipranges[first].end   = end;
+        for (index = last; index < skipcount; index++) {
+            skipranges[index - (last - first - 1)] = skipranges[index];
+        }
+        skipcount -= last - first - 1;
+        return TRUE;
+    }
+
+    if (skipcount == CALLSTACKMAXSKIPRANGES) {
+        return FALSE;
+    }
+
+    for (index = skipcount; index > first; index--) {
+        skipranges[index] = skipranges[index - 1];
+    }
+    skipranges[first].start = start;
+    skipranges[first].end   = end;
+    skipcount++;
+    return TRUE;
+}
+
+// skipframe - Checks whether a frame should be left out of the CallStack.
+//
+//  - programcounter (IN): The return address of the frame. The call
+//      instruction that pushed it lies just below, so the address itself may
+//      be one past the end of the calling function.
+//
+//  Return Value:
+//
+//    Returns TRUE if the frame is in the skip list, FALSE otherwise.
+//
+static inline BOOL skipframe (SIZE_T programcounter)
+{
+    UINT32 high = skipcount;
+    UINT32 low = 0;
+    UINT32 middle;
+
+    programcounter--;
+    while (low < high) {
+        middle = (low + high) / 2;
+        if (skipranges[middle].start <= programcounter) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    return (low > 0) && (programcounter < skipranges[low - 1].end);
+}
+
+// addskipfunction - Adds the function containing a program counter address to
+//   the skip list. The extent of the function comes from the symbol tables.
+//
+//   Note: On Windows the symbol handler must be initialized prior to calling
+//     this function. On Linux only functions in the dynamic symbol tables can
+//     be found.
+//
+//  - programcounter (IN): Any address inside the function.
+//
+//  Return Value:
+//
+//    Returns TRUE if the function was found and added, FALSE otherwise.
+//
+#ifdef _WIN32
+BOOL addskipfunction (SIZE_T programcounter)
+{
+    DWORD64          displacement64;
+    SYMBOL_INFO     *functioninfo;
+    BYTE             symbolbuffer [sizeof(SYMBOL_INFO) + (MAXSYMBOLNAMELENGTH * sizeof(WCHAR)) - 1] = { 0 };
+
+    functioninfo = (SYMBOL_INFO*)&symbolbuffer;
+    functioninfo->SizeOfStruct = sizeof(SYMBOL_INFO);
+    functioninfo->MaxNameLen = MAXSYMBOLNAMELENGTH;
+
+    if (!pSymFromAddrW(currentprocess, programcounter, &displacement64, functioninfo) || (functioninfo->Size == 0)) {
+        return FALSE;
+    }
+    return addskiprange((SIZE_T)functioninfo->Address, (SIZE_T)(functioninfo->Address + functioninfo->Size));
+}
+
+// addskipsymbol - Adds a function to the skip list by name. Unlike
+//   addskipfunction, this also finds functions that are not exported, as long
+//   as the module's symbols are loaded.
+//
+//   Note: The symbol handler must be initialized prior to calling this
+//     function.
+//
+//  - name (IN): The function name, optionally qualified with the module name
+//      as in "msvcr110d!_heap_alloc_dbg".
+//
+//  Return Value:
+//
+//    Returns TRUE if the function was found and added, FALSE otherwise.
+//
+BOOL addskipsymbol (LPCWSTR name)
+{
+    SYMBOL_INFO     *functioninfo;
+    BYTE             symbolbuffer [sizeof(SYMBOL_INFO) + (MAXSYMBOLNAMELENGTH * sizeof(WCHAR)) - 1] = { 0 };
+
+    functioninfo = (SYMBOL_INFO*)&symbolbuffer;
+    functioninfo->SizeOfStruct = sizeof(SYMBOL_INFO);
+    functioninfo->MaxNameLen = MAXSYMBOLNAMELENGTH;
+
+    if (!pSymFromNameW(currentprocess, name, functioninfo) || (functioninfo->Size == 0)) {
+        return FALSE;
+    }
+    return addskiprange((SIZE_T)functioninfo->Address, (SIZE_T)(functioninfo->Address + functioninfo->Size));
+}
+#else
+BOOL addskipfunction (SIZE_T programcounter)
+{
+    Dl_info          info;
+    const ElfW(Sym) *symbol = NULL;
+
+    if (!dladdr1((void*)programcounter, &info, (void**)&symbol, RTLD_DL_SYMENT) ||
+        (symbol == NULL) || (symbol->st_size == 0) || (info.dli_saddr == NULL)) {
+        return FALSE;
+    }
+    return addskiprange((SIZE_T)info.dli_saddr, (SIZE_T)info.dli_saddr + symbol->st_size);
+}
+#endif // _WIN32
 
 // push_back - Pushes a frame's program counter onto the CallStack. Pushes are
-//   always appended to the back of the chunk list (aka the "top" chunk).
+//   always appended to the back of the frame array.
 //
-//   Note: This function will allocate additional memory as necessary to make
-//     room for new program counter addresses.
+//   Note: The CallStack holds at most CALLSTACKMAXDEPTH frames and never
+//     allocates memory. Frames pushed beyond that are dropped, so callers
+//     should not trace deeper than CALLSTACKMAXDEPTH frames.
 //
 //  - programcounter (IN): The program counter address of the frame to be pushed
 //      onto the CallStack.
@@ -205,11 +476,156 @@ VOID CallStack::dump(BOOL showinternalframes) const
 //
 VOID CallStack::push_back(const SIZE_T programcounter)
 {
-    if (m_size < CALLSTACKCHUNKSIZE) {
+    if (m_size < CALLSTACKMAXDEPTH) {
         m_frames[m_size++] = programcounter;
     }
 }
 
+// size - Retrieves the number of frames currently stored in the CallStack.
+//
+//  Return Value:
+//
+//    Returns the number of frames that have been pushed onto the CallStack.
+//
+UINT32 CallStack::size () const
+{
+    return m_size;
+}
+
+#ifdef _WIN32
+// getstackbounds - Retrieves the range of addresses occupied by the current
+//   thread's stack. Frame pointers are only followed while they stay inside
+//   this range, so walking a bogus frame can never touch an unmapped page.
+//
+//   Note: The bounds come straight from the thread information block. The
+//     lower bound is the current commit limit, which is always below any frame
+//     that is still live.
+//
+//  - low (OUT): Receives the lowest address of the stack.
+//
+//  - high (OUT): Receives the address just past the top of the stack.
+//
+//  Return Value:
+//
+//    None.
+//
+static VOID getstackbounds (SIZE_T *low, SIZE_T *high)
+{
+    NT_TIB *tib = (NT_TIB*)NtCurrentTeb();
+
+    *low  = (SIZE_T)tib->StackLimit;
+    *high = (SIZE_T)tib->StackBase;
+}
+#else
+static __declspec(thread) SIZE_T stacklow;  // Cached bounds of this thread's stack.
+static __declspec(thread) SIZE_T stackhigh; // Zero until the first query.
+
+// getstackbounds - Retrieves the range of addresses occupied by the current
+//   thread's stack. Frame pointers are only followed while they stay inside
+//   this range, so walking a bogus frame can never touch an unmapped page.
+//
+//   Note: pthread_getattr_np() is slow (for the main thread it parses
+//     /proc/self/maps), so it is called only once per thread and the result is
+//     cached in thread-local storage. It may allocate memory; it is only called
+//     from inside the hook layer, where nested allocations are not tracked. If
+//     the bounds can't be determined an empty range is cached, and every frame
+//     pointer will fail the range check.
+//
+//  - low (OUT): Receives the lowest address of the stack.
+//
+//  - high (OUT): Receives the address just past the top of the stack.
+//
+//  Return Value:
+//
+//    None.
+//
+static VOID getstackbounds (SIZE_T *low, SIZE_T *high)
+{
+    pthread_attr_t attr;
+    PVOID          stackaddr;
+    size_t         stacksize;
+
+    if (stackhigh == 0) {
+        stacklow  = (SIZE_T)-1;
+        stackhigh = (SIZE_T)-1;
+        if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+            if (pthread_attr_getstack(&attr, &stackaddr, &stacksize) == 0) {
+                stacklow  = (SIZE_T)stackaddr;
+                stackhigh = (SIZE_T)stackaddr + stacksize;
+            }
+            pthread_attr_destroy(&attr);
+        }
+    }
+
+    *low  = stacklow;
+    *high = stackhigh;
+}
+
+// pushbacktrace - Populates the CallStack using backtrace(), which unwinds with
+//   the compiler's unwind tables and so also walks frames built without frame
+//   pointers. Frames in the skip list are left out. The first call may load the unwinder library, which allocates
+//   memory; the hook layer makes one call during initialization so that this
+//   never happens from inside a hooked allocation.
+//
+//  - callstack (IN/OUT): The CallStack to populate.
+//
+//  - maxdepth (IN): Maximum number of frames to trace back.
+//
+//  Return Value:
+//
+//    None.
+//
+static VOID pushbacktrace (CallStack *callstack, UINT32 maxdepth)
+{
+    PVOID   frames [CALLSTACKMAXDEPTH + CALLSTACKSKIPSLACK];
+    int     count;
+    int     frame;
+    UINT32  stored = 0;
+
+    if (maxdepth > CALLSTACKMAXDEPTH) {
+        maxdepth = CALLSTACKMAXDEPTH;
+    }
+
+    // The first frames are the hook's own, so unwind a few more than needed
+    // to still fill maxdepth slots once they are skipped.
+    count = backtrace(frames, (int)(maxdepth + CALLSTACKSKIPSLACK));
+    for (frame = 0; (frame < count) && (stored < maxdepth); frame++) {
+        if (skipframe((SIZE_T)frames[frame])) {
+            continue;
+        }
+        stored++;
+        callstack->push_back((SIZE_T)frames[frame]);
+    }
+}
+#endif // _WIN32
+
+// validframe - Checks that a frame pointer may be followed: the two slots it
+//   addresses (the saved frame pointer and the return address) must both lie
+//   inside the stack, and it must be aligned to the size of a pointer. Nothing
+//   is read from the address, so this costs a couple of compares.
+//
+//  - framepointer (IN): The frame pointer to check.
+//
+//  - low (IN): Lowest address of the stack.
+//
+//  - high (IN): Address just past the top of the stack.
+//
+//  Return Value:
+//
+//    Returns TRUE if the frame pointer can safely be dereferenced.
+//
+static inline BOOL validframe (SIZE_T framepointer, SIZE_T low, SIZE_T high)
+{
+    if (framepointer & (sizeof(SIZE_T*) - 1)) {
+        // Frame pointer addresses should always be aligned to the size of a
+        // pointer. A misaligned one was probably loaded from a register used
+        // for something else by a frame built with frame pointer omission
+        // (FPO) optimization turned on.
+        return FALSE;
+    }
+    return (framepointer >= low) && (framepointer < high) && (high - framepointer >= 2 * sizeof(SIZE_T));
+}
+
 // getstacktrace - Traces the stack as far back as possible, or until 'maxdepth'
 //   frames have been traced. Populates the CallStack with one entry for each
 //   stack frame traced.
@@ -220,6 +636,12 @@ VOID CallStack::push_back(const SIZE_T programcounter)
 //     will not be successfully walked by this function and will cause the
 //     stack trace to terminate prematurely.
 //
+//   Note: Each frame pointer is validated against the cached bounds of the
+//     thread's stack instead of being probed with IsBadReadPtr(), so no system
+//     call or exception handling is involved. The saved frame pointers must
+//     also strictly increase, which guarantees that the walk terminates. When
+//     an invalid frame is found the frames traced so far are kept.
+//
 //  - maxdepth (IN): Maximum number of frames to trace back.
 //
 //  - framepointer (IN): Frame (base) pointer at which to begin the stack trace.
@@ -232,6 +654,10 @@ VOID CallStack::push_back(const SIZE_T programcounter)
 VOID FastCallStack::getstacktrace (UINT32 maxdepth, SIZE_T *framepointer)
 {
     UINT32  count = 0;
+    SIZE_T  high;
+    SIZE_T  low;
+    SIZE_T *next;
+    SIZE_T  skipped = 0;
 
     if (framepointer == NULL) {
         // Begin the stack trace with the current frame. Obtain the current
@@ -239,39 +665,53 @@ VOID FastCallStack::getstacktrace (UINT32 maxdepth, SIZE_T *framepointer)
         FRAMEPOINTER(framepointer);
     }
 
+    getstackbounds(&low, &high);
+    if (!validframe((SIZE_T)framepointer, low, high)) {
+#ifndef _WIN32
+        // Not on the thread's normal stack (e.g. running on an alternate
+        // signal stack), or the bounds are unknown. Fall back to the unwinder.
+        pushbacktrace(this, maxdepth);
+#endif // _WIN32
+        return;
+    }
+
     while (count < maxdepth) {
-        if ((SIZE_T*)*framepointer < framepointer) {
-            if ((SIZE_T*)*framepointer == NULL) {
-                // Looks like we reached the end of the stack.
-                break;
-            }
-            else {
-                // Invalid frame pointer. Frame pointer addresses should always
-                // increase as we move up the stack.
-                m_size = 0;
-                break;
-            }
+        if (*(framepointer + 1) == 0) {
+            // No return address. Looks like we reached the end of the stack.
+            break;
         }
-        if ((SIZE_T)*framepointer & (sizeof(SIZE_T*) - 1)) {
-            // Invalid frame pointer. Frame pointer addresses should always
-            // be aligned to the size of a pointer. This probably means that
-            // we've encountered a frame that was created by a module built with
-            // frame pointer omission (FPO) optimization turned on.
-            m_size = 0;
+        if (!skipframe(*(framepointer + 1))) {
+            count++;
+            push_back(*(framepointer + 1));
+        }
+        else {
+            skipped = *(framepointer + 1);
+        }
+
+        next = (SIZE_T*)*framepointer;
+        if (next <= framepointer) {
+            // Either the end of the stack (NULL), or an invalid frame pointer.
+            // Frame pointer addresses should always increase as we move up the
+            // stack.
             break;
         }
-        if (IsBadReadPtr((SIZE_T*)*framepointer, sizeof(SIZE_T*))) {
-            // Bogus frame pointer. Again, this probably means that we've
-            // encountered a frame built with FPO optimization.
-            m_size = 0;
+        if (!validframe((SIZE_T)next, low, high)) {
+            // Bogus frame pointer. This probably means that we've encountered
+            // a frame built with FPO optimization.
             break;
         }
-        count++;
-        push_back(*(framepointer + 1));
-        framepointer = (SIZE_T*)*framepointer;
+        framepointer = next;
+    }
+
+    if ((count == 0) && (skipped != 0)) {
+        // The walk ended inside an allocator wrapper built without frame
+        // pointers. Its frame is still better than an empty stack.
+        push_back(skipped);
     }
 }
 
+#ifdef _WIN32
+
 // getstacktrace - Traces the stack as far back as possible, or until 'maxdepth'
 //   frames have been traced. Populates the CallStack with one entry for each
 //   stack frame traced.
@@ -333,7 +773,6 @@ VOID SafeCallStack::getstacktrace (UINT32 maxdepth, SIZE_T *framepointer)
 
     // Walk the stack.
     while (count < maxdepth) {
-        count++;
         if (!pStackWalk64(architecture, currentprocess, currentthread, &frame, &context, NULL,
                           pSymFunctionTableAccess64, pSymGetModuleBase64, NULL)) {
             // Couldn't trace back through any more frames.
@@ -343,8 +782,121 @@ VOID SafeCallStack::getstacktrace (UINT32 maxdepth, SIZE_T *framepointer)
             // End of stack.
             break;
         }
+        if (skipframe((SIZE_T)frame.AddrPC.Offset)) {
+            // A hook function or an allocator wrapper. Doesn't use up a slot.
+            continue;
+        }
 
         // Push this frame's program counter onto the CallStack.
+        count++;
         push_back((SIZE_T)frame.AddrPC.Offset);
     }
 }
+
+#else
+// getstacktrace - Traces the stack as far back as possible, or until 'maxdepth'
+//   frames have been traced. Populates the CallStack with one entry for each
+//   stack frame traced.
+//
+//   Note: On Linux this walker uses backtrace(). It is slower than following
+//     frame pointers, but also walks frames built without them.
+//
+//  - maxdepth (IN): Maximum number of frames to trace back.
+//
+//  - framepointer (IN): Ignored. The trace always begins at this function.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID SafeCallStack::getstacktrace (UINT32 maxdepth, SIZE_T *framepointer)
+{
+    (void)framepointer;
+    pushbacktrace(this, maxdepth);
+}
+
+// getstacktrace - Traces the stack as far back as possible, or until 'maxdepth'
+//   frames have been traced. Populates the CallStack with one entry for each
+//   stack frame traced.
+//
+//   Note: Each frame is unwound with the rule from the unwind tables for its
+//     return address: the canonical frame address (CFA) is the stack pointer
+//     or the frame pointer plus an offset, the return address is stored just
+//     below the CFA, and the caller's frame pointer is either unchanged or
+//     saved at a fixed slot below the CFA. The rules are looked up from a
+//     cache, so a frame normally costs one cache load plus the loads from the
+//     stack. Every address read is checked against the thread's stack bounds
+//     first. Frames without a usable rule (no unwind information, signal
+//     frames, realigned stacks) end the trace.
+//
+//  - maxdepth (IN): Maximum number of frames to trace back.
+//
+//  - framepointer (IN): Frame (base) pointer at which to begin the stack trace.
+//      This frame must have been built with a frame pointer. If NULL, then the
+//      stack trace will begin at this function.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID CachedCallStack::getstacktrace (UINT32 maxdepth, SIZE_T *framepointer)
+{
+    SIZE_T  basepointer;
+    SIZE_T  cfa;
+    UINT32  count = 0;
+    SIZE_T  high;
+    SIZE_T  low;
+    SIZE_T  programcounter;
+    UINT32  rule;
+    UINT32  slot;
+    SIZE_T  stackpointer;
+
+    if (framepointer == NULL) {
+        // Begin the stack trace with the current frame. Obtain the current
+        // frame pointer.
+        FRAMEPOINTER(framepointer);
+    }
+
+    getstackbounds(&low, &high);
+    if (!validframe((SIZE_T)framepointer, low, high)) {
+        pushbacktrace(this, maxdepth);
+        return;
+    }
+
+    // The first frame has a frame pointer, so the caller's registers can be
+    // recovered without a rule.
+    programcounter = *(framepointer + 1);
+    stackpointer   = (SIZE_T)(framepointer + 2);
+    basepointer    = *framepointer;
+
+    while ((count < maxdepth) && (programcounter != 0)) {
+        if (!skipframe(programcounter)) {
+            count++;
+            push_back(programcounter);
+        }
+
+        rule = unwind_cache_rule(programcounter);
+        if (rule == UNWIND_RULE_END) {
+            break;
+        }
+
+        cfa = ((rule & UNWIND_RULE_CFA_BP) ? basepointer : stackpointer) + (rule & UNWIND_RULE_OFFSET_MASK);
+        if ((cfa <= stackpointer) || (cfa > high) || (cfa & (sizeof(SIZE_T) - 1))) {
+            // The CFA should always be above the current frame and inside the
+            // stack. Otherwise the frame pointer the rule is based on is bogus.
+            break;
+        }
+
+        slot = (rule >> UNWIND_RULE_BP_SHIFT) & UNWIND_RULE_BP_MASK;
+        if (slot != 0) {
+            if (cfa - stackpointer < slot * sizeof(SIZE_T)) {
+                break;
+            }
+            basepointer = *(SIZE_T*)(cfa - slot * sizeof(SIZE_T));
+        }
+
+        programcounter = *(SIZE_T*)(cfa - sizeof(SIZE_T));
+        stackpointer   = cfa;
+    }
+}
+#endif // _WIN32
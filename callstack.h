@@ -24,9 +24,13 @@
 
 #pragma once
 
-#include <windows.h>
+#include "platform.h"
 
-#define CALLSTACKCHUNKSIZE 16 // Number of frame slots in each CallStack chunk.
+#define CALLSTACKMAXDEPTH 128 // Maximum number of frames a CallStack can hold.
+#define CALLSTACKDEFAULTDEPTH 16 // Number of frames traced unless configured otherwise.
+#define MAXFUNCTIONNAMELENGTH 512 // Size of the buffer used for a single function name.
+#define CALLSTACKMAXSKIPRANGES 64 // Maximum number of address ranges in the skip list.
+#define CALLSTACKSKIPSLACK 16 // Extra frames unwound to make up for skipped ones.
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -39,13 +43,11 @@
 //    a STL vector, but is specifically tailored for use by VLD, making it more
 //    efficient than a standard STL vector.
 //
-//    Inside the CallStack are a number of "chunks" which are arranged in a
-//    linked list. Each chunk contains an array of frames (each frame is
-//    represented by a program counter address). If we run out of space when
-//    pushing new frames onto an existing chunk in the CallStack chunk list,
-//    then a new chunk is allocated and appended to the end of the list. In this
-//    way, the CallStack can grow dynamically as needed. New frames are always
-//    pushed onto the chunk at the end of the list known as the "top" chunk.
+//    Inside the CallStack is a fixed array of CALLSTACKMAXDEPTH frames (each
+//    frame is represented by a program counter address). CallStacks are only
+//    used as temporaries on the stack while capturing or dumping, so nothing
+//    is allocated; the stack table stores each unique stack in a compact
+//    encoding instead.
 //
 class CallStack
 {
@@ -59,8 +61,9 @@ public:
     virtual VOID getstacktrace (UINT32 maxdepth, SIZE_T *framepointer) = 0;
     SIZE_T operator [] (UINT32 index) const;
     VOID push_back (const SIZE_T programcounter);
+    UINT32 size () const;
 protected:
-    SIZE_T m_frames[CALLSTACKCHUNKSIZE];
+    SIZE_T m_frames[CALLSTACKMAXDEPTH];
     UINT32 m_size;     // Current size (in frames)
 
     CallStack(const CallStack&);
@@ -91,4 +94,42 @@ class SafeCallStack : public CallStack
 {
 public:
     VOID getstacktrace (UINT32 maxdepth, SIZE_T *framepointer);
-};
\ No newline at end of file
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Symbol Helpers
+//
+//    getfunctionname looks up the name of the function containing a program
+//    counter address, for reports that match frames by function name.
+//
+//    The skip list holds the address ranges of the hook functions and of known
+//    allocator wrappers. The stack walkers drop frames inside these ranges
+//    before storing them, so every stored frame belongs to the application.
+//    Ranges may only be added before the heap functions are hooked; the
+//    walkers read the list without a lock.
+//
+BOOL getfunctionname (SIZE_T programcounter, CHAR *name, SIZE_T size);
+BOOL addskiprange (SIZE_T start, SIZE_T end);
+BOOL addskipfunction (SIZE_T programcounter);
+#ifdef _WIN32
+BOOL addskipsymbol (LPCWSTR name);
+#endif // _WIN32
+
+#ifndef _WIN32
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The CachedCallStack Class
+//
+//    This class is a specialization of the CallStack class which walks the
+//    stack using the unwind tables (.eh_frame), so frames built without frame
+//    pointers are walked too. The unwind rule for each return address is
+//    computed only once and cached, so after warm-up it is nearly as fast as
+//    the FastCallStack.
+//
+class CachedCallStack : public CallStack
+{
+public:
+    VOID getstacktrace (UINT32 maxdepth, SIZE_T *framepointer);
+};
+#endif // _WIN32
\ No newline at end of file
@@ -22,6 +22,9 @@
 //
 ////////////////////////////////////////////////////////////////////////////////
 
+// The Debug Help Library only exists on Windows.
+#ifdef _WIN32
+
 #include "dbghelpapi.h"
 
 // Global function pointers for explicit dynamic linking with the Debug Help
@@ -33,6 +36,7 @@ ImageDirectoryEntryToDataEx_t  pImageDirectoryEntryToDataEx;
 StackWalk64_t                  pStackWalk64;
 SymCleanup_t                   pSymCleanup;
 SymFromAddrW_t                 pSymFromAddrW;
+SymFromNameW_t                 pSymFromNameW;
 SymFunctionTableAccess64_t     pSymFunctionTableAccess64;
 SymGetLineFromAddrW64_t        pSymGetLineFromAddrW64;
 SymGetModuleBase64_t           pSymGetModuleBase64;
@@ -90,6 +94,11 @@ BOOL link_debughelp_library()
         return FALSE;
     }
 
+    functionname = "SymFromNameW";
+    if ((pSymFromNameW = (SymFromNameW_t)GetProcAddress(m_dbghelp, functionname)) == NULL) {
+        return FALSE;
+    }
+
     functionname = "SymFunctionTableAccess64";
     if ((pSymFunctionTableAccess64 = (SymFunctionTableAccess64_t)GetProcAddress(m_dbghelp, functionname)) == NULL) {
         return FALSE;
@@ -132,3 +141,5 @@ BOOL link_debughelp_library()
 
     return TRUE;
 }
+
+#endif // _WIN32
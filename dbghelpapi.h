@@ -46,6 +46,7 @@ typedef BOOL(__stdcall *StackWalk64_t)(DWORD MachineType, HANDLE hProcess, HANDL
 typedef BOOL(__stdcall *SymCleanup_t) (HANDLE hProcess);
 typedef BOOL(__stdcall *SymFromAddrW_t) (HANDLE hProcess, DWORD64 Address, PDWORD64 Displacement,
     PSYMBOL_INFOW Symbol);
+typedef BOOL(__stdcall *SymFromNameW_t) (HANDLE hProcess, PCWSTR Name, PSYMBOL_INFOW Symbol);
 typedef PVOID(__stdcall *SymFunctionTableAccess64_t) (HANDLE hProcess, DWORD64 AddrBase);
 typedef BOOL(__stdcall *SymGetLineFromAddrW64_t) (HANDLE hProcess, DWORD64 qwAddr, PDWORD pdwDisplacement,
     PIMAGEHLP_LINEW64 Line64);
@@ -64,6 +65,7 @@ extern ImageDirectoryEntryToDataEx_t  pImageDirectoryEntryToDataEx;
 extern StackWalk64_t                  pStackWalk64;
 extern SymCleanup_t                   pSymCleanup;
 extern SymFromAddrW_t                 pSymFromAddrW;
+extern SymFromNameW_t                 pSymFromNameW;
 extern SymFunctionTableAccess64_t     pSymFunctionTableAccess64;
 extern SymGetLineFromAddrW64_t        pSymGetLineFromAddrW64;
 extern SymGetModuleBase64_t           pSymGetModuleBase64;
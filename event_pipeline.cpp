@@ -0,0 +1,301 @@
+#include <algorithm>
+#include "event_pipeline.h"
+#include "hook_state.h"
+#include "virtual_memory.h"
+
+static __declspec(thread) event_ring* _thread_ring;
+
+static __declspec(thread) bool _consumer_thread;
+
+event_pipeline::event_pipeline(memory_watcher* watcher) : _watcher(watcher)
+{
+    _rings = nullptr;
+    _thread = nullptr;
+    _stop = false;
+    _drain_count = 0;
+    _fls_index = FlsAlloc(on_thread_exit);
+
+    _batch = (memory_event*)virtual_alloc(sizeof(memory_event) * EVENT_BATCH_SIZE);
+    _batch_count = 0;
+    _pending = (pending_free*)virtual_alloc(sizeof(pending_free) * EVENT_PENDING_SIZE);
+    _pending_count = 0;
+    _pass = 0;
+}
+
+event_pipeline::~event_pipeline()
+{
+    stop();
+
+    if (_fls_index != FLS_OUT_OF_INDEXES) {
+        FlsFree(_fls_index);
+    }
+
+    while (_rings != nullptr) {
+        event_ring* next = _rings->_next;
+        virtual_free(_rings, sizeof(event_ring));
+        _rings = next;
+    }
+
+    virtual_free(_batch, sizeof(memory_event) * EVENT_BATCH_SIZE);
+    virtual_free(_pending, sizeof(pending_free) * EVENT_PENDING_SIZE);
+}
+
+bool event_pipeline::start()
+{
+    if (_batch == nullptr || _pending == nullptr)
+        return false;
+
+    _stop = false;
+    _thread = CreateThread(nullptr, 0, consumer_main, this, 0, nullptr);
+    return _thread != nullptr;
+}
+
+void event_pipeline::stop()
+{
+    if (_thread == nullptr)
+        return;
+
+    _stop = true;
+    WaitForSingleObject(_thread, INFINITE);
+    CloseHandle(_thread);
+    _thread = nullptr;
+}
+
+void event_pipeline::post(uint32_t op, void* ptr, size_t size, uint32_t stack_id, uint32_t kind, uint32_t front_size)
+{
+    event_ring* ring = _thread_ring;
+    if (ring == nullptr) {
+        ring = acquire_ring();
+    }
+
+    thread_stats* thread = _watcher->current_thread();
+    if (ring == nullptr) {
+        /// 申请不到队列，只能同步处理
+        if (op == EVENT_ALLOC) {
+            _watcher->on_memory_alloc(ptr, size, stack_id, kind, front_size, thread);
+        } else {
+            _watcher->on_memory_free(ptr, true, kind, size);
+        }
+        return;
+    }
+
+    LONG tail = ring->_tail;
+    while (tail - ReadAcquire(&ring->_head) >= EVENT_RING_SIZE) { /// 后台线程复制完槽位之后才能覆盖
+        /// 队列满，等待后台线程处理
+        ring->_stall_count++;
+        SwitchToThread();
+    }
+
+    memory_event& e = ring->_events[tail & (EVENT_RING_SIZE - 1)];
+    e._ptr = ptr;
+    e._size = size;
+    e._stack_id = stack_id;
+    e._thread = thread;
+    e._op = (uint8_t)op;
+    e._kind = (uint8_t)kind;
+    e._front_size = (uint16_t)front_size;
+    e._tsc = __rdtsc();
+
+    WriteRelease(&ring->_tail, tail + 1); /// 事件写完之后再发布
+}
+
+bool event_pipeline::is_consumer_thread()
+{
+    return _consumer_thread;
+}
+
+uint32_t event_pipeline::stall_count() const
+{
+    uint32_t count = 0;
+    for (event_ring* ring = _rings; ring != nullptr; ring = ring->_next) {
+        count += ring->_stall_count;
+    }
+    return count;
+}
+
+bool event_pipeline::find_alloc(void* ptr, size_t& size) const
+{
+    for (event_ring* ring = _rings; ring != nullptr; ring = ring->_next) {
+        LONG head = ReadAcquire(&ring->_head);
+        LONG tail = ReadAcquire(&ring->_tail);
+
+        /// 从新到旧找，先碰到free说明已经释放
+        for (LONG i = tail; i != head; i--) {
+            memory_event e = ring->_events[(i - 1) & (EVENT_RING_SIZE - 1)];
+            MemoryBarrier(); /// 复制完再检查head，acquire只约束后面的读，这里要完整的屏障
+
+            /// 后台线程取走之后槽位可能被所属线程重新写入，复制出来的事件不可信
+            if (ring->_head - i >= 0)
+                break;
+
+            if (e._ptr != ptr)
+                continue;
+
+            if (e._op != EVENT_ALLOC)
+                return false;
+
+            size = e._size;
+            return true;
+        }
+    }
+    return false;
+}
+
+void event_pipeline::flush()
+{
+    if (_thread == nullptr || _consumer_thread)
+        return;
+
+    /// 正在进行的一轮可能在调用之前就读过队列，要等下一轮完整结束
+    LONG start = _drain_count;
+    while (_drain_count - start < 2 && !_stop) {
+        SwitchToThread();
+    }
+}
+
+event_ring* event_pipeline::acquire_ring()
+{
+    /// 优先复用已退出线程的队列
+    event_ring* ring = _rings;
+    while (ring != nullptr) {
+        if (ring->_state == RING_FREE &&
+            InterlockedCompareExchange(&ring->_state, RING_ACTIVE, RING_FREE) == RING_FREE)
+            break;
+
+        ring = ring->_next;
+    }
+
+    if (ring == nullptr) {
+        ring = (event_ring*)virtual_alloc(sizeof(event_ring));
+        if (ring == nullptr)
+            return nullptr;
+
+        ring->_state = RING_ACTIVE;
+
+        event_ring* next;
+        do {
+            next = _rings;
+            ring->_next = next;
+        } while (InterlockedCompareExchangePointer((PVOID volatile*)&_rings, ring, next) != next);
+    }
+
+    ring->_tid = GetCurrentThreadId();
+    _thread_ring = ring;
+
+    if (_fls_index != FLS_OUT_OF_INDEXES) {
+        FlsSetValue(_fls_index, ring);
+    }
+
+    return ring;
+}
+
+void WINAPI event_pipeline::on_thread_exit(PVOID data)
+{
+    event_ring* ring = (event_ring*)data;
+    if (ring == nullptr)
+        return;
+
+    /// 剩下的事件由后台线程处理完之后再回收
+    if (ring->_tid == GetCurrentThreadId()) {
+        _thread_ring = nullptr;
+    }
+
+    InterlockedExchange(&ring->_state, RING_CLOSED);
+}
+
+DWORD WINAPI event_pipeline::consumer_main(LPVOID param)
+{
+    event_pipeline* pipeline = (event_pipeline*)param;
+    _consumer_thread = true;
+
+    auto_hook_depth depth; /// 后台线程只运行watcher内部代码，它的分配都不记录
+
+    while (!pipeline->_stop) {
+        if (pipeline->drain() == 0) {
+            Sleep(1);
+        }
+    }
+
+    /// 退出前处理掉所有事件，挂起的free也不再等待
+    pipeline->drain();
+    pipeline->_pass++;
+    pipeline->resolve_pending();
+    return 0;
+}
+
+uint32_t event_pipeline::drain()
+{
+    _pass++;
+
+    uint32_t total = 0;
+    for (event_ring* ring = _rings; ring != nullptr; ring = ring->_next) {
+        LONG state = ReadAcquire(&ring->_state); /// 先读状态，再读队列
+        LONG head = ring->_head;
+        LONG tail = ReadAcquire(&ring->_tail);
+
+        total += tail - head;
+        while (head != tail) {
+            if (_batch_count == EVENT_BATCH_SIZE) {
+                apply_batch();
+            }
+
+            _batch[_batch_count++] = ring->_events[head & (EVENT_RING_SIZE - 1)];
+            head++;
+        }
+
+        WriteRelease(&ring->_head, head); /// 复制完再让出槽位
+
+        if (state == RING_CLOSED && ReadAcquire(&ring->_tail) == head) {
+            InterlockedCompareExchange(&ring->_state, RING_FREE, RING_CLOSED);
+        }
+    }
+
+    apply_batch();
+    resolve_pending();
+    InterlockedIncrement(&_drain_count);
+    return total;
+}
+
+void event_pipeline::apply_batch()
+{
+    /// 按时间排序，尽量让不同线程的alloc排在对应的free之前
+    std::sort(_batch, _batch + _batch_count, [](const memory_event& a, const memory_event& b) {
+        return a._tsc < b._tsc;
+    });
+
+    for (uint32_t i = 0; i < _batch_count; i++) {
+        const memory_event& e = _batch[i];
+        if (e._op == EVENT_ALLOC) {
+            _watcher->on_memory_alloc(e._ptr, e._size, e._stack_id, e._kind, e._front_size, e._thread);
+        } else if (!_watcher->on_memory_free(e._ptr, false, e._kind, e._size, e._thread)) {
+            if (_pending_count < EVENT_PENDING_SIZE) {
+                _pending[_pending_count]._ptr = e._ptr;
+                _pending[_pending_count]._size = e._size;
+                _pending[_pending_count]._kind = e._kind;
+                _pending[_pending_count]._pass = _pass;
+                _pending[_pending_count]._thread = e._thread;
+                _pending_count++;
+            } else {
+                _watcher->on_memory_free(e._ptr, true, e._kind, e._size, e._thread);
+            }
+        }
+    }
+
+    _batch_count = 0;
+}
+
+void event_pipeline::resolve_pending()
+{
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < _pending_count; i++) {
+        const pending_free& p = _pending[i];
+        if (p._pass < _pass) {
+            /// 已经完整读过一轮所有队列，仍然找不到就不是记录过的块
+            _watcher->on_memory_free(p._ptr, true, p._kind, p._size, p._thread);
+        } else if (!_watcher->on_memory_free(p._ptr, false, p._kind, p._size, p._thread)) {
+            _pending[kept++] = p;
+        }
+    }
+
+    _pending_count = kept;
+}
@@ -0,0 +1,149 @@
+#pragma once
+#include <stdint.h>
+#include "platform.h"
+
+class memory_watcher;
+
+struct thread_stats;
+
+#define EVENT_RING_SIZE 1024 /// 每个线程的环形队列长度，必须是2的幂
+
+#define EVENT_BATCH_SIZE 4096 /// 后台线程每批处理的事件数
+
+#define EVENT_PENDING_SIZE (64 * 1024) /// 等待配对的free最多保留的数量
+
+enum event_ring_state
+{
+    RING_ACTIVE, /// 线程正在使用
+
+    RING_CLOSED, /// 线程已退出，可能还有未处理的事件
+
+    RING_FREE, /// 已经处理完，可以分给新线程
+};
+
+enum memory_event_op
+{
+    EVENT_ALLOC,
+
+    EVENT_FREE,
+};
+
+struct memory_event
+{
+    void* _ptr;
+
+    size_t _size; /// free事件是sized delete传入的大小
+
+    thread_stats* _thread; /// 发出事件的线程，后台线程把统计记到它名下
+
+    uint32_t _stack_id;
+
+    uint8_t _op;
+
+    uint8_t _kind; /// 见alloc_kind
+
+    uint16_t _front_size; /// alloc事件的前置保护区大小
+
+    uint64_t _tsc;
+};
+
+struct event_ring
+{
+    volatile LONG _head; /// 只由后台线程修改
+
+    uint8_t _padding0[60];
+
+    volatile LONG _tail; /// 只由所属线程修改
+
+    uint8_t _padding1[60];
+
+    event_ring* volatile _next; /// 所有队列串成链表，只增不减
+
+    DWORD _tid;
+
+    volatile LONG _state; /// 见event_ring_state
+
+    uint32_t _stall_count; /// 队列满时等待的次数
+
+    memory_event _events[EVENT_RING_SIZE];
+};
+
+/// 异步模式：挂钩函数只把事件写入本线程的单生产者单消费者队列，
+/// 由后台线程批量交给memory_watcher处理，统计不再占用分配线程的时间
+///
+/// free先于alloc到达（另一个线程分配后交给本线程释放，两条事件在不同队列里）时，
+/// 这个free先挂起，等下一轮完整地读完所有队列后再处理，分配事件一定已经可见
+/// 内存只在后台线程处理完free之后才真正释放，地址不会在事件处理前被复用
+///
+/// 队列满时分配线程让出时间片等待后台线程，不丢事件
+class event_pipeline
+{
+public:
+    event_pipeline(memory_watcher* watcher);
+
+    ~event_pipeline();
+
+    bool start();
+
+    void stop(); /// 处理完所有事件后返回
+
+    void post(uint32_t op, void* ptr, size_t size, uint32_t stack_id, uint32_t kind, uint32_t front_size = 0);
+
+    static bool is_consumer_thread(); /// 后台线程自己的分配同步处理
+
+    uint32_t stall_count() const;
+
+    bool find_alloc(void* ptr, size_t& size) const; /// 在还没取走的事件里找ptr的分配事件，之后又释放了时返回false
+
+    void flush(); /// 等后台线程处理完调用之前投递的所有事件
+private:
+    event_ring* acquire_ring();
+
+    static void WINAPI on_thread_exit(PVOID data);
+
+    static DWORD WINAPI consumer_main(LPVOID param);
+
+    uint32_t drain();
+
+    void apply_batch();
+
+    void resolve_pending();
+
+    memory_watcher* _watcher;
+
+    event_ring* volatile _rings;
+
+    DWORD _fls_index;
+
+    HANDLE _thread;
+
+    volatile bool _stop;
+
+    volatile LONG _drain_count; /// 后台线程处理完的轮数
+private:
+    struct pending_free
+    {
+        void* _ptr;
+
+        size_t _size;
+
+        uint16_t _kind;
+
+        uint32_t _pass;
+
+        thread_stats* _thread;
+    };
+
+    memory_event* _batch; /// 以下只由后台线程访问
+
+    uint32_t _batch_count;
+
+    pending_free* _pending;
+
+    uint32_t _pending_count;
+
+    uint32_t _pass;
+private:
+    event_pipeline(const event_pipeline&);
+    event_pipeline& operator=(const event_pipeline&);
+};
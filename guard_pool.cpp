@@ -0,0 +1,166 @@
+#include "guard_pool.h"
+#include "redzone.h"
+#include "virtual_memory.h"
+
+#define PAGE_CONTINUE 0xffffffff
+
+static __declspec(thread) uint32_t _countdown; /// 本线程距离下一次采样的分配次数，0表示还没有初始化
+
+guard_pool::guard_pool()
+{
+    InitializeCriticalSectionAndSpinCount(&_mutex, 100);
+
+    _base = nullptr;
+    _size = 0;
+    _page_size = 0;
+    _page_count = 0;
+    _pages = nullptr;
+    _cursor = 0;
+    _used_pages = 0;
+    _interval = 0;
+}
+
+guard_pool::~guard_pool()
+{
+    virtual_free(_base, _size);
+    virtual_free(_pages, sizeof(uint32_t) * _page_count);
+
+    DeleteCriticalSection(&_mutex);
+}
+
+bool guard_pool::reserve(const page_guard_config& config)
+{
+    if (_base != nullptr || config._sample_interval == 0)
+        return false;
+
+    _page_size = virtual_page_size();
+    uint32_t page_count = (uint32_t)(config._max_memory_size / _page_size);
+    if (page_count < 2)
+        return false;
+
+    _pages = (uint32_t*)virtual_alloc(sizeof(uint32_t) * page_count);
+    if (_pages == nullptr)
+        return false;
+
+    _base = (uint8_t*)virtual_reserve((size_t)page_count * _page_size);
+    if (_base == nullptr) {
+        virtual_free(_pages, sizeof(uint32_t) * page_count);
+        _pages = nullptr;
+        return false;
+    }
+
+    _page_count = page_count;
+    _size = (size_t)page_count * _page_size;
+    _interval = config._sample_interval;
+    return true;
+}
+
+bool guard_pool::sample()
+{
+    if (_interval == 0)
+        return false;
+
+    if (_countdown == 0) {
+        /// 每个线程在一个间隔里随机取起点，否则每个线程的第一次分配都会放进保护页
+        uint64_t seed = ((uint64_t)GetCurrentThreadId() << 16) ^ (uint64_t)(uintptr_t)&_countdown ^ GetTickCount();
+        seed *= 0x9e3779b97f4a7c15ULL;
+        _countdown = (uint32_t)((seed >> 32) % _interval) + 1;
+    }
+
+    if (_countdown > 1) {
+        _countdown--;
+        return false;
+    }
+
+    _countdown = _interval;
+    return true;
+}
+
+void* guard_pool::alloc(size_t size)
+{
+    /// 块的末尾对齐到保护页，不足16字节的部分由调用者写保护字节
+    size_t data_size = (size + REDZONE_ALIGNMENT - 1) & ~(size_t)(REDZONE_ALIGNMENT - 1);
+    size_t count = (data_size + _page_size - 1) / _page_size + 1;
+    if (count > _page_count)
+        return nullptr;
+
+    EnterCriticalSection(&_mutex);
+
+    /// 从上次的位置往后找连续的空闲页，块不跨过末尾，最多绕一圈
+    uint32_t first = PAGE_CONTINUE;
+    uint32_t pos = _cursor;
+    uint32_t run = 0;
+    for (size_t scanned = 0; scanned < _page_count + count; ) {
+        if (pos == _page_count) {
+            pos = 0;
+            run = 0;
+        }
+
+        if (_pages[pos] != 0) {
+            scanned += _pages[pos];
+            pos += _pages[pos];
+            run = 0;
+            continue;
+        }
+
+        scanned++;
+        pos++;
+        if (++run == count) {
+            first = pos - (uint32_t)count;
+            break;
+        }
+    }
+
+    uint8_t* data = nullptr;
+    if (first != PAGE_CONTINUE && virtual_commit(_base + first * _page_size, (count - 1) * _page_size)) {
+        _pages[first] = (uint32_t)count;
+        for (size_t i = 1; i < count; i++) {
+            _pages[first + i] = PAGE_CONTINUE;
+        }
+
+        _used_pages += (uint32_t)count;
+        _cursor = first + (uint32_t)count;
+        data = _base + (first + count - 1) * _page_size - data_size;
+    }
+
+    LeaveCriticalSection(&_mutex);
+    return data;
+}
+
+size_t guard_pool::usable_size(const void* ptr)
+{
+    EnterCriticalSection(&_mutex);
+    uint32_t first = find_first_page(ptr);
+    uint8_t* guard = _base + (first + _pages[first] - 1) * _page_size;
+    LeaveCriticalSection(&_mutex);
+    return guard - (const uint8_t*)ptr;
+}
+
+void guard_pool::protect(void* ptr)
+{
+    EnterCriticalSection(&_mutex);
+    uint32_t first = find_first_page(ptr);
+    virtual_decommit(_base + first * _page_size, (_pages[first] - 1) * _page_size);
+    LeaveCriticalSection(&_mutex);
+}
+
+void guard_pool::release(void* ptr)
+{
+    EnterCriticalSection(&_mutex);
+    uint32_t first = find_first_page(ptr);
+    uint32_t count = _pages[first];
+    for (uint32_t i = 0; i < count; i++) {
+        _pages[first + i] = 0;
+    }
+    _used_pages -= count;
+    LeaveCriticalSection(&_mutex);
+}
+
+uint32_t guard_pool::find_first_page(const void* ptr)
+{
+    uint32_t page = (uint32_t)(((const uint8_t*)ptr - _base) / _page_size);
+    while (_pages[page] == PAGE_CONTINUE) {
+        page--;
+    }
+    return page;
+}
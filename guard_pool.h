@@ -0,0 +1,66 @@
+#pragma once
+#include <stdint.h>
+#include "platform.h"
+
+struct page_guard_config
+{
+    uint32_t _sample_interval; /// 平均每多少次分配放一块到保护页前面，0表示关闭
+
+    uint32_t _max_memory_size; /// 保护页池最多占用的地址空间，包括保护页
+};
+
+/// 保护页模式，做法和electric fence相同
+/// 采样到的分配紧贴在一页不可访问的内存前面，越界写在出错的那条指令上触发异常
+/// 释放时页面立即还给系统并且不可访问，之后的访问同样触发异常
+/// 页面来自一段预先保留的地址空间，按顺序循环使用，释放过的页面尽量晚复用
+class guard_pool
+{
+public:
+    guard_pool();
+
+    ~guard_pool();
+
+    bool reserve(const page_guard_config& config); /// 挂钩之前调用一次
+
+    bool sample(); /// 只修改当前线程的状态
+
+    bool contains(const void* ptr) const
+    {
+        return (const uint8_t*)ptr >= _base && (const uint8_t*)ptr < _base + _size;
+    }
+
+    void* alloc(size_t size); /// 内容为0，按16字节对齐，空间不够时返回nullptr
+
+    size_t usable_size(const void* ptr); /// 到保护页为止的大小
+
+    void protect(void* ptr); /// 释放时调用，页面立即不可访问
+
+    void release(void* ptr); /// 不再需要检查double free时调用，之后页面可以复用
+
+    uint32_t used_pages() const { return _used_pages; }
+
+    uint32_t page_count() const { return _page_count; }
+private:
+    uint32_t find_first_page(const void* ptr);
+
+    CRITICAL_SECTION _mutex;
+
+    uint8_t* _base;
+
+    size_t _size;
+
+    size_t _page_size;
+
+    uint32_t _page_count;
+
+    uint32_t* _pages; /// 每页一项，块的第一页保存页数（包括保护页），其他页是PAGE_CONTINUE，空闲为0
+
+    uint32_t _cursor; /// 下一次从这里开始查找
+
+    uint32_t _used_pages;
+
+    uint32_t _interval;
+private:
+    guard_pool(const guard_pool&);
+    guard_pool& operator=(const guard_pool&);
+};
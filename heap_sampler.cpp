@@ -0,0 +1,66 @@
+#include <math.h>
+#include "heap_sampler.h"
+
+struct heap_sampler_state
+{
+    uint64_t _seed; /// 0表示本线程还没有初始化
+
+    int64_t _bytes_left; /// 距离下一个采样点的字节数
+};
+
+static __declspec(thread) heap_sampler_state _sampler_state;
+
+static int64_t next_sample_bytes(heap_sampler_state& state, uint32_t interval)
+{
+    /// 48位线性同余，取高26位作为(0, 1]上的均匀分布
+    const uint64_t prng_mult = 0x5DEECE66DULL;
+    const uint64_t prng_add = 0xB;
+    const uint64_t prng_mod_mask = (1ULL << 48) - 1;
+    state._seed = (prng_mult * state._seed + prng_add) & prng_mod_mask;
+
+    double q = (double)((state._seed >> 22) + 1) / (double)(1 << 26);
+    return (int64_t)(-log(q) * interval) + 1;
+}
+
+heap_sampler::heap_sampler()
+{
+    _interval = 0;
+}
+
+void heap_sampler::set_interval(uint32_t interval)
+{
+    /// 各线程已经取出的采样点不变，之后按新的间隔取
+    InterlockedExchange(&_interval, (LONG)interval);
+}
+
+bool heap_sampler::sample(size_t size)
+{
+    uint32_t interval = (uint32_t)_interval;
+    if (interval == 0)
+        return true;
+
+    heap_sampler_state& state = _sampler_state;
+    if (state._seed == 0) {
+        state._seed = ((uint64_t)GetCurrentThreadId() << 16) ^ (uint64_t)(uintptr_t)&state ^ GetTickCount();
+        state._seed |= 1;
+        state._bytes_left = next_sample_bytes(state, interval);
+    }
+
+    state._bytes_left -= (int64_t)size;
+    if (state._bytes_left > 0)
+        return false;
+
+    state._bytes_left = next_sample_bytes(state, interval);
+    return true;
+}
+
+size_t heap_sampler::weight(size_t size) const
+{
+    uint32_t interval = (uint32_t)_interval;
+    if (interval == 0 || size == 0)
+        return size;
+
+    /// 大小为size的分配被采样的概率是1 - exp(-size / interval)
+    double weight = (double)size / (1.0 - exp(-(double)size / interval));
+    return weight < (double)(size_t)-1 ? (size_t)weight : (size_t)-1;
+}
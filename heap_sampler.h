@@ -0,0 +1,25 @@
+#pragma once
+#include <stdint.h>
+#include "platform.h"
+
+/// 按字节的泊松采样，做法和tcmalloc相同
+/// 每个线程从均值为采样间隔的指数分布中取下一个采样点，分配跨过采样点时才获取堆栈
+/// 被采样的分配按它代表的字节数加权，统计结果是无偏估计
+class heap_sampler
+{
+public:
+    heap_sampler();
+
+    void set_interval(uint32_t interval); /// 平均采样间隔字节数，0表示每次分配都采样
+
+    uint32_t interval() const { return (uint32_t)_interval; }
+
+    bool sample(size_t size); /// 只修改当前线程的状态
+
+    size_t weight(size_t size) const; /// 被采样的分配代表的字节数
+private:
+    volatile LONG _interval;
+private:
+    heap_sampler(const heap_sampler&);
+    heap_sampler& operator=(const heap_sampler&);
+};
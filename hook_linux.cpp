@@ -0,0 +1,692 @@
+#ifndef _WIN32
+
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <link.h>
+#include <string.h>
+#include <new>
+#include "hook_state.h"
+#include "unwind_cache.h"
+
+/// 通过LD_PRELOAD替换libc的分配函数，原始函数用dlsym(RTLD_NEXT)取得
+/// LD_PRELOAD=./libmemory_watcher.so ./program
+
+typedef int   (*posix_memalign_t)(void** ptr, size_t alignment, size_t size);
+typedef void* (*memalign_t)(size_t alignment, size_t size);
+typedef int   (*dlclose_t)(void* handle);
+
+malloc_t malloc_func;
+
+calloc_t calloc_func;
+
+realloc_t realloc_func;
+
+free_t free_func;
+
+msize_t msize_func; /// malloc_usable_size
+
+static posix_memalign_t posix_memalign_func;
+
+static memalign_t memalign_func;
+
+static dlclose_t dlclose_func;
+
+#define BOOTSTRAP_ARENA_SIZE (64 * 1024)
+
+#define BOOTSTRAP_ALIGNMENT 16
+
+/// dlsym自己会调用calloc，这时原始函数还没有取到，用静态内存应付
+/// 这部分内存不会释放，也不记录
+static __declspec(align(16)) uint8_t _bootstrap_arena[BOOTSTRAP_ARENA_SIZE];
+
+static volatile LONG _bootstrap_used;
+
+static bool is_bootstrap(void* ptr)
+{
+    return (uint8_t*)ptr >= _bootstrap_arena && (uint8_t*)ptr < _bootstrap_arena + BOOTSTRAP_ARENA_SIZE;
+}
+
+static void* bootstrap_alloc(size_t size)
+{
+    /// 每块前面保存大小，realloc和malloc_usable_size要用
+    size_t total = BOOTSTRAP_ALIGNMENT + ((size + BOOTSTRAP_ALIGNMENT - 1) & ~(size_t)(BOOTSTRAP_ALIGNMENT - 1));
+    LONG offset = InterlockedExchangeAdd(&_bootstrap_used, (LONG)total);
+    if (offset + total > BOOTSTRAP_ARENA_SIZE)
+        return nullptr;
+
+    uint8_t* data = _bootstrap_arena + offset;
+    *(size_t*)data = size;
+    return data + BOOTSTRAP_ALIGNMENT;
+}
+
+static size_t bootstrap_size(void* ptr)
+{
+    return *(size_t*)((uint8_t*)ptr - BOOTSTRAP_ALIGNMENT);
+}
+
+static void hook_state_resolve()
+{
+    if (malloc_func != nullptr)
+        return;
+
+    _hook_initializing = true;
+    calloc_func = (calloc_t)dlsym(RTLD_NEXT, "calloc");
+    realloc_func = (realloc_t)dlsym(RTLD_NEXT, "realloc");
+    free_func = (free_t)dlsym(RTLD_NEXT, "free");
+    msize_func = (msize_t)dlsym(RTLD_NEXT, "malloc_usable_size");
+    posix_memalign_func = (posix_memalign_t)dlsym(RTLD_NEXT, "posix_memalign");
+    memalign_func = (memalign_t)dlsym(RTLD_NEXT, "memalign");
+    dlclose_func = (dlclose_t)dlsym(RTLD_NEXT, "dlclose");
+    malloc_func = (malloc_t)dlsym(RTLD_NEXT, "malloc"); /// 最后设置，不为空表示全部取到
+    _hook_initializing = false;
+}
+
+/// 找到本库所在的可执行段，挂钩函数和获取堆栈时经过的内部函数都在里面，整段跳过
+static int skip_hook_module(struct dl_phdr_info* info, size_t, void* data)
+{
+    SIZE_T address = (SIZE_T)data;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+        if (phdr.p_type != PT_LOAD || (phdr.p_flags & PF_X) == 0)
+            continue;
+
+        SIZE_T start = info->dlpi_addr + phdr.p_vaddr;
+        SIZE_T end = start + phdr.p_memsz;
+        if (address < start || address >= end)
+            continue;
+
+        /// 和程序链接在一起时这一段也是程序自己的代码，不能整段跳过
+        if (info->dlpi_name == nullptr || info->dlpi_name[0] == '\0')
+            return -1;
+
+        return addskiprange(start, end) ? 1 : -1;
+    }
+    return 0;
+}
+
+/// 获取堆栈时跳过的帧，在挂钩之前填好，之后不再修改
+static void hook_state_skip_functions()
+{
+    if (dl_iterate_phdr(skip_hook_module, (void*)&hook_state_skip_functions) != 1) {
+        /// 只能按动态符号表找到导出的挂钩函数
+        void* (*new_function)(size_t) = &::operator new;
+        void* (*new_array_function)(size_t) = &::operator new[];
+        addskipfunction((SIZE_T)&malloc);
+        addskipfunction((SIZE_T)&calloc);
+        addskipfunction((SIZE_T)&realloc);
+        addskipfunction((SIZE_T)&posix_memalign);
+        addskipfunction((SIZE_T)new_function);
+        addskipfunction((SIZE_T)new_array_function);
+    }
+
+    /// 只是包了一层malloc的库函数，记录调用它们的地方；libstdc++自己的operator new通常已经被替换，以防有模块直接绑定
+    static const char* wrappers[] = {
+        "strdup", "strndup", "wcsdup",
+        "_Znwm", "_Znam", "_ZnwmRKSt9nothrow_t", "_ZnamRKSt9nothrow_t",
+        "_ZnwmSt11align_val_t", "_ZnamSt11align_val_t",
+    };
+
+    for (const char* name : wrappers) {
+        void* function = dlsym(RTLD_NEXT, name);
+        if (function != nullptr) {
+            addskipfunction((SIZE_T)function);
+        }
+    }
+
+    /// 程序自己的分配包装函数，逗号分隔，需要在动态符号表里（-rdynamic）
+    const char* skip_functions = getenv("MEMORY_WATCHER_SKIP_FUNCTIONS");
+    while (skip_functions != nullptr && *skip_functions != '\0') {
+        const char* comma = strchr(skip_functions, ',');
+        size_t length = comma != nullptr ? (size_t)(comma - skip_functions) : strlen(skip_functions);
+
+        char name[256];
+        if (length > 0 && length < sizeof(name)) {
+            memcpy(name, skip_functions, length);
+            name[length] = '\0';
+
+            void* function = dlsym(RTLD_DEFAULT, name);
+            if (function == nullptr || !addskipfunction((SIZE_T)function)) {
+                OutputDebugStringA("skip function not found\n");
+            }
+        }
+
+        skip_functions = comma != nullptr ? comma + 1 : nullptr;
+    }
+}
+
+bool hook_state_initialize(bool async_mode)
+{
+    if (_hook_state._enabled)
+        return true;
+
+    hook_state_resolve();
+    if (malloc_func == nullptr || free_func == nullptr) {
+        OutputDebugStringA("dlsym\n");
+        return false;
+    }
+
+    _hook_state._storage_index = TlsAlloc();
+    if (_hook_state._storage_index == TLS_OUT_OF_INDEXES) {
+        OutputDebugStringA("invalid storage index\n");
+        return false;
+    }
+
+    /// 第一次调用backtrace会加载libgcc_s并申请内存，不能发生在挂钩函数里
+    void* frames[1];
+    backtrace(frames, 1);
+
+    if (_the_manager == nullptr) {
+        _the_manager = new memory_watcher;
+    }
+
+    _the_manager->set_redzone_config(_hook_state._redzone);
+    _the_manager->set_page_guard_config(_hook_state._page_guard);
+    _the_manager->set_inline_header(_hook_state._inline_header);
+    _the_manager->set_stack_trie(_hook_state._stack_trie);
+    redzone_initialize();
+    unwind_cache_initialize();
+    hook_state_skip_functions();
+
+    if (async_mode && msize_func != nullptr) {
+        hook_state_start_pipeline();
+    }
+
+    InterlockedExchange(&_hook_state._enabled, TRUE);
+    return true;
+}
+
+bool hook_state_initialize()
+{
+    return hook_state_initialize(false);
+}
+
+void hook_state_uninitialize()
+{
+    if (_hook_state._enabled) {
+        InterlockedExchange(&_hook_state._enabled, FALSE);
+
+        hook_state_stop_pipeline();
+        _the_manager->on_shutdown();
+    }
+
+    if (_hook_state._storage_index != TLS_OUT_OF_INDEXES) {
+        TlsFree(_hook_state._storage_index);
+        _hook_state._storage_index = TLS_OUT_OF_INDEXES;
+    }
+
+    /// 挂钩不会卸载，之后释放带前置保护区、头部或者在保护页池里的块还要找到记录
+    if (hook_state_front_size() != 0 || _hook_state._page_guard._sample_interval != 0)
+        return;
+
+    delete _the_manager;
+    _the_manager = nullptr;
+}
+
+void hook_state_prepare_stack_info()
+{
+    /// 符号由dladdr按需查找，不需要初始化
+    _hook_state._stack_info_prepared = true;
+}
+
+__attribute__((constructor)) static void hook_state_load()
+{
+    _hook_state._storage_index = TLS_OUT_OF_INDEXES;
+
+    redzone_config config = _hook_state._redzone;
+    const char* front_size = getenv("MEMORY_WATCHER_FRONT_REDZONE");
+    if (front_size != nullptr) {
+        config._front_size = (uint32_t)strtoul(front_size, nullptr, 10);
+    }
+
+    const char* rear_size = getenv("MEMORY_WATCHER_REAR_REDZONE");
+    if (rear_size != nullptr) {
+        config._rear_size = (uint32_t)strtoul(rear_size, nullptr, 10);
+    }
+
+    hook_state_set_redzone_config(config);
+
+    page_guard_config page_guard = _hook_state._page_guard;
+    const char* page_guard_interval = getenv("MEMORY_WATCHER_PAGE_GUARD_INTERVAL");
+    if (page_guard_interval != nullptr) {
+        page_guard._sample_interval = (uint32_t)strtoul(page_guard_interval, nullptr, 10);
+    }
+
+    const char* page_guard_memory = getenv("MEMORY_WATCHER_PAGE_GUARD_MEMORY");
+    if (page_guard_memory != nullptr) {
+        page_guard._max_memory_size = (uint32_t)strtoul(page_guard_memory, nullptr, 10);
+    }
+
+    hook_state_set_page_guard_config(page_guard);
+
+    const char* inline_header = getenv("MEMORY_WATCHER_INLINE_HEADER");
+    if (inline_header != nullptr) {
+        hook_state_set_inline_header(inline_header[0] == '1');
+    }
+
+    const char* stack_trie = getenv("MEMORY_WATCHER_STACK_TRIE");
+    if (stack_trie != nullptr) {
+        hook_state_set_stack_trie(stack_trie[0] == '1');
+    }
+
+    const char* async_mode = getenv("MEMORY_WATCHER_ASYNC");
+    if (!hook_state_initialize(async_mode != nullptr && async_mode[0] == '1'))
+        return;
+
+    const char* sample_interval = getenv("MEMORY_WATCHER_SAMPLE_INTERVAL");
+    if (sample_interval != nullptr) {
+        hook_state_set_sample_interval((uint32_t)strtoul(sample_interval, nullptr, 10));
+    }
+
+    const char* resize_stack = getenv("MEMORY_WATCHER_RESIZE_STACK");
+    if (resize_stack != nullptr) {
+        hook_state_set_resize_stack(resize_stack[0] == '1');
+    }
+
+    const char* stack_walker = getenv("MEMORY_WATCHER_STACK_WALKER");
+    if (stack_walker != nullptr && strcmp(stack_walker, "fast") == 0) {
+        hook_state_set_stack_walker(STACK_WALKER_FAST);
+    }
+    else if (stack_walker != nullptr && strcmp(stack_walker, "cached") == 0) {
+        hook_state_set_stack_walker(STACK_WALKER_CACHED);
+    }
+
+    const char* stack_depth = getenv("MEMORY_WATCHER_STACK_DEPTH");
+    if (stack_depth != nullptr) {
+        hook_state_set_stack_depth((uint32_t)strtoul(stack_depth, nullptr, 10));
+    }
+}
+
+__attribute__((destructor)) static void hook_state_unload()
+{
+    hook_state_uninitialize();
+}
+
+#define FRAMEPOINTER(fp) fp = (SIZE_T*)__builtin_frame_address(0)
+
+/// 对齐分配时前置保护区和头部按对齐取整，返回的指针仍然对齐；太大放不进记录时返回0
+static uint32_t aligned_front_size(size_t alignment)
+{
+    uint32_t front_size = hook_state_front_size();
+    if (front_size == 0 || alignment <= REDZONE_ALIGNMENT)
+        return front_size;
+
+    size_t aligned_size = (front_size + alignment - 1) & ~(alignment - 1);
+    return aligned_size <= 0xffff ? (uint32_t)aligned_size : 0;
+}
+
+/// 对齐分配的公共部分，失败时返回错误码
+static int hook_state_memalign(void** ptr, size_t alignment, size_t size, uint32_t kind)
+{
+    SIZE_T* frame_pointer = NULL;
+    FRAMEPOINTER(frame_pointer);
+
+    if (alignment <= REDZONE_ALIGNMENT) {
+        *ptr = hook_state_alloc(size, kind, frame_pointer);
+        return *ptr != nullptr ? 0 : ENOMEM;
+    }
+
+    if (size == 0) { size = 4; }
+
+    uint32_t front_size = aligned_front_size(alignment);
+    if (front_size == 0 && hook_state_front_size() != 0)
+        return posix_memalign_func(ptr, alignment, size); /// 前面放不下头部，不记录
+
+    void* raw = nullptr;
+    int result = posix_memalign_func(&raw, alignment, front_size + size + _hook_state._redzone._rear_size);
+    if (result != 0)
+        return result;
+
+    *ptr = hook_state_track(raw, size, front_size, kind, frame_pointer);
+    return 0;
+}
+
+/// operator new的公共部分，alignment为0时使用malloc的默认对齐
+static void* hook_state_new(size_t size, size_t alignment, uint32_t kind)
+{
+    if (malloc_func == nullptr) {
+        hook_state_resolve();
+    }
+
+    if (!hook_state_tracking()) {
+        if (alignment == 0)
+            return malloc_func(size);
+
+        void* data = nullptr;
+        return posix_memalign_func(&data, alignment, size) == 0 ? data : nullptr;
+    }
+
+    void* data = nullptr;
+    return hook_state_memalign(&data, alignment, size, kind) == 0 ? data : nullptr;
+}
+
+static void* hook_state_new_throw(size_t size, size_t alignment, uint32_t kind)
+{
+    for (;;) {
+        void* data = hook_state_new(size, alignment, kind);
+        if (data != nullptr)
+            return data;
+
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr)
+            throw std::bad_alloc();
+
+        handler();
+    }
+}
+
+static void* hook_state_new_nothrow(size_t size, size_t alignment, uint32_t kind)
+{
+    try {
+        return hook_state_new_throw(size, alignment, kind);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+/// operator delete的公共部分，size是sized delete传入的大小，0表示不知道
+static void hook_state_delete(void* ptr, size_t size, uint32_t kind)
+{
+    if (ptr == nullptr || is_bootstrap(ptr) || free_func == nullptr)
+        return;
+
+    if (!hook_state_tracking())
+        return hook_state_free_untracked(ptr);
+
+    auto_heap_guard guard(nullptr);
+    hook_state_on_free(ptr, kind, size);
+}
+
+extern "C" {
+
+void* malloc(size_t size)
+{
+    if (malloc_func == nullptr) {
+        if (_hook_initializing)
+            return bootstrap_alloc(size);
+
+        hook_state_resolve();
+    }
+
+    /// 没有开启记录时直接转发，不加锁
+    if (!hook_state_tracking())
+        return malloc_func(size);
+
+    SIZE_T* frame_pointer = NULL;
+    FRAMEPOINTER(frame_pointer);
+
+    return hook_state_alloc(size, ALLOC_MALLOC, frame_pointer);
+}
+
+void* calloc(size_t n, size_t size)
+{
+    if (calloc_func == nullptr || _hook_initializing) {
+        /// 静态内存本来就是0
+        if (n != 0 && size > (size_t)-1 / n)
+            return nullptr;
+
+        return bootstrap_alloc(n * size);
+    }
+
+    if (!hook_state_tracking())
+        return calloc_func(n, size);
+
+    SIZE_T* frame_pointer = NULL;
+    FRAMEPOINTER(frame_pointer);
+
+    return hook_state_calloc(n, size, frame_pointer);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    if (ptr != nullptr && is_bootstrap(ptr)) {
+        /// 从静态内存搬到正常的堆上
+        size_t old_size = bootstrap_size(ptr);
+        void* data = malloc(size);
+        if (data != nullptr) {
+            memcpy(data, ptr, old_size < size ? old_size : size);
+        }
+        return data;
+    }
+
+    if (realloc_func == nullptr || _hook_initializing) {
+        return ptr == nullptr ? bootstrap_alloc(size) : nullptr;
+    }
+
+    if (ptr == nullptr)
+        return malloc(size);
+
+    if (size == 0) {
+        free(ptr);
+        return nullptr;
+    }
+
+    if (!hook_state_tracking())
+        return hook_state_untracked_realloc(ptr, size);
+
+    SIZE_T* frame_pointer = NULL;
+    FRAMEPOINTER(frame_pointer);
+
+    return hook_state_realloc(ptr, size, frame_pointer);
+}
+
+void free(void* ptr)
+{
+    if (ptr == nullptr || is_bootstrap(ptr))
+        return;
+
+    if (free_func == nullptr)
+        return;
+
+    if (!hook_state_tracking())
+        return hook_state_free_untracked(ptr);
+
+    auto_heap_guard guard(nullptr);
+    hook_state_on_free(ptr);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size)
+{
+    /// 对齐不超过16时直接按malloc分配，不会经过原始函数的检查，这里先检查
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment % sizeof(void*) != 0)
+        return EINVAL;
+
+    if (posix_memalign_func == nullptr) {
+        hook_state_resolve();
+        if (posix_memalign_func == nullptr)
+            return ENOMEM;
+    }
+
+    if (!hook_state_tracking())
+        return posix_memalign_func(ptr, alignment, size);
+
+    return hook_state_memalign(ptr, alignment, size, ALLOC_MALLOC);
+}
+
+void* memalign(size_t alignment, size_t size)
+{
+    if (memalign_func == nullptr) {
+        hook_state_resolve();
+        if (memalign_func == nullptr)
+            return nullptr;
+    }
+
+    if (!hook_state_tracking())
+        return memalign_func(alignment, size);
+
+    void* data = nullptr;
+    return hook_state_memalign(&data, alignment, size, ALLOC_MALLOC) == 0 ? data : nullptr;
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+void* valloc(size_t size)
+{
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void* pvalloc(size_t size)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    return memalign(page_size, (size + page_size - 1) & ~(page_size - 1));
+}
+
+/// 卸载的模块的地址可能被之后加载的模块复用，缓存的回溯规则要清掉
+/// 不挂钩dlopen，它按调用者的地址查找RPATH，新加载的模块在缓存未命中时发现
+int dlclose(void* handle)
+{
+    if (dlclose_func == nullptr) {
+        hook_state_resolve();
+        if (dlclose_func == nullptr)
+            return -1;
+    }
+
+    int result = dlclose_func(handle);
+    unwind_cache_refresh();
+    return result;
+}
+
+size_t malloc_usable_size(void* ptr)
+{
+    if (ptr == nullptr)
+        return 0;
+
+    if (is_bootstrap(ptr))
+        return bootstrap_size(ptr);
+
+    if (msize_func == nullptr)
+        return 0;
+
+    /// 记录过的块只报告申请的大小，前后是保护区
+    /// 异步模式下分配事件可能还没处理，先看头部
+    if (_the_manager != nullptr && _hook_depth == 0) {
+        size_t length = 0;
+        if (_the_manager->header_length(ptr, length))
+            return length;
+
+        memory_block block;
+        if (_the_manager->find_block(ptr, block))
+            return !block._delay_free ? block._length : 0;
+
+        if (_the_manager->is_guarded(ptr))
+            return _the_manager->guarded_size(ptr);
+
+        /// 分配事件还没处理的块后面也有保护区，不能按原始大小报告
+        if (hook_state_async() && hook_state_pending_length(ptr, length))
+            return length;
+    }
+
+    return msize_func(ptr);
+}
+
+}
+
+/// 全部可替换的全局operator new/delete，aligned版本需要C++17
+
+void* operator new(size_t size)
+{
+    return hook_state_new_throw(size, 0, ALLOC_NEW);
+}
+
+void* operator new[](size_t size)
+{
+    return hook_state_new_throw(size, 0, ALLOC_NEW_ARRAY);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    return hook_state_new_nothrow(size, 0, ALLOC_NEW);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    return hook_state_new_nothrow(size, 0, ALLOC_NEW_ARRAY);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    hook_state_delete(ptr, 0, ALLOC_NEW);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    hook_state_delete(ptr, 0, ALLOC_NEW_ARRAY);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+    hook_state_delete(ptr, 0, ALLOC_NEW);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+    hook_state_delete(ptr, 0, ALLOC_NEW_ARRAY);
+}
+
+void operator delete(void* ptr, size_t size) noexcept
+{
+    hook_state_delete(ptr, size, ALLOC_NEW);
+}
+
+void operator delete[](void* ptr, size_t size) noexcept
+{
+    hook_state_delete(ptr, size, ALLOC_NEW_ARRAY);
+}
+
+#if __cpp_aligned_new
+
+void* operator new(size_t size, std::align_val_t alignment)
+{
+    return hook_state_new_throw(size, (size_t)alignment, ALLOC_NEW);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment)
+{
+    return hook_state_new_throw(size, (size_t)alignment, ALLOC_NEW_ARRAY);
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return hook_state_new_nothrow(size, (size_t)alignment, ALLOC_NEW);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return hook_state_new_nothrow(size, (size_t)alignment, ALLOC_NEW_ARRAY);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+    hook_state_delete(ptr, 0, ALLOC_NEW);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept
+{
+    hook_state_delete(ptr, 0, ALLOC_NEW_ARRAY);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    hook_state_delete(ptr, 0, ALLOC_NEW);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    hook_state_delete(ptr, 0, ALLOC_NEW_ARRAY);
+}
+
+void operator delete(void* ptr, size_t size, std::align_val_t) noexcept
+{
+    hook_state_delete(ptr, size, ALLOC_NEW);
+}
+
+void operator delete[](void* ptr, size_t size, std::align_val_t) noexcept
+{
+    hook_state_delete(ptr, size, ALLOC_NEW_ARRAY);
+}
+
+#endif
+
+#endif
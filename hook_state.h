@@ -0,0 +1,127 @@
+#pragma once
+#include "memory_watcher.h"
+
+/// 挂钩层和memory_watcher共用的状态
+/// 挂钩本身和平台相关，Windows见hook_win32.cpp，Linux见hook_linux.cpp
+
+typedef void* (*malloc_t)(size_t size);
+typedef void* (*calloc_t)(size_t n, size_t size);
+typedef void* (*realloc_t)(void* ptr, size_t size);
+typedef void  (*free_t)(void* ptr);
+typedef size_t (*msize_t)(void* ptr);
+
+extern malloc_t malloc_func; /// 原始的分配函数，由各平台的挂钩层填写
+
+extern calloc_t calloc_func;
+
+extern realloc_t realloc_func;
+
+extern free_t free_func;
+
+extern msize_t msize_func;
+
+struct hook_state
+{
+    DWORD  _storage_index;
+
+    volatile LONG _enabled; /// 只在初始化和退出时修改，挂钩函数只读
+
+    bool   _stack_info_prepared;
+
+    redzone_config _redzone; /// 挂钩之前设置，之后不再修改
+
+    page_guard_config _page_guard;
+
+    bool _inline_header;
+
+    bool _stack_trie;
+};
+
+extern hook_state _hook_state;
+
+extern __declspec(thread) uint32_t _hook_depth; /// 本线程正在执行watcher内部代码的层数
+
+extern __declspec(thread) bool _hook_initializing; /// 本线程正在取原始函数或者安装挂钩，其他线程的分配照常处理
+
+/// 作用域内本线程的分配不再记录，其他线程不受影响
+class auto_hook_depth
+{
+public:
+    auto_hook_depth() { _hook_depth++; }
+
+    ~auto_hook_depth() { _hook_depth--; }
+};
+
+inline bool hook_state_tracking()
+{
+    return _hook_state._enabled && _hook_depth == 0;
+}
+
+inline uint32_t hook_state_front_size() /// 前置保护区加上头部
+{
+    return _hook_state._redzone._front_size + (_hook_state._inline_header ? HEADER_SIZE : 0);
+}
+
+extern memory_watcher* _the_manager;
+
+class event_pipeline;
+
+extern event_pipeline* volatile _the_pipeline; /// 只在memory_watcher.cpp里通过auto_pipeline使用
+
+void hook_state_start_pipeline(); /// 启动失败时仍然同步处理
+
+void hook_state_stop_pipeline();
+
+bool hook_state_async();
+
+bool hook_state_pending_length(void* ptr, size_t& length); /// 异步模式下查不到记录时，从还没处理的分配事件里取申请的大小
+
+void hook_state_on_alloc(void* data, size_t size, uint32_t kind = ALLOC_MALLOC, uint32_t front_size = 0);
+
+void hook_state_on_free(void* ptr, uint32_t kind = ALLOC_MALLOC, size_t size = 0);
+
+memory_block* hook_state_begin_realloc(void* old_ptr); /// 见memory_watcher::begin_realloc
+
+void hook_state_end_realloc(memory_block* block, void* new_ptr, size_t size, uint32_t front_size);
+
+/// 保存调用者的帧，获取堆栈时从这里开始
+class auto_heap_guard
+{
+public:
+    auto_heap_guard(SIZE_T* frame_pointer)
+    {
+        TlsSetValue(_hook_state._storage_index, frame_pointer);
+    }
+
+    ~auto_heap_guard()
+    {
+        TlsSetValue(_hook_state._storage_index, nullptr);
+    }
+};
+
+/// raw是申请到的内存，大小至少是front_size + size + 后面的保护区，返回给调用者的指针
+void* hook_state_track(void* raw, size_t size, uint32_t front_size, uint32_t kind, SIZE_T* frame_pointer);
+
+/// 开启记录时的malloc和new，按采样放到保护页前面
+void* hook_state_alloc(size_t size, uint32_t kind, SIZE_T* frame_pointer);
+
+/// 没有采样到时返回nullptr，保护页池的内存内容为0，calloc也可以用
+void* hook_state_alloc_guarded(size_t size, uint32_t kind, SIZE_T* frame_pointer);
+
+/// 开启记录时的calloc，检查乘法溢出，内存由原始的calloc清零
+void* hook_state_calloc(size_t n, size_t size, SIZE_T* frame_pointer);
+
+#define REALLOC_LARGE_SIZE (128 * 1024) /// glibc默认从这个大小开始用mmap分配，realloc时用mremap搬移页面，不复制内容
+
+/// 开启记录时的realloc，ptr和size都不为0；大块在异步模式下也交给原始的realloc
+void* hook_state_realloc(void* ptr, size_t size, SIZE_T* frame_pointer);
+
+/// 没有开启记录时的realloc，记录过的块前面可能有保护区
+void* hook_state_untracked_realloc(void* ptr, size_t size);
+
+/// 没有开启记录时释放，记录过的块可能要还给保护页池
+void hook_state_free_untracked(void* ptr);
+
+void hook_state_prepare_stack_info(); /// 平台相关，输出堆栈前调用
+
+void report(LPCWSTR format, ...);
@@ -0,0 +1,369 @@
+#ifdef _WIN32
+
+#include "dbghelpapi.h"
+#include <crtdbg.h>
+#include "hook_state.h"
+#include "mhook-lib/mhook.h"
+
+malloc_t malloc_func;
+
+calloc_t calloc_func;
+
+realloc_t realloc_func;
+
+free_t free_func;
+
+msize_t msize_func;
+
+typedef void* (*new_t)(size_t size);
+typedef void  (*delete_t)(void* ptr);
+
+new_t new_func; /// msvcr110导出的operator new/delete，VS2012还没有sized和aligned版本
+
+new_t new_array_func;
+
+delete_t delete_func;
+
+delete_t delete_array_func;
+
+#define MAXMODULENAME 256
+
+#define currentprocess GetCurrentProcess()
+#define currentthread  GetCurrentThread()
+
+BOOL WINAPI attach_to_module(PCWSTR modulepath, DWORD64 modulebase, ULONG modulesize, PVOID)
+{
+    size_t              count;
+    WCHAR               extension[_MAX_EXT];
+    WCHAR               filename[_MAX_FNAME];
+    IMAGEHLP_MODULE64   moduleimageinfo;
+    WCHAR               modulename[MAXMODULENAME + 1];
+    CHAR                modulepatha[MAX_PATH];
+    BOOL                refresh = FALSE;
+
+    _wsplitpath_s(modulepath, NULL, 0, NULL, 0, filename, _MAX_FNAME, extension, _MAX_EXT);
+    wcsncpy_s(modulename, MAXMODULENAME + 1, filename, _TRUNCATE);
+    wcsncat_s(modulename, MAXMODULENAME + 1, extension, _TRUNCATE);
+    _wcslwr_s(modulename, MAXMODULENAME + 1);
+
+    moduleimageinfo.SizeOfStruct = sizeof(IMAGEHLP_MODULE64);
+    wcstombs_s(&count, modulepatha, MAX_PATH, modulepath, _TRUNCATE);
+    if ((pSymGetModuleInfoW64(currentprocess, modulebase, &moduleimageinfo) == TRUE) ||
+        ((pSymLoadModule64(currentprocess, NULL, modulepatha, NULL, modulebase, modulesize) == modulebase) &&
+        (pSymGetModuleInfoW64(currentprocess, modulebase, &moduleimageinfo) == TRUE)))
+    {
+    }
+
+    return TRUE;
+}
+
+void* hook_malloc(size_t size);
+void* hook_calloc(size_t n, size_t size);
+void* hook_realloc(void* ptr, size_t size);
+void  hook_free(void* ptr);
+void* hook_new(size_t size);
+void* hook_new_array(size_t size);
+void  hook_delete(void* ptr);
+void  hook_delete_array(void* ptr);
+
+/// 获取堆栈时跳过的帧，按符号解析出函数的范围，在挂钩之前填好
+/// 对应VLD原来输出时按文件名过滤的afxmem.cpp、dbgheap.c、malloc.c、new.cpp、newaop.cpp
+static void hook_state_skip_functions()
+{
+    addskipfunction((SIZE_T)hook_malloc);
+    addskipfunction((SIZE_T)hook_calloc);
+    addskipfunction((SIZE_T)hook_realloc);
+    addskipfunction((SIZE_T)hook_new);
+    addskipfunction((SIZE_T)hook_new_array);
+
+    static const wchar_t* modules[] = {
+        L"msvcr110", L"msvcr110d", L"mfc110", L"mfc110d", L"mfc110u", L"mfc110ud",
+    };
+
+    static const wchar_t* functions[] = {
+        L"operator new", L"operator new[]", L"_nh_malloc", L"_heap_alloc",
+        L"_malloc_dbg", L"_calloc_dbg", L"_realloc_dbg", L"_nh_malloc_dbg", L"_nh_malloc_dbg_impl",
+        L"_heap_alloc_dbg", L"_heap_alloc_dbg_impl", L"_calloc_dbg_impl", L"_realloc_dbg_impl",
+    };
+
+    /// 没有加载的模块和找不到符号的函数直接忽略
+    for (auto module : modules) {
+        if (GetModuleHandle(module) == NULL)
+            continue;
+
+        for (auto function : functions) {
+            wchar_t name[128];
+            swprintf_s(name, L"%s!%s", module, function);
+            addskipsymbol(name);
+        }
+    }
+}
+
+bool hook_state_initialize(bool async_mode)
+{
+    InterlockedExchange(&_hook_state._enabled, FALSE);
+    _hook_state._storage_index = TLS_OUT_OF_INDEXES;
+    _the_manager = new memory_watcher;
+    _the_manager->set_redzone_config(_hook_state._redzone);
+    _the_manager->set_page_guard_config(_hook_state._page_guard);
+    _the_manager->set_inline_header(_hook_state._inline_header);
+    _the_manager->set_stack_trie(_hook_state._stack_trie);
+    redzone_initialize();
+
+    if (!link_debughelp_library()) {
+        OutputDebugStringA("link_debughelp_library\n");
+        return false;
+    }
+
+    /// 挂钩之前初始化符号，初始化时的分配不会被记录
+    hook_state_prepare_stack_info();
+    hook_state_skip_functions();
+
+    _hook_state._storage_index = TlsAlloc();
+    if (_hook_state._storage_index == TLS_OUT_OF_INDEXES) {
+        OutputDebugStringA("invalid storage index\n");
+        return false;
+    }
+
+    HMODULE module = LoadLibrary(L"msvcr110.dll");
+    malloc_func = (malloc_t)GetProcAddress(module, "malloc");
+    calloc_func = (calloc_t)GetProcAddress(module, "calloc");
+    realloc_func = (realloc_t)GetProcAddress(module, "realloc");
+    free_func = (free_t)GetProcAddress(module, "free");
+    msize_func = (msize_t)GetProcAddress(module, "_msize");
+    if (malloc_func == nullptr || free_func == nullptr) {
+        OutputDebugStringA("GetProcAddress\n");
+        return false;
+    }
+
+    new_func = (new_t)GetProcAddress(module, "??2@YAPAXI@Z");
+    new_array_func = (new_t)GetProcAddress(module, "??_U@YAPAXI@Z");
+    delete_func = (delete_t)GetProcAddress(module, "??3@YAXPAX@Z");
+    delete_array_func = (delete_t)GetProcAddress(module, "??_V@YAXPAX@Z");
+
+    /// 只挂钩一部分会把new[]记成malloc，误报不配对，所以要么全挂要么都不挂
+    bool hook_new_delete = new_func != nullptr && new_array_func != nullptr &&
+        delete_func != nullptr && delete_array_func != nullptr;
+
+    if (async_mode && msize_func != nullptr) {
+        hook_state_start_pipeline();
+    }
+
+    _hook_initializing = true;
+    Mhook_SetHook((PVOID*)&free_func, hook_free);
+    Mhook_SetHook((PVOID*)&realloc_func, hook_realloc);
+    Mhook_SetHook((PVOID*)&malloc_func, hook_malloc);
+    Mhook_SetHook((PVOID*)&calloc_func, hook_calloc);
+    if (hook_new_delete) {
+        Mhook_SetHook((PVOID*)&delete_func, hook_delete);
+        Mhook_SetHook((PVOID*)&delete_array_func, hook_delete_array);
+        Mhook_SetHook((PVOID*)&new_func, hook_new);
+        Mhook_SetHook((PVOID*)&new_array_func, hook_new_array);
+    }
+    _hook_initializing = false;
+    InterlockedExchange(&_hook_state._enabled, TRUE);
+    return true;
+}
+
+bool hook_state_initialize()
+{
+    return hook_state_initialize(false);
+}
+
+void hook_state_uninitialize()
+{
+    /// 之后释放带前置保护区、头部或者在保护页池里的块还要找到记录，挂钩和记录都要保留，和Linux一致
+    bool keep_hooks = hook_state_front_size() != 0 || _hook_state._page_guard._sample_interval != 0;
+
+    if (_hook_state._enabled) {
+        InterlockedExchange(&_hook_state._enabled, FALSE);
+        if (!keep_hooks) {
+            Mhook_Unhook((PVOID*)&malloc_func);
+            Mhook_Unhook((PVOID*)&calloc_func);
+            Mhook_Unhook((PVOID*)&realloc_func);
+            Mhook_Unhook((PVOID*)&free_func);
+            if (new_func != nullptr) {
+                Mhook_Unhook((PVOID*)&new_func);
+                Mhook_Unhook((PVOID*)&new_array_func);
+                Mhook_Unhook((PVOID*)&delete_func);
+                Mhook_Unhook((PVOID*)&delete_array_func);
+            }
+        }
+
+        hook_state_stop_pipeline();
+        _the_manager->on_shutdown();
+    }
+
+    if (_hook_state._storage_index != TLS_OUT_OF_INDEXES) {
+        TlsFree(_hook_state._storage_index);
+        _hook_state._storage_index = TLS_OUT_OF_INDEXES;
+    }
+
+    if (keep_hooks)
+        return;
+
+    delete _the_manager;
+    _the_manager = nullptr;
+}
+
+void hook_state_prepare_stack_info()
+{
+    /// 堆栈报告可能多次输出，符号只需要初始化一次；之后加载的模块每次补上
+    if (_hook_state._stack_info_prepared) {
+        pEnumerateLoadedModulesW64(GetCurrentProcess(), attach_to_module, NULL);
+        return;
+    }
+
+    _hook_state._stack_info_prepared = true;
+    pSymSetOptions(SYMOPT_LOAD_LINES | SYMOPT_UNDNAME);
+
+    wchar_t program[MAX_PATH * 3] = { };
+    GetModuleFileName(NULL, program, MAX_PATH);
+
+    int prev = -1;
+    for (int i = 0; i < MAX_PATH && program[i]; i++) {
+        if (program[i] == L'\\') {
+            prev = i;
+        }
+    }
+
+    if (prev != -1) {
+        program[prev] = L'\0';
+    }
+
+    wcscpy(program + wcslen(program), L";D:\Microsoft Visual Studio 11.0\VC\lib");
+
+    if (!pSymInitializeW(GetCurrentProcess(), program, FALSE)) {
+        OutputDebugStringA("SymInitialize\n");
+    }
+
+    pEnumerateLoadedModulesW64(GetCurrentProcess(), attach_to_module, NULL);
+}
+
+#define BPREG Ebp
+#define FRAMEPOINTER(fp) __asm mov fp, BPREG // Copies the current frame pointer to the supplied variable.
+
+/// malloc和new的公共部分，堆栈从调用者传入的帧开始
+static void* hook_alloc(size_t size, uint32_t kind, SIZE_T* frame_pointer)
+{
+    if (!hook_state_tracking())
+        return malloc_func(size);
+
+    return hook_state_alloc(size, kind, frame_pointer);
+}
+
+static void hook_release(void* ptr, uint32_t kind)
+{
+    if (!hook_state_tracking())
+        return hook_state_free_untracked(ptr);
+
+    auto_heap_guard guard(nullptr);
+    hook_state_on_free(ptr, kind);
+}
+
+void* hook_malloc(size_t size)
+{
+    if (_hook_initializing)
+        return malloc_func(size);
+
+    SIZE_T* frame_pointer = NULL;
+    FRAMEPOINTER(frame_pointer);
+
+    return hook_alloc(size, ALLOC_MALLOC, frame_pointer);
+}
+
+void* hook_calloc(size_t n, size_t size)
+{
+    if (_hook_initializing)
+        return calloc_func(n, size);
+
+    if (!hook_state_tracking())
+        return calloc_func(n, size);
+
+    SIZE_T* frame_pointer = NULL;
+    FRAMEPOINTER(frame_pointer);
+
+    return hook_state_calloc(n, size, frame_pointer);
+}
+
+void* hook_realloc(void* ptr, size_t size)
+{
+    if (_hook_initializing)
+        return realloc_func(ptr, size);
+
+    if (ptr == nullptr)
+        return malloc(size);
+
+    if (size == 0) {
+        free(ptr);
+        return nullptr;
+    }
+
+    if (!hook_state_tracking())
+        return hook_state_untracked_realloc(ptr, size);
+
+    SIZE_T* frame_pointer = NULL;
+    FRAMEPOINTER(frame_pointer);
+
+    return hook_state_realloc(ptr, size, frame_pointer);
+}
+
+void hook_free(void* ptr)
+{
+    if (_hook_initializing)
+        return free_func(ptr);
+
+    if (ptr == nullptr)
+        return;
+
+    hook_release(ptr, ALLOC_MALLOC);
+}
+
+void* hook_new(size_t size)
+{
+    if (_hook_initializing)
+        return new_func(size);
+
+    SIZE_T* frame_pointer = NULL;
+    FRAMEPOINTER(frame_pointer);
+
+    /// 失败时交给CRT处理new_handler和bad_alloc
+    void* data = hook_alloc(size, ALLOC_NEW, frame_pointer);
+    return data != nullptr ? data : new_func(size);
+}
+
+void* hook_new_array(size_t size)
+{
+    if (_hook_initializing)
+        return new_array_func(size);
+
+    SIZE_T* frame_pointer = NULL;
+    FRAMEPOINTER(frame_pointer);
+
+    void* data = hook_alloc(size, ALLOC_NEW_ARRAY, frame_pointer);
+    return data != nullptr ? data : new_array_func(size);
+}
+
+void hook_delete(void* ptr)
+{
+    if (_hook_initializing)
+        return delete_func(ptr);
+
+    if (ptr == nullptr)
+        return;
+
+    hook_release(ptr, ALLOC_NEW);
+}
+
+void hook_delete_array(void* ptr)
+{
+    if (_hook_initializing)
+        return delete_array_func(ptr);
+
+    if (ptr == nullptr)
+        return;
+
+    hook_release(ptr, ALLOC_NEW_ARRAY);
+}
+
+#endif
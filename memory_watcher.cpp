@@ -1,621 +1,1577 @@
-#include "dbghelpapi.h"
-#include <crtdbg.h>
+#include <errno.h>
+#include <stdio.h>
 #include "memory_watcher.h"
-#include "mhook-lib/mhook.h"
+#include "hook_state.h"
+#include "event_pipeline.h"
+#include "virtual_memory.h"
 
-#define GUARD_NUM 0xcc
+hook_state _hook_state = { 0, FALSE, false, { 0, 16 }, { 0, 64 * 1024 * 1024 }, false, false };
 
-typedef void* (*malloc_t)(size_t size);
-typedef void* (*calloc_t)(size_t n, size_t size);
-typedef void* (*realloc_t)(void* ptr, size_t size);
-typedef void  (*free_t)(void* ptr);
+__declspec(thread) uint32_t _hook_depth;
 
-malloc_t malloc_func;
+__declspec(thread) bool _hook_initializing;
 
-calloc_t calloc_func;
+memory_watcher* _the_manager = nullptr;
 
-realloc_t realloc_func;
+event_pipeline* volatile _the_pipeline = nullptr; /// 异步模式下才创建
 
-free_t free_func;
+#define PIPELINE_USER_STRIPES 64 /// 投递事件的线程按TLS地址分散计数，分配线程之间不争用同一个缓存行
 
-struct hook_state
+struct __declspec(align(64)) pipeline_users
 {
-    DWORD  _storage_index;
+    volatile LONG _count;
+};
+
+static pipeline_users _pipeline_users[PIPELINE_USER_STRIPES];
 
-    bool   _initializing;
+/// 使用_the_pipeline期间持有，停止时先把指针换成空，等所有持有者退出后才删除
+class auto_pipeline
+{
+public:
+    auto_pipeline()
+    {
+        uint64_t key = (uint64_t)(uintptr_t)&_hook_depth * 0x9e3779b97f4a7c15ULL;
+        _users = &_pipeline_users[(key >> 32) % PIPELINE_USER_STRIPES];
 
-    bool   _enabled;
+        /// 先登记再读指针，和hook_state_stop_pipeline里先换指针再检查计数对应，两边都是完整的内存屏障
+        InterlockedIncrement(&_users->_count);
+        _pipeline = _the_pipeline;
+    }
 
-    CRITICAL_SECTION _mutex;
+    ~auto_pipeline() { InterlockedDecrement(&_users->_count); }
+
+    event_pipeline* operator->() const { return _pipeline; }
+
+    event_pipeline* get() const { return _pipeline; }
+
+    bool async() const { return _pipeline != nullptr && !event_pipeline::is_consumer_thread(); }
+private:
+    pipeline_users* _users;
+
+    event_pipeline* _pipeline;
 };
 
-hook_state _hook_state;
+static int64_t _the_stall_count = -1; /// 管线停止时的等待次数，退出时的统计里仍然输出；-1表示没有开启异步模式
 
-#define MAXMODULENAME 256
+void hook_state_set_delay_free_config(const delay_free_config& config)
+{
+    if (_the_manager != nullptr) {
+        _the_manager->set_delay_free_config(config);
+    }
+}
 
-#define currentprocess GetCurrentProcess()
-#define currentthread  GetCurrentThread()
+void hook_state_set_sample_interval(uint32_t interval)
+{
+    if (_the_manager != nullptr) {
+        _the_manager->set_sample_interval(interval);
+    }
+}
 
-BOOL WINAPI attach_to_module(PCWSTR modulepath, DWORD64 modulebase, ULONG modulesize, PVOID)
+void hook_state_set_resize_stack(bool enabled)
 {
-    size_t              count;
-    WCHAR               extension[_MAX_EXT];
-    WCHAR               filename[_MAX_FNAME];
-    IMAGEHLP_MODULE64   moduleimageinfo;
-    WCHAR               modulename[MAXMODULENAME + 1];
-    CHAR                modulepatha[MAX_PATH];
-    BOOL                refresh = FALSE;
+    if (_the_manager != nullptr) {
+        _the_manager->set_resize_stack(enabled);
+    }
+}
 
-    _wsplitpath_s(modulepath, NULL, 0, NULL, 0, filename, _MAX_FNAME, extension, _MAX_EXT);
-    wcsncpy_s(modulename, MAXMODULENAME + 1, filename, _TRUNCATE);
-    wcsncat_s(modulename, MAXMODULENAME + 1, extension, _TRUNCATE);
-    _wcslwr_s(modulename, MAXMODULENAME + 1);
+void hook_state_set_stack_walker(uint32_t walker)
+{
+    if (_the_manager != nullptr) {
+        _the_manager->set_stack_walker(walker);
+    }
+}
 
-    moduleimageinfo.SizeOfStruct = sizeof(IMAGEHLP_MODULE64);
-    wcstombs_s(&count, modulepatha, MAX_PATH, modulepath, _TRUNCATE);
-    if ((pSymGetModuleInfoW64(currentprocess, modulebase, &moduleimageinfo) == TRUE) ||
-        ((pSymLoadModule64(currentprocess, NULL, modulepatha, NULL, modulebase, modulesize) == modulebase) &&
-        (pSymGetModuleInfoW64(currentprocess, modulebase, &moduleimageinfo) == TRUE)))
-    {
+void hook_state_set_stack_depth(uint32_t depth)
+{
+    if (_the_manager != nullptr) {
+        _the_manager->set_stack_depth(depth);
     }
+}
+
+bool hook_state_set_redzone_config(const redzone_config& config)
+{
+    /// 已经记录的块按原来的大小申请，不能再改
+    if (_hook_state._enabled)
+        return false;
 
-    return TRUE;
+    uint32_t front_size = config._front_size < REDZONE_MAX_SIZE ? config._front_size : REDZONE_MAX_SIZE;
+    uint32_t rear_size = config._rear_size < REDZONE_MAX_SIZE ? config._rear_size : REDZONE_MAX_SIZE;
+    if (rear_size < REDZONE_ALIGNMENT) { rear_size = REDZONE_ALIGNMENT; }
+
+    _hook_state._redzone._front_size = (front_size + REDZONE_ALIGNMENT - 1) & ~(REDZONE_ALIGNMENT - 1);
+    _hook_state._redzone._rear_size = (rear_size + REDZONE_ALIGNMENT - 1) & ~(REDZONE_ALIGNMENT - 1);
+
+    if (_the_manager != nullptr) {
+        _the_manager->set_redzone_config(_hook_state._redzone);
+    }
+    return true;
 }
 
-memory_watcher* _the_manager = nullptr;
+bool hook_state_set_inline_header(bool enabled)
+{
+    /// 已经记录的块前面没有头部
+    if (_hook_state._enabled)
+        return false;
 
-void* hook_malloc(size_t size);
-void* hook_calloc(size_t n, size_t size);
-void* hook_realloc(void* ptr, size_t size);
-void  hook_free(void* ptr);
+    _hook_state._inline_header = enabled;
+    return true;
+}
 
-bool hook_state_initialize()
+bool hook_state_set_stack_trie(bool enabled)
 {
-    _hook_state._enabled = false;
-    _hook_state._storage_index = TLS_OUT_OF_INDEXES;
-    _the_manager = new memory_watcher;
+    /// 已经保存的堆栈不能换成另一种存法
+    if (_hook_state._enabled)
+        return false;
 
-    if (!link_debughelp_library()) {
-        OutputDebugStringA("link_debughelp_library\n");
+    _hook_state._stack_trie = enabled;
+    return true;
+}
+
+bool hook_state_add_skip_range(const void* start, size_t size)
+{
+    /// 获取堆栈时不加锁读取跳过列表
+    if (_hook_state._enabled)
         return false;
-    }
 
-    _hook_state._storage_index = TlsAlloc();
-    if (_hook_state._storage_index == TLS_OUT_OF_INDEXES) {
-        OutputDebugStringA("invalid storage index\n");
+    return addskiprange((SIZE_T)start, (SIZE_T)start + size) != FALSE;
+}
+
+bool hook_state_set_page_guard_config(const page_guard_config& config)
+{
+    /// 保护页池的地址空间在挂钩时保留
+    if (_hook_state._enabled)
         return false;
-    }
 
-    HMODULE module = LoadLibrary(L"msvcr110.dll");
-    malloc_func = (malloc_t)GetProcAddress(module, "malloc");
-    calloc_func = (calloc_t)GetProcAddress(module, "calloc");
-    realloc_func = (realloc_t)GetProcAddress(module, "realloc");
-    free_func = (free_t)GetProcAddress(module, "free");
-    if (malloc_func == nullptr || free_func == nullptr) {
-        OutputDebugStringA("GetProcAddress\n");
+    _hook_state._page_guard = config;
+    return true;
+}
+
+bool hook_state_get_thread_stats(uint32_t tid, thread_profile* result)
+{
+    if (_the_manager == nullptr)
         return false;
+
+    return _the_manager->thread_profile_of(tid, *result);
+}
+
+void hook_state_for_each_thread(thread_profile_callback callback, void* context)
+{
+    if (_the_manager != nullptr) {
+        _the_manager->for_each_thread(callback, context);
+    }
+}
+
+uint32_t hook_state_top_stacks(stack_profile* result, uint32_t count)
+{
+    if (_the_manager == nullptr)
+        return 0;
+
+    return _the_manager->top_stacks(result, count);
+}
+
+void hook_state_report_top_stacks(uint32_t count)
+{
+    if (_the_manager != nullptr) {
+        _the_manager->report_top_stacks(count);
     }
+}
 
-    InitializeCriticalSectionAndSpinCount(&_hook_state._mutex, 100);
+bool hook_state_subtree(const char* function, subtree_profile* result)
+{
+    if (_the_manager == nullptr)
+        return false;
 
-    _hook_state._initializing = true;
-    Mhook_SetHook((PVOID*)&free_func, hook_free);
-    Mhook_SetHook((PVOID*)&realloc_func, hook_realloc);
-    Mhook_SetHook((PVOID*)&malloc_func, hook_malloc);
-    Mhook_SetHook((PVOID*)&calloc_func, hook_calloc);
-    _hook_state._initializing = false;
-    _hook_state._enabled = true;
-    return true;
+    return _the_manager->subtree(function, *result);
 }
 
-void hook_state_uninitialize()
+void hook_state_report_subtree(const char* function)
 {
-    if (_hook_state._enabled) {
-        _hook_state._enabled = false;
-        Mhook_Unhook((PVOID*)&malloc_func);
-        Mhook_Unhook((PVOID*)&free_func);
+    if (_the_manager != nullptr) {
+        _the_manager->report_subtree(function);
+    }
+}
+
+uint32_t hook_state_size_classes(size_class_profile* result, uint32_t count)
+{
+    if (_the_manager == nullptr)
+        return 0;
+
+    return _the_manager->size_classes(result, count);
+}
 
-        DeleteCriticalSection(&_hook_state._mutex);
-        _the_manager->on_shutdown();
+void hook_state_report_size_classes()
+{
+    if (_the_manager != nullptr) {
+        _the_manager->report_size_classes();
     }
+}
+
+const heap_snapshot* hook_state_take_snapshot()
+{
+    if (_the_manager == nullptr)
+        return nullptr;
+
+    return _the_manager->take_snapshot();
+}
 
-    if (_hook_state._storage_index != TLS_OUT_OF_INDEXES) {
-        TlsFree(_hook_state._storage_index);
-        _hook_state._storage_index = TLS_OUT_OF_INDEXES;
+void hook_state_release_snapshot(const heap_snapshot* snapshot)
+{
+    if (_the_manager != nullptr) {
+        _the_manager->release_snapshot(snapshot);
     }
+}
+
+uint32_t hook_state_diff_snapshots(const heap_snapshot* a, const heap_snapshot* b, stack_growth* result, uint32_t count)
+{
+    if (_the_manager == nullptr)
+        return 0;
 
-    delete _the_manager;
-    _the_manager = nullptr;
+    return _the_manager->diff(a, b, result, count);
 }
 
-void hook_state_prepare_stack_info()
+void hook_state_report_snapshot_diff(const heap_snapshot* a, const heap_snapshot* b, uint32_t count)
 {
-    pSymSetOptions(SYMOPT_LOAD_LINES | SYMOPT_UNDNAME);
+    if (_the_manager != nullptr) {
+        _the_manager->report_diff(a, b, count);
+    }
+}
 
-    wchar_t program[MAX_PATH * 3] = { };
-    GetModuleFileName(NULL, program, MAX_PATH);
+void hook_state_start_pipeline()
+{
+    event_pipeline* pipeline = new event_pipeline(_the_manager);
+    if (!pipeline->start()) {
+        OutputDebugStringA("event_pipeline\n");
+        delete pipeline;
+        return;
+    }
 
-    int prev = -1;
-    for (int i = 0; i < MAX_PATH && program[i]; i++) {
-        if (program[i] == L'\\') {
-            prev = i;
-        }
+    /// realloc要知道旧块前面有多少保护区，异步模式下分配事件可能还没处理，查不到记录
+    if (_hook_state._redzone._front_size != 0) {
+        OutputDebugStringA("async mode disables front redzone\n");
+        _hook_state._redzone._front_size = 0;
     }
 
-    if (prev != -1) {
-        program[prev] = L'\0';
+    _the_manager->set_async(true);
+    InterlockedExchangePointer((PVOID volatile*)&_the_pipeline, pipeline);
+}
+
+void hook_state_stop_pipeline()
+{
+    event_pipeline* pipeline = (event_pipeline*)InterlockedExchangePointer((PVOID volatile*)&_the_pipeline, nullptr);
+    if (pipeline != nullptr) {
+        /// 之后的分配都同步处理，已经拿到指针的线程还可能在投递事件
+        for (auto& users : _pipeline_users) {
+            while (users._count != 0) {
+                Sleep(0);
+            }
+        }
+
+        /// 处理完队列中剩下的事件
+        pipeline->stop();
+        _the_stall_count = pipeline->stall_count();
+        delete pipeline;
+        _the_manager->set_async(false);
     }
+}
 
-    wcscpy(program + wcslen(program), L";D:\Microsoft Visual Studio 11.0\VC\lib");
+/// 异步模式下只投递事件，后台线程自己的分配仍然同步处理
+bool hook_state_async()
+{
+    return _the_pipeline != nullptr && !event_pipeline::is_consumer_thread();
+}
 
-    if (!pSymInitializeW(GetCurrentProcess(), program, FALSE)) {
-        OutputDebugStringA("SymInitialize\n");
+bool hook_state_pending_length(void* ptr, size_t& length)
+{
+    auto_hook_depth depth;
+    auto_pipeline pipeline;
+    if (pipeline.async()) {
+        if (pipeline->find_alloc(ptr, length))
+            return true;
+
+        /// 事件可能已经被后台线程取走还没有处理完
+        pipeline->flush();
     }
 
-    pEnumerateLoadedModulesW64(GetCurrentProcess(), attach_to_module, NULL);
+    memory_block block;
+    if (!_the_manager->find_block(ptr, block) || block._delay_free)
+        return false;
+
+    length = block._length;
+    return true;
 }
 
-class auto_heap_guard
+void hook_state_on_alloc(void* data, size_t size, uint32_t kind, uint32_t front_size)
 {
-public:
-    auto_heap_guard(SIZE_T* frame_pointer) : _will_reset(false)
-    {
-        EnterCriticalSection(&_hook_state._mutex);
-        TlsSetValue(_hook_state._storage_index, frame_pointer);
+    auto_hook_depth depth; /// 获取堆栈等内部代码可能申请内存
+    auto_pipeline pipeline;
+    if (pipeline.async()) {
+        pipeline->post(EVENT_ALLOC, data, size, _the_manager->capture_stack(size), kind, front_size);
+    } else {
+        _the_manager->on_memory_alloc(data, size, kind, front_size);
     }
+}
 
-    ~auto_heap_guard()
-    {
-        TlsSetValue(_hook_state._storage_index, nullptr);
-        LeaveCriticalSection(&_hook_state._mutex);
+void hook_state_on_free(void* ptr, uint32_t kind, size_t size)
+{
+    auto_hook_depth depth;
+    auto_pipeline pipeline;
+    if (pipeline.async()) {
+        pipeline->post(EVENT_FREE, ptr, size, 0, kind);
+    } else {
+        _the_manager->on_memory_free(ptr, true, kind, size);
     }
-private:
-    bool _will_reset;
-};
+}
 
-#define BPREG Ebp
-#define FRAMEPOINTER(fp) __asm mov fp, BPREG // Copies the current frame pointer to the supplied variable.
+memory_block* hook_state_begin_realloc(void* old_ptr)
+{
+    auto_hook_depth depth;
+    return _the_manager->begin_realloc(old_ptr);
+}
+
+void hook_state_end_realloc(memory_block* block, void* new_ptr, size_t size, uint32_t front_size)
+{
+    auto_hook_depth depth;
+    _the_manager->end_realloc(block, new_ptr, size, front_size);
+}
 
-void* hook_malloc(size_t size)
+void* hook_state_track(void* raw, size_t size, uint32_t front_size, uint32_t kind, SIZE_T* frame_pointer)
 {
-    if (_hook_state._initializing)
-        return malloc_func(size);
+    uint8_t* data = (uint8_t*)raw + front_size;
+    redzone_fill(raw, front_size);
+    redzone_fill(data + size, _the_manager->rear_size(data, size));
+    _the_manager->write_header(data, size);
+
+    auto_heap_guard guard(frame_pointer);
+    hook_state_on_alloc(data, size, kind, front_size);
+    return data;
+}
 
+void* hook_state_alloc_guarded(size_t size, uint32_t kind, SIZE_T* frame_pointer)
+{
     if (size == 0) { size = 4; }
 
-    uint8_t* data = (uint8_t*)malloc_func(size + 16);
+    void* data = _the_manager->guarded_alloc(size);
     if (data == nullptr)
         return nullptr;
 
-    for (size_t i = 0; i < 16; i++) {
-        data[size + i] = GUARD_NUM; /// 检查越界写，向前越界的比较少见，且暂时无法实现
-    }
+    return hook_state_track(data, size, 0, kind, frame_pointer);
+}
 
-    SIZE_T* frame_pointer = NULL;
-    FRAMEPOINTER(frame_pointer);
+void* hook_state_alloc(size_t size, uint32_t kind, SIZE_T* frame_pointer)
+{
+    if (size == 0) { size = 4; }
 
-    auto_heap_guard guard(frame_pointer);
-    if (_hook_state._enabled) {
-        _the_manager->on_memory_alloc(data, size);
-    }
+    void* data = hook_state_alloc_guarded(size, kind, frame_pointer);
+    if (data != nullptr)
+        return data;
 
-    return data;
+    uint32_t front_size = hook_state_front_size();
+    void* raw = malloc_func(front_size + size + _hook_state._redzone._rear_size);
+    if (raw == nullptr)
+        return nullptr;
+
+    return hook_state_track(raw, size, front_size, kind, frame_pointer);
 }
 
-void* hook_calloc(size_t n, size_t size)
+void* hook_state_calloc(size_t n, size_t size, SIZE_T* frame_pointer)
 {
-    if (_hook_state._initializing)
-        return calloc_func(n, size);
+    uint32_t front_size = hook_state_front_size();
+    uint32_t extra_size = front_size + _hook_state._redzone._rear_size;
+    if (n != 0 && size > ((size_t)-1 - extra_size) / n) {
+        errno = ENOMEM;
+        return nullptr;
+    }
 
     size *= n;
+    if (size == 0) { size = 4; }
 
-    uint8_t* data = (uint8_t*)malloc_func(size + 16);
-    if (data == nullptr)
+    void* data = hook_state_alloc_guarded(size, ALLOC_MALLOC, frame_pointer);
+    if (data != nullptr)
+        return data;
+
+    /// 交给原始的calloc清零，新映射的页面本来就是0，不会被逐页写一遍；之后只写保护区
+    void* raw = calloc_func(1, front_size + size + _hook_state._redzone._rear_size);
+    if (raw == nullptr)
         return nullptr;
 
-    memset(data, size, 0);
+    return hook_state_track(raw, size, front_size, ALLOC_MALLOC, frame_pointer);
+}
 
-    for (size_t i = 0; i < 16; i++) {
-        data[size + i] = GUARD_NUM; /// 检查越界写，向前越界的比较少见，且暂时无法实现
-    }
+/// 复制内容时旧块的大小，记录可能还没有建立
+static size_t hook_state_old_length(void* ptr)
+{
+    size_t length = 0;
+    if (_the_manager->header_length(ptr, length))
+        return length;
 
-    SIZE_T* frame_pointer = NULL;
-    FRAMEPOINTER(frame_pointer);
+    if (_the_manager->is_guarded(ptr))
+        return _the_manager->guarded_size(ptr);
 
-    auto_heap_guard guard(frame_pointer);
-    if (_hook_state._enabled) {
-        _the_manager->on_memory_alloc(data, size);
+    /// 有前置区时ptr不是原始分配器的指针，不能交给msize_func；头部跨页的块只在索引里
+    if (hook_state_front_size() != 0) {
+        memory_block block;
+        if (_the_manager->find_block(ptr, block))
+            return block._length;
+
+        if (hook_state_async() && hook_state_pending_length(ptr, length))
+            return length;
     }
 
-    return data;
+    return msize_func(ptr);
 }
 
-void* hook_realloc(void* ptr, size_t size)
+void* hook_state_realloc(void* ptr, size_t size, SIZE_T* frame_pointer)
 {
-    if (_hook_state._initializing)
-        return realloc_func(ptr, size);
+    if (hook_state_async() && size < REALLOC_LARGE_SIZE) {
+        /// 异步模式下不查记录，头部模式下从头部取大小；旧块要等后台线程处理完free才能释放
+        size_t old_size = hook_state_old_length(ptr);
 
-    if (ptr == nullptr)
-        return malloc(size);
+        void* data = hook_state_alloc(size, ALLOC_MALLOC, frame_pointer);
+        if (data == nullptr)
+            return nullptr;
 
-    if (size == 0) {
-        free(ptr);
-        return nullptr;
+        memcpy(data, ptr, old_size < size ? old_size : size);
+
+        auto_heap_guard guard(nullptr);
+        hook_state_on_free(ptr);
+        return data;
     }
 
-    uint8_t* data = (uint8_t*)realloc_func(ptr, size + 16);
-    if (data == nullptr)
+    /// 大块复制的开销远大于加锁查找，异步模式下也同步修改记录，让原始的realloc原地扩展或者用mremap搬移
+    memory_block block;
+    bool found = _the_manager->find_block(ptr, block);
+    if (found && block._delay_free) {
+        /// 对已经释放的内存realloc，按double free报告
+        auto_heap_guard guard(nullptr);
+        hook_state_on_free(ptr);
         return nullptr;
-
-    for (size_t i = 0; i < 16; i++) {
-        data[size + i] = GUARD_NUM; /// 检查越界写，向前越界的比较少见，且暂时无法实现
     }
 
-    SIZE_T* frame_pointer = NULL;
-    FRAMEPOINTER(frame_pointer);
+    if (found && !_the_manager->is_guarded(ptr)) {
+        /// 前面的保护区跟着内容一起搬，只需要重写后面的
+        uint32_t front_size = block._front_size;
+        uint32_t rear_size = _hook_state._redzone._rear_size;
+        memory_block* record = hook_state_begin_realloc(ptr);
+        uint8_t* raw = (uint8_t*)realloc_func((uint8_t*)ptr - front_size, front_size + size + rear_size);
+        if (raw == nullptr) {
+            hook_state_end_realloc(record, nullptr, 0, front_size);
+            return nullptr;
+        }
+
+        uint8_t* data = raw + front_size;
+        redzone_fill(data + size, rear_size);
 
-    auto_heap_guard guard(nullptr);
-    if (_hook_state._enabled) {
-        _the_manager->on_memory_realloc(ptr, data, size);
+        auto_heap_guard guard(frame_pointer);
+        hook_state_end_realloc(record, data, size, front_size);
+        return data;
     }
 
-    return data;
-}
+    if (!found && msize_func == nullptr)
+        return realloc_func(ptr, size);
 
-void hook_free(void* ptr)
-{
-    if (_hook_state._initializing)
-        return free_func(ptr);
+    /// 保护页池里的块和没有记录过的块都换一块新的，异步模式下分配事件可能还没处理
+    size_t old_size = found ? block._length : hook_state_old_length(ptr);
 
-    if (ptr == nullptr)
-        return;
+    void* data = hook_state_alloc(size, ALLOC_MALLOC, frame_pointer);
+    if (data == nullptr)
+        return nullptr;
 
-    {
+    memcpy(data, ptr, old_size < size ? old_size : size);
+
+    if (found || hook_state_async()) {
         auto_heap_guard guard(nullptr);
-        if (_hook_state._enabled) {
-            return _the_manager->on_memory_free(ptr);
-        }
+        hook_state_on_free(ptr);
+    } else {
+        free_func(ptr);
     }
 
-    free_func(ptr);
+    return data;
 }
 
-memory_watcher::memory_watcher()
+/// 记录过的块前面可能有保护区，或者在保护页池里，不能直接交给原始函数
+static bool find_untracked_block(void* ptr, memory_block& block)
 {
-    memset(_block_slots, 0, sizeof(_block_slots));
-    _delay_free_head = nullptr;
-    _delay_free_tail = nullptr;
+    /// 本线程在执行内部代码时，释放的都是内部申请的内存
+    if (_the_manager == nullptr || _hook_depth != 0)
+        return false;
 
-    _not_freed_count = 0;
+    /// 没有前置保护区、头部，也不在保护页池里时不用查找，不加锁
+    bool guarded = _the_manager->is_guarded(ptr);
+    if (hook_state_front_size() == 0 && !guarded)
+        return false;
 
-    _delay_free_block = 0;
-    _delay_free_memory_size = 0;
+    if (!_the_manager->find_block(ptr, block)) {
+        if (!guarded)
+            return false;
 
-    _current_block_count = 0;
-    _current_memory_size = 0;
-    
-    _max_block_count = 0;
-    _max_memory_size = 0;
-    _last_output_time = GetTickCount();
+        block._length = _the_manager->guarded_size(ptr);
+        block._front_size = 0;
+    }
 
-    block_pool_init();
+    return true;
 }
 
-void memory_watcher::block_pool_init()
+void* hook_state_untracked_realloc(void* ptr, size_t size)
 {
-    for (uint32_t i = 0; i < 1024 * 100 - 1; i++) {
-        _block_pool[i]._next = _block_pool + i + 1;
+    memory_block block;
+    if (!find_untracked_block(ptr, block))
+        return realloc_func(ptr, size);
+
+    /// 内容搬到新块的开头
+    void* data = malloc_func(size);
+    if (data != nullptr) {
+        memcpy(data, ptr, block._length < size ? block._length : size);
+        _the_manager->free_memory(ptr, block._front_size);
     }
+    return data;
+}
+
+void hook_state_free_untracked(void* ptr)
+{
+    memory_block block;
+    if (!find_untracked_block(ptr, block))
+        return free_func(ptr);
 
-    _block_pool[1024 * 100 - 1]._next = nullptr;
-    
-    _block_header = _block_pool;
+    _the_manager->free_memory(ptr, block._front_size);
 }
 
-memory_block* memory_watcher::block_pool_alloc()
+class auto_shard_guard
 {
-    if (_block_header != nullptr) {
-        auto block = _block_header;
-        _block_header = block->_next;
-        return block;
+public:
+    auto_shard_guard(memory_shard& shard) : _shard(shard)
+    {
+        EnterCriticalSection(&_shard._mutex);
     }
 
-    /// 尝试释放掉delay_free里面的元素
-    do_delay_free(true);
+    ~auto_shard_guard()
+    {
+        LeaveCriticalSection(&_shard._mutex);
+    }
+private:
+    memory_shard& _shard;
+
+    auto_shard_guard(const auto_shard_guard&);
+    auto_shard_guard& operator=(const auto_shard_guard&);
+};
+
+memory_watcher::memory_watcher()
+{
+    for (auto& shard : _shards) {
+        InitializeCriticalSectionAndSpinCount(&shard._mutex, 100);
+
+        memset(shard._delay_free_queues, 0, sizeof(shard._delay_free_queues));
+
+        shard._live_blocks = nullptr;
+
+        shard._not_freed_count = 0;
+
+        shard._delay_free_count = 0;
+        shard._delay_free_hit = 0;
+        shard._mismatch_count = 0;
 
-    if (_block_header != nullptr) {
-        auto block = _block_header;
-        _block_header = block->_next;
-        return block;
+        shard._current_block_count = 0;
+        shard._current_memory_size = 0;
+
+        shard._max_block_count = 0;
+        shard._max_memory_size = 0;
     }
 
-    /// 可能可以等其他地方释放
-    return nullptr;
+    _delay_free_config._max_memory_size = 64 * 1024 * 1024;
+    _delay_free_config._max_block_count = 1024 * 100;
+    _delay_free_config._large_block_size = 1024 * 1024;
+    _delay_free_config._large_max_memory_size = 16 * 1024 * 1024;
+    _large_delay_free_size = 0;
+
+    _rear_size = 16;
+    _header_size = 0;
+    _resize_stack = false;
+    _stack_walker = STACK_WALKER_SAFE;
+    _stack_depth = CALLSTACKDEFAULTDEPTH;
+
+    _max_block_count = 0;
+    _max_memory_size = 0;
+    _last_output_time = GetTickCount();
 }
 
-void memory_watcher::block_pool_free(memory_block* block)
+memory_watcher::~memory_watcher()
 {
-    block->_next = _block_header;
-    _block_header = block;
+    for (auto& shard : _shards) {
+        DeleteCriticalSection(&shard._mutex);
+    }
 }
 
-void memory_watcher::do_delay_free(bool force)
+void memory_watcher::do_delay_free(memory_shard& shard, bool force)
 {
-    if (force) { delay_free_one_block(); }
+    delay_free_queue& queue = shard._delay_free_queues[0];
+    delay_free_queue& large_queue = shard._delay_free_queues[1];
 
-    if (_delay_free_head == nullptr) return;
+    if (force) {
+        delay_free_one_block(shard, queue._head != nullptr ? queue : large_queue);
+    }
 
-    DWORD tick = GetTickCount();
-    while (_delay_free_head != nullptr) {
-        auto block = _delay_free_head;
-        if (block->_free_time + 1000 < tick || block->_free_time > tick) {
-            delay_free_one_block();
-        } else {
-            break;
-        }
+    /// 超过任意一个预算就按FIFO释放
+    uint64_t max_memory_size = _delay_free_config._max_memory_size / SHARD_COUNT;
+    uint32_t max_block_count = _delay_free_config._max_block_count / SHARD_COUNT;
+    while (queue._head != nullptr &&
+        (queue._memory_size > max_memory_size || queue._block_count > max_block_count)) {
+        delay_free_one_block(shard, queue);
+    }
+
+    /// 大块的预算平分到每个分片连一块都放不下，按所有分片合计
+    /// 只能释放本分片的块，其他分片多出来的等它们下一次释放大块时再处理
+    int64_t large_max_memory_size = (int64_t)_delay_free_config._large_max_memory_size;
+    while (large_queue._head != nullptr && _large_delay_free_size > large_max_memory_size) {
+        delay_free_one_block(shard, large_queue);
     }
 }
 
-void memory_watcher::delay_free_one_block()
+void memory_watcher::delay_free_one_block(memory_shard& shard, delay_free_queue& queue)
 {
-    if (_delay_free_head == nullptr) return;
+    if (queue._head == nullptr) return;
 
-    auto block = _delay_free_head;
-    _delay_free_head = _delay_free_head->_next;
-    if (_delay_free_head == nullptr) {
-        _delay_free_tail = nullptr;
+    auto block = queue._head;
+    queue._head = queue._head->_next;
+    if (queue._head == nullptr) {
+        queue._tail = nullptr;
     }
 
-    if (!validate_block(block)) {
-        report_heap_corruption(&block->_call_stack);
+    /// 保护页池里的块在释放时已经检查过，页面现在不可访问
+    bool guarded = _guard_pool.contains(block->_start_ptr);
+    if (!guarded && !validate_block(block)) {
+        report_heap_corruption(block->_stack_id);
     } else {
-        free_func(block->_start_ptr); /// delay free
+        unlink_record(shard, block);
+        if (guarded) {
+            _guard_pool.release(block->_start_ptr);
+        } else {
+            free_func((uint8_t*)block->_start_ptr - block->_front_size); /// delay free
+        }
+        _stack_table.release(block->_stack_id);
+        _stack_table.release(block->_resize_stack_id);
 
-        _delay_free_block--;
-        _delay_free_memory_size -= block->_length;
-        block_pool_free(block);
+        queue._block_count--;
+        queue._memory_size -= block->_length;
+        if (&queue == &shard._delay_free_queues[1]) {
+            InterlockedExchangeAdd64(&_large_delay_free_size, -(LONGLONG)block->_length);
+        }
+        _block_pool.free(block);
     }
 }
 
 bool memory_watcher::validate_block(memory_block* block)
 {
-    const uint8_t* data = (const uint8_t*)block->_start_ptr + block->_length;
-    for (size_t i = 0; i < 16; i++) {
-        if (data[i] != GUARD_NUM)
+    const uint8_t* data = (const uint8_t*)block->_start_ptr;
+    uint32_t header_size = 0;
+    if (!use_index(data)) {
+        const block_header* header = (const block_header*)(data - HEADER_SIZE);
+        if (!redzone_check(header->_guard, sizeof(header->_guard)))
             return false;
+
+        header_size = HEADER_SIZE;
+    } else if (_header_size != 0 && block->_front_size >= HEADER_SIZE) {
+        /// 头部跨页的块放在索引里，头部的位置没有填保护区，realloc还可能把旧头部搬过来
+        header_size = HEADER_SIZE;
     }
-    return true;
+
+    return redzone_check(data - block->_front_size, block->_front_size - header_size) &&
+        redzone_check(data + block->_length, rear_size(data, block->_length));
 }
 
-memory_block* memory_watcher::check_is_delay_free(void* ptr)
+uint32_t memory_watcher::capture_stack(size_t length)
 {
-    memory_block* curr = _delay_free_head;
-    while (curr != nullptr) {
-        if (curr->_start_ptr == ptr)
-            return curr;
+    /// 未采样的分配仍然记录，只是不获取堆栈
+    if (!_sampler.sample(length))
+        return 0;
+
+    SIZE_T* frame_pointer = (SIZE_T*)TlsGetValue(_hook_state._storage_index);
+    if (_stack_walker == STACK_WALKER_FAST) {
+        FastCallStack call_stack;
+        call_stack.getstacktrace(_stack_depth, frame_pointer);
+        return _stack_table.insert(call_stack);
+    }
 
-        curr = curr->_next;
+#ifndef _WIN32
+    if (_stack_walker == STACK_WALKER_CACHED) {
+        CachedCallStack call_stack;
+        call_stack.getstacktrace(_stack_depth, frame_pointer);
+        return _stack_table.insert(call_stack);
     }
+#endif
 
-    return nullptr;
+    SafeCallStack call_stack;
+    call_stack.getstacktrace(_stack_depth, frame_pointer);
+    return _stack_table.insert(call_stack);
 }
 
-void memory_watcher::on_memory_alloc(void* start_ptr, uint32_t length)
+void memory_watcher::on_memory_alloc(void* start_ptr, size_t length, uint32_t kind, uint32_t front_size)
 {
-    do_delay_free();
+    /// 在锁外获取堆栈，这是最耗时的部分
+    on_memory_alloc(start_ptr, length, capture_stack(length), kind, front_size, _thread_stats.current());
+}
 
-    auto block = block_pool_alloc();
-    if (block == nullptr)
+void memory_watcher::on_memory_alloc(void* start_ptr, size_t length, uint32_t stack_id, uint32_t kind, uint32_t front_size, thread_stats* thread)
+{
+    auto block = _block_pool.alloc();
+    if (block == nullptr) {
+        _stack_table.release(stack_id);
         return;
-
-    /// 统计信息
-    _current_block_count++;
-    _current_memory_size += length;
-
-    if (_current_block_count > _max_block_count) {
-        _max_block_count = _current_block_count;
-    }
-
-    if (_current_memory_size > _max_memory_size) {
-        _max_memory_size = _current_memory_size;
     }
 
     block->_start_ptr = start_ptr;
     block->_length = length;
-    block->_call_stack.getstacktrace(CALLSTACKCHUNKSIZE,
-        (SIZE_T*)TlsGetValue(_hook_state._storage_index));
+    block->_stack_id = stack_id;
+    block->_resize_stack_id = 0;
+    block->_sample_size = stack_id != 0 ? _sampler.weight(length) : 0;
+    block->_delay_free = false;
+    block->_kind = (uint8_t)kind;
+    block->_front_size = (uint16_t)front_size;
+    block->_next = nullptr;
+    block->_owner = thread;
+
+    memory_shard& shard = find_shard(start_ptr);
+    {
+        auto_shard_guard guard(shard);
+        if (!insert_record(shard, block)) {
+            _stack_table.release(block->_stack_id);
+            _block_pool.free(block);
+            return;
+        }
+
+        /// 统计信息
+        shard._current_block_count++;
+        shard._current_memory_size += length;
+        _stack_table.record_alloc(block->_stack_id, block->_sample_size);
 
-    uint32_t slot_index = find_block(start_ptr);
-    block->_next = _block_slots[slot_index];
-    _block_slots[slot_index] = block;
+        update_peak(shard);
+    }
+
+    _thread_stats.record_alloc(thread, length);
     output_memory_info();
 }
 
-void memory_watcher::on_memory_realloc(void* old_ptr, void* new_ptr, uint32_t new_length)
+memory_block* memory_watcher::begin_realloc(void* old_ptr)
 {
-    do_delay_free();
+    memory_block* curr = nullptr;
+    memory_shard& shard = find_shard(old_ptr);
+    {
+        auto_shard_guard guard(shard);
 
-    /// 查找条目
-    uint32_t slot_index = find_block(old_ptr);
-    memory_block* prev = nullptr;
-    memory_block* curr = _block_slots[slot_index];
-    while (curr != nullptr && curr->_start_ptr != old_ptr) {
-        prev = curr; curr = curr->_next;
+        curr = find_record(shard, old_ptr);
+
+        if (curr != nullptr && curr->_delay_free) {
+            /// 对已经释放的内存realloc，原来的记录留在队列里，新块重新记录
+            shard._delay_free_hit++;
+            report_heap_corruption(curr->_stack_id);
+            return nullptr;
+        }
+
+        if (curr == nullptr)
+            return nullptr;
+
+        if (curr->_kind != ALLOC_MALLOC) {
+            /// 对new出来的内存realloc
+            report_mismatch(shard, curr, ALLOC_MALLOC, 0);
+        }
+
+        /// 原始的realloc一返回，旧地址就可能被其他线程分配到并插入索引，记录要在这之前摘下来
+        unlink_record(shard, curr);
+        if (!use_index(old_ptr)) {
+            /// 头部跟着内容一起搬走，旧地址上的魔数要清掉，新地址上的在end_realloc里重写
+            ((block_header*)((uint8_t*)old_ptr - HEADER_SIZE))->_magic = 0;
+        }
+        shard._current_block_count--;
+        shard._current_memory_size -= curr->_length;
     }
 
-    /// 修改条目
-    if (old_ptr == new_ptr && curr != nullptr) {
-        _current_memory_size -= curr->_length;
-        _current_memory_size += new_length;
-        curr->_length = new_length;
+    return curr;
+}
+
+void memory_watcher::end_realloc(memory_block* curr, void* new_ptr, size_t new_length, uint32_t front_size)
+{
+    if (curr == nullptr) {
+        /// 没有记录过的块当作新分配
+        if (new_ptr != nullptr) {
+            on_memory_alloc(new_ptr, new_length, ALLOC_MALLOC, front_size);
+        }
+        return;
+    }
 
-        if (_current_memory_size > _max_memory_size) {
-            _max_memory_size = _current_memory_size;
+    if (new_ptr == nullptr) {
+        /// 原始的realloc失败，旧块还在，记录原样放回
+        memory_shard& target = find_shard(curr->_start_ptr);
+        auto_shard_guard guard(target);
+        if (!insert_record(target, curr)) {
+            _stack_table.release(curr->_stack_id);
+            _stack_table.release(curr->_resize_stack_id);
+            _block_pool.free(curr);
+            return;
         }
 
-        output_memory_info();
+        target._current_block_count++;
+        target._current_memory_size += curr->_length;
         return;
     }
 
-    /// 移除条目
-    if (curr != nullptr) {
-        if (prev == nullptr) {
-            _block_slots[slot_index] = curr->_next;
-        } else {
-            prev->_next = curr->_next;
+    /// 保留原来的分配堆栈，开启时按采样另外记录最后一次改变大小的堆栈
+    uint32_t resize_stack_id = _resize_stack ? capture_stack(new_length) : 0;
+    thread_stats* thread = _thread_stats.current();
+
+    _stack_table.record_free(curr->_stack_id, curr->_sample_size);
+    _thread_stats.record_realloc(thread, curr->_owner, curr->_length, new_length);
+
+    curr->_owner = thread;
+    curr->_start_ptr = new_ptr;
+    curr->_length = new_length;
+    curr->_front_size = (uint16_t)front_size;
+    curr->_sample_size = curr->_stack_id != 0 ? _sampler.weight(new_length) : 0;
+    if (resize_stack_id != 0) {
+        _stack_table.release(curr->_resize_stack_id);
+        curr->_resize_stack_id = resize_stack_id;
+    }
+
+    {
+        /// 新地址可能落在其他分片，记录本身不重新申请；头部模式下插入时重写搬过来的头部
+        memory_shard& target = find_shard(new_ptr);
+        auto_shard_guard guard(target);
+        if (!insert_record(target, curr)) {
+            _stack_table.release(curr->_stack_id);
+            _stack_table.release(curr->_resize_stack_id);
+            _block_pool.free(curr);
+            return;
         }
 
-        _current_block_count--;
-        _current_memory_size -= curr->_length;
-        block_pool_free(curr);
+        target._current_block_count++;
+        target._current_memory_size += new_length;
+        _stack_table.record_alloc(curr->_stack_id, curr->_sample_size);
+        update_peak(target);
     }
 
-    /// 添加条目
-    on_memory_alloc(new_ptr, new_length);
+    output_memory_info();
 }
 
-void memory_watcher::on_memory_free(void* start_ptr)
+bool memory_watcher::on_memory_free(void* start_ptr, bool free_untracked, uint32_t kind, size_t size, thread_stats* thread)
 {
-    do_delay_free();
+    memory_block* curr = nullptr;
+    memory_shard& shard = find_shard(start_ptr);
+    {
+        auto_shard_guard guard(shard);
 
-    uint32_t slot_index = find_block(start_ptr);
-    memory_block* prev = nullptr;
-    memory_block* curr = _block_slots[slot_index];
-    while (curr != nullptr) {
-        if (curr->_start_ptr == start_ptr)
-            break;
+        curr = find_record(shard, start_ptr);
+
+        if (curr == nullptr) {
+            if (!free_untracked)
+                return false;
 
-        prev = curr;
-        curr = curr->_next;
+            /// 可能是调用其他函数分配出来的
+            shard._not_freed_count++;
+        } else if (curr->_delay_free) {
+            /// 检查double free，delay free队列中的块仍在索引里
+            shard._delay_free_hit++;
+            report_heap_corruption(curr->_stack_id);
+        } else {
+            /// 已经查到了块，比较一下不需要额外的开销
+            if (curr->_kind != kind || (size != 0 && size != curr->_length)) {
+                report_mismatch(shard, curr, kind, size);
+            }
+
+            if (_guard_pool.contains(start_ptr)) {
+                /// 现在检查并且让页面不可访问，之后的访问会触发异常
+                if (!validate_block(curr)) {
+                    report_heap_corruption(curr->_stack_id);
+                }
+                _guard_pool.protect(start_ptr);
+            }
+
+            if (!use_index(start_ptr)) {
+                /// 只从存活链表里摘下，头部仍然指向记录，用来检查double free，_next要给队列用
+                unlink_record(shard, curr);
+            }
+
+            curr->_delay_free = true;
+            curr->_next = nullptr;
+
+            /// 统计信息
+            shard._current_block_count--;
+            shard._current_memory_size -= curr->_length;
+            _stack_table.record_free(curr->_stack_id, curr->_sample_size);
+            _thread_stats.record_free(thread != nullptr ? thread : _thread_stats.current(), curr->_owner, curr->_length);
+
+            /// 放入delay free队列，大块单独排队
+            bool large = curr->_length >= _delay_free_config._large_block_size;
+            delay_free_queue& queue = shard._delay_free_queues[large ? 1 : 0];
+            queue._block_count++;
+            queue._memory_size += curr->_length;
+            if (large) {
+                InterlockedExchangeAdd64(&_large_delay_free_size, curr->_length);
+            }
+            shard._delay_free_count++;
+
+            if (queue._head == nullptr) {
+                queue._head = queue._tail = curr;
+            } else {
+                queue._tail->_next = curr;
+                queue._tail = curr;
+            }
+
+            do_delay_free(shard);
+        }
     }
 
     if (curr == nullptr) {
-        /// 检查double free
-        memory_block* block = check_is_delay_free(start_ptr);
-        if (block != nullptr) {
-            report_heap_corruption(&curr->_call_stack);
-        }
+        free_memory(start_ptr, 0);
+        return false;
+    }
+
+    output_memory_info();
+
+    /// 立即删除
+    /// do_delay_free(true);
+    return true;
+}
+
+bool memory_watcher::find_block(void* start_ptr, memory_block& result)
+{
+    memory_shard& shard = find_shard(start_ptr);
+    auto_shard_guard guard(shard);
+
+    memory_block* curr = find_record(shard, start_ptr);
+    if (curr == nullptr)
+        return false;
+
+    result = *curr;
+    return true;
+}
+
+static uint32_t header_check(const void* start_ptr, const block_header* header)
+{
+    uintptr_t value = (uintptr_t)start_ptr ^ (uintptr_t)header->_block;
+    uint64_t length = header->_length;
+    return (uint32_t)value ^ (uint32_t)((uint64_t)value >> 32) ^ (uint32_t)length ^ (uint32_t)(length >> 32) ^
+        header->_stack_id ^ HEADER_MAGIC;
+}
+
+void memory_watcher::write_header(void* start_ptr, size_t length)
+{
+    if (use_index(start_ptr))
+        return;
+
+    block_header* header = (block_header*)((uint8_t*)start_ptr - HEADER_SIZE);
+    header->_magic = HEADER_MAGIC;
+    header->_block = nullptr;
+    header->_length = length;
+    header->_stack_id = 0;
+    header->_check = header_check(start_ptr, header);
+    redzone_fill(header->_guard, sizeof(header->_guard));
+}
+
+bool memory_watcher::header_length(void* start_ptr, size_t& length)
+{
+    if (use_index(start_ptr))
+        return false;
+
+    /// 长度在分配时写好，之后只有原地realloc会修改
+    const block_header* header = (const block_header*)((uint8_t*)start_ptr - HEADER_SIZE);
+    if (header->_magic != HEADER_MAGIC)
+        return false;
+
+    length = header->_length;
+    return true;
+}
+
+bool memory_watcher::use_index(const void* start_ptr) const
+{
+    if (_header_size == 0)
+        return true;
+
+    /// 头部跨页时前一页可能没有映射，其他分配器的指针（比如mmap出来的大块）读头部会崩溃
+    /// 这样的地址不到1%，这里分配的也放在索引里，只有确认在同一页里时才读头部
+    if (((uintptr_t)start_ptr & (HEADER_PAGE_SIZE - 1)) < HEADER_SIZE)
+        return true;
+
+    /// 保护页池里的块释放后页面不可访问，读不了头部，仍然放在索引里
+    return _guard_pool.contains(start_ptr);
+}
+
+memory_block* memory_watcher::find_record(memory_shard& shard, void* start_ptr)
+{
+    if (use_index(start_ptr))
+        return shard._index.find(start_ptr);
+
+    /// 魔数不对的是其他分配器的指针，和索引里查不到一样处理
+    block_header* header = (block_header*)((uint8_t*)start_ptr - HEADER_SIZE);
+    if (header->_magic != HEADER_MAGIC)
+        return nullptr;
 
-        /// 可能是调用其他函数分配出来的
-        _not_freed_count++;
-        return free_func(start_ptr);
+    /// 异步模式下分配事件还没有处理
+    if (header->_block == nullptr)
+        return nullptr;
+
+    if (header->_check != header_check(start_ptr, header) || header->_block->_start_ptr != start_ptr) {
+        report_heap_corruption(0);
+        return nullptr;
     }
 
-    if (prev == nullptr) {
-        _block_slots[slot_index] = curr->_next;
-    } else {
-        prev->_next = curr->_next;
+    return header->_block;
+}
+
+bool memory_watcher::insert_record(memory_shard& shard, memory_block* block)
+{
+    if (use_index(block->_start_ptr))
+        return shard._index.insert(block->_start_ptr, block);
+
+    block->_prev = nullptr;
+    block->_next = shard._live_blocks;
+    if (shard._live_blocks != nullptr) {
+        shard._live_blocks->_prev = block;
     }
+    shard._live_blocks = block;
+
+    update_header(block);
+    return true;
+}
+
+void memory_watcher::update_header(memory_block* block)
+{
+    if (use_index(block->_start_ptr))
+        return;
+
+    block_header* header = (block_header*)((uint8_t*)block->_start_ptr - HEADER_SIZE);
+    header->_magic = HEADER_MAGIC;
+    header->_block = block;
+    header->_length = block->_length;
+    header->_stack_id = block->_stack_id;
+    header->_check = header_check(block->_start_ptr, header);
+}
 
-    curr->_free_time = GetTickCount();
-    curr->_next = nullptr;
+void memory_watcher::unlink_record(memory_shard& shard, memory_block* block)
+{
+    if (use_index(block->_start_ptr)) {
+        shard._index.erase(block->_start_ptr);
+        return;
+    }
 
-    /// 放入delay free队列
-    _delay_free_block++;
-    _delay_free_memory_size += curr->_length;
+    if (block->_delay_free) {
+        /// 内存马上要还回去，清掉魔数，地址复用时不会误认
+        ((block_header*)((uint8_t*)block->_start_ptr - HEADER_SIZE))->_magic = 0;
+        return;
+    }
 
-    if (_delay_free_head == nullptr) {
-        _delay_free_head = _delay_free_tail = curr;
+    if (block->_prev != nullptr) {
+        block->_prev->_next = block->_next;
     } else {
-        _delay_free_tail->_next = curr;
-        _delay_free_tail = curr;
+        shard._live_blocks = block->_next;
     }
 
-    /// 统计信息
-    _current_block_count--;
-    _current_memory_size -= curr->_length;
-    output_memory_info();
+    if (block->_next != nullptr) {
+        block->_next->_prev = block->_prev;
+    }
+}
 
-    /// 立即删除
-    /// do_delay_free(true);
+void* memory_watcher::guarded_alloc(size_t size)
+{
+    if (!_guard_pool.sample())
+        return nullptr;
+
+    return _guard_pool.alloc(size);
+}
+
+uint32_t memory_watcher::rear_size(const void* start_ptr, size_t length) const
+{
+    /// 保护页池里的块紧贴保护页，只有对齐多出来的几个字节
+    if (_guard_pool.contains(start_ptr))
+        return (uint32_t)(((length + REDZONE_ALIGNMENT - 1) & ~(REDZONE_ALIGNMENT - 1)) - length);
+
+    return _rear_size;
+}
+
+void memory_watcher::free_memory(void* start_ptr, uint32_t front_size)
+{
+    if (_guard_pool.contains(start_ptr)) {
+        _guard_pool.protect(start_ptr);
+        _guard_pool.release(start_ptr);
+    } else {
+        free_func((uint8_t*)start_ptr - front_size);
+    }
 }
 
 void memory_watcher::on_shutdown()
 {
-    while (_delay_free_head != nullptr) {
-        do_delay_free(true);
+    for (auto& shard : _shards) {
+        auto_shard_guard guard(shard);
+        while (shard._delay_free_queues[0]._head != nullptr ||
+            shard._delay_free_queues[1]._head != nullptr) {
+            do_delay_free(shard, true);
+        }
     }
 
     report_heap_leak();
 }
 
-uint32_t memory_watcher::find_block(void* start_ptr)
+void memory_watcher::set_delay_free_config(const delay_free_config& config)
+{
+    /// 新的预算在下一次释放时生效，逐个字段原子写入，读取的一方不会看到写了一半的值
+    InterlockedExchange64((volatile LONGLONG*)&_delay_free_config._max_memory_size, (LONGLONG)config._max_memory_size);
+    InterlockedExchange((volatile LONG*)&_delay_free_config._max_block_count, (LONG)config._max_block_count);
+    InterlockedExchange((volatile LONG*)&_delay_free_config._large_block_size, (LONG)config._large_block_size);
+    InterlockedExchange64((volatile LONGLONG*)&_delay_free_config._large_max_memory_size, (LONGLONG)config._large_max_memory_size);
+}
+
+void memory_watcher::set_sample_interval(uint32_t interval)
+{
+    _sampler.set_interval(interval);
+}
+
+void memory_watcher::set_resize_stack(bool enabled)
 {
-    uint32_t pos = (uint32_t)start_ptr;
-    return pos / (1024 * 4);
+    _resize_stack = enabled;
 }
 
-void memory_watcher::report_heap_corruption(CallStack* call_stack)
+void memory_watcher::set_stack_walker(uint32_t walker)
 {
-    _hook_state._enabled = false;
+    _stack_walker = walker;
+}
+
+void memory_watcher::set_stack_depth(uint32_t depth)
+{
+    if (depth == 0) { depth = 1; }
+    if (depth > CALLSTACKMAXDEPTH) { depth = CALLSTACKMAXDEPTH; }
+    _stack_depth = depth;
+}
+
+void memory_watcher::set_redzone_config(const redzone_config& config)
+{
+    _rear_size = config._rear_size;
+}
+
+void memory_watcher::set_inline_header(bool enabled)
+{
+    _header_size = enabled ? HEADER_SIZE : 0;
+}
+
+void memory_watcher::set_stack_trie(bool enabled)
+{
+    if (!_stack_table.set_trie(enabled)) {
+        OutputDebugStringA("stack_table set_trie\n");
+    }
+}
+
+void memory_watcher::set_page_guard_config(const page_guard_config& config)
+{
+    if (config._sample_interval != 0 && !_guard_pool.reserve(config)) {
+        OutputDebugStringA("guard_pool reserve\n");
+    }
+}
+
+memory_shard& memory_watcher::find_shard(void* start_ptr)
+{
+    return _shards[block_index::hash(start_ptr) % SHARD_COUNT];
+}
+
+void memory_watcher::update_peak(memory_shard& shard)
+{
+    bool block_count_changed = shard._current_block_count > shard._max_block_count;
+    bool memory_size_changed = shard._current_memory_size > shard._max_memory_size;
+    if (!block_count_changed && !memory_size_changed)
+        return;
+
+    if (block_count_changed) {
+        shard._max_block_count = shard._current_block_count;
+    }
+
+    if (memory_size_changed) {
+        shard._max_memory_size = shard._current_memory_size;
+    }
+
+    /// 分片峰值变化时才合并，不加其他分片的锁
+    LONG block_count = 0;
+    LONGLONG memory_size = 0;
+    for (auto& item : _shards) {
+        block_count += item._current_block_count;
+        memory_size += item._current_memory_size;
+    }
+
+    LONG prev;
+    while ((prev = _max_block_count) < block_count) {
+        if (InterlockedCompareExchange(&_max_block_count, block_count, prev) == prev)
+            break;
+    }
+
+    LONGLONG prev_size;
+    while ((prev_size = _max_memory_size) < memory_size) {
+        if (InterlockedCompareExchange64(&_max_memory_size, memory_size, prev_size) == prev_size)
+            break;
+    }
+}
+
+void memory_watcher::report_heap_corruption(uint32_t stack_id)
+{
+    auto_hook_depth depth;
 
     hook_state_prepare_stack_info();
     OutputDebugStringA("report_heap_corruption");
 
-    call_stack->dump(FALSE);
+    _stack_table.dump(stack_id);
     abort();
 }
 
-void report(LPCWSTR format, ...);
+void memory_watcher::report_mismatch(memory_shard& shard, memory_block* block, uint32_t kind, size_t size)
+{
+    /// 不配对通常不会马上出错，只报告不中止
+    static const char* kind_names[] = { "malloc/free", "new/delete", "new[]/delete[]" };
+
+    shard._mismatch_count++;
+
+    auto_hook_depth depth;
+
+    hook_state_prepare_stack_info();
+    OutputDebugStringA("report_mismatch\n");
+
+    char buffer[128];
+    sprintf_s(buffer, "%p, allocated by %s, released by %s, length %llu, size %llu\n", block->_start_ptr,
+        kind_names[block->_kind % 3], kind_names[kind % 3], (unsigned long long)block->_length, (unsigned long long)size);
+    OutputDebugStringA(buffer);
+
+    _stack_table.dump(block->_stack_id);
+
+}
+
+uint32_t memory_watcher::top_stacks(stack_profile* result, uint32_t count)
+{
+    return _stack_table.top(result, count);
+}
+
+void memory_watcher::report_top_stacks(uint32_t count)
+{
+    stack_profile result[64];
+    if (count > 64) { count = 64; }
+    count = top_stacks(result, count);
+
+    auto_hook_depth depth;
+
+    hook_state_prepare_stack_info();
+    OutputDebugStringA("report_top_stacks\n");
+
+    /// 采样模式下字节数是加权后的估计，次数是采样到的次数
+    report(L"sample_interval, %d\n", _sampler.interval());
+
+    for (uint32_t i = 0; i < count; i++) {
+        report(L"top_stack(%02d), live_size %lld, live_count %d, alloc_size %lld, free_size %lld\n",
+            i + 1, result[i]._live_size, result[i]._live_count, result[i]._alloc_size, result[i]._free_size);
+        _stack_table.dump(result[i]._stack_id);
+    }
+
+}
+
+bool memory_watcher::subtree(const char* function, subtree_profile& result)
+{
+    /// 查符号时可能申请内存
+    auto_hook_depth depth;
+
+    hook_state_prepare_stack_info();
+    return _stack_table.subtree(function, result);
+}
+
+void memory_watcher::report_subtree(const char* function)
+{
+    subtree_profile result;
+    if (!subtree(function, result))
+        return;
+
+    auto_hook_depth depth;
+    OutputDebugStringA("report_subtree\n");
+
+    char buffer[MAXFUNCTIONNAMELENGTH + 160];
+    sprintf_s(buffer, "subtree, %s, node_count %u, stack_count %u, live_count %u, live_size %lld, alloc_size %lld\n",
+        function, result._node_count, result._stack_count, result._live_count,
+        (long long)result._live_size, (long long)result._alloc_size);
+    OutputDebugStringA(buffer);
+}
+
+void memory_watcher::report_size_classes()
+{
+    size_class_profile result[SIZE_CLASS_COUNT];
+    uint32_t count = size_classes(result, SIZE_CLASS_COUNT);
+
+    auto_hook_depth depth;
+    OutputDebugStringA("report_size_classes\n");
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (result[i]._alloc_count == 0)
+            continue;
+
+        char buffer[128];
+        sprintf_s(buffer, "size_class, %llu, alloc_count %llu, live_count %lld\n",
+            (unsigned long long)result[i]._min_size, (unsigned long long)result[i]._alloc_count, (long long)result[i]._live_count);
+        OutputDebugStringA(buffer);
+    }
+}
+
+const heap_snapshot* memory_watcher::take_snapshot()
+{
+    /// 之后新增的堆栈不在快照里
+    uint32_t capacity = _stack_table.stack_count();
+    size_t size = sizeof(heap_snapshot) + sizeof(snapshot_entry) * (capacity > 0 ? capacity - 1 : 0);
+
+    heap_snapshot* snapshot = (heap_snapshot*)virtual_alloc(size);
+    if (snapshot == nullptr)
+        return nullptr;
+
+    snapshot->_tick = GetTickCount();
+    snapshot->_size = size;
+    snapshot->_entry_count = _stack_table.snapshot(snapshot->_entries, capacity);
+
+    /// 和output_memory_info一样不加锁读取
+    snapshot->_block_count = 0;
+    snapshot->_memory_size = 0;
+    for (auto& shard : _shards) {
+        snapshot->_block_count += shard._current_block_count;
+        snapshot->_memory_size += shard._current_memory_size;
+    }
+
+    return snapshot;
+}
+
+void memory_watcher::release_snapshot(const heap_snapshot* snapshot)
+{
+    if (snapshot != nullptr) {
+        virtual_free((void*)snapshot, snapshot->_size);
+    }
+}
+
+uint32_t memory_watcher::diff(const heap_snapshot* a, const heap_snapshot* b, stack_growth* result, uint32_t count)
+{
+    if (a == nullptr || b == nullptr)
+        return 0;
+
+    /// 两边都按id升序，归并一遍
+    uint32_t found = 0;
+    uint32_t i = 0, j = 0;
+    while ((i < a->_entry_count || j < b->_entry_count) && count > 0) {
+        const snapshot_entry* before = i < a->_entry_count ? &a->_entries[i] : nullptr;
+        const snapshot_entry* after = j < b->_entry_count ? &b->_entries[j] : nullptr;
+
+        stack_growth growth;
+        if (after == nullptr || (before != nullptr && before->_stack_id < after->_stack_id)) {
+            growth._stack_id = before->_stack_id;
+            growth._count_delta = -(int32_t)before->_live_count;
+            growth._size_delta = -before->_live_size;
+            i++;
+        } else if (before == nullptr || after->_stack_id < before->_stack_id) {
+            growth._stack_id = after->_stack_id;
+            growth._count_delta = (int32_t)after->_live_count;
+            growth._size_delta = after->_live_size;
+            j++;
+        } else {
+            growth._stack_id = after->_stack_id;
+            growth._count_delta = (int32_t)after->_live_count - (int32_t)before->_live_count;
+            growth._size_delta = after->_live_size - before->_live_size;
+            i++;
+            j++;
+        }
+
+        if (growth._size_delta <= 0)
+            continue;
+
+        if (found == count && result[found - 1]._size_delta >= growth._size_delta)
+            continue;
+
+        uint32_t pos = found < count ? found++ : found - 1;
+        while (pos > 0 && result[pos - 1]._size_delta < growth._size_delta) {
+            result[pos] = result[pos - 1];
+            pos--;
+        }
+        result[pos] = growth;
+    }
+
+    return found;
+}
+
+void memory_watcher::report_diff(const heap_snapshot* a, const heap_snapshot* b, uint32_t count)
+{
+    if (a == nullptr || b == nullptr)
+        return;
+
+    stack_growth result[64];
+    if (count > 64) { count = 64; }
+    count = diff(a, b, result, count);
+
+    auto_hook_depth depth;
+
+    hook_state_prepare_stack_info();
+    OutputDebugStringA("report_snapshot_diff\n");
+
+    report(L"snapshot_diff, %d ms, block_count %d -> %d, memory_size %lld -> %lld\n",
+        b->_tick - a->_tick, a->_block_count, b->_block_count, a->_memory_size / 1024, b->_memory_size / 1024);
+
+    for (uint32_t i = 0; i < count; i++) {
+        report(L"growth(%02d), size_delta %lld, count_delta %d\n",
+            i + 1, result[i]._size_delta, result[i]._count_delta);
+        _stack_table.dump(result[i]._stack_id);
+    }
+
+}
 
 void memory_watcher::report_heap_leak()
 {
-    _hook_state._enabled = false;
+    auto_hook_depth depth;
 
     hook_state_prepare_stack_info();
     OutputDebugStringA("report_heap_leak\n");
 
     uint32_t index = 0;
-    for (auto block : _block_slots) {
-        while (block != nullptr) {
-            report(L"heap_leak(%05d), %p, %d\n",
-                ++index, block->_start_ptr, block->_length);
-            block->_call_stack.dump(FALSE);
-            block = block->_next;
+    for (auto& shard : _shards) {
+        auto_shard_guard guard(shard);
+        auto report_block = [this, &index](memory_block* block) {
+            if (block->_delay_free)
+                return;
+
+            report(L"heap_leak(%05d), %p, %llu\n",
+                ++index, block->_start_ptr, (unsigned long long)block->_length);
+            _stack_table.dump(block->_stack_id);
+
+            if (block->_resize_stack_id != 0) {
+                OutputDebugStringA("last_resized_by\n");
+                _stack_table.dump(block->_resize_stack_id);
+            }
+        };
+
+        shard._index.for_each(report_block);
+        for (memory_block* block = shard._live_blocks; block != nullptr; block = block->_next) {
+            report_block(block);
         }
     }
 
     output_memory_info(true);
 }
 
-#include <stdio.h>
-
 void memory_watcher::output_memory_info(bool force)
 {
     DWORD tick = GetTickCount();
-    if (force || _last_output_time + 10000 < tick || tick < _last_output_time) {
-        _last_output_time = tick;
+    DWORD last_output_time = (DWORD)_last_output_time;
+    if (force || last_output_time + 10000 < tick || tick < last_output_time) {
+        /// 只让一个线程输出
+        if (InterlockedCompareExchange(&_last_output_time, (LONG)tick, (LONG)last_output_time) != (LONG)last_output_time && !force)
+            return;
+
+        /// 合并各分片的统计信息，不加锁读取
+        uint32_t not_freed_count = 0;
+        uint32_t delay_free_block = 0;
+        uint64_t delay_free_memory_size = 0;
+        uint64_t large_delay_free_memory_size = 0;
+        uint32_t delay_free_count = 0;
+        uint32_t delay_free_hit = 0;
+        uint32_t mismatch_count = 0;
+        uint32_t current_block_count = 0;
+        uint64_t current_memory_size = 0;
+        for (auto& shard : _shards) {
+            not_freed_count += shard._not_freed_count;
+            delay_free_block += shard._delay_free_queues[0]._block_count + shard._delay_free_queues[1]._block_count;
+            delay_free_memory_size += shard._delay_free_queues[0]._memory_size;
+            large_delay_free_memory_size += shard._delay_free_queues[1]._memory_size;
+            delay_free_count += shard._delay_free_count;
+            delay_free_hit += shard._delay_free_hit;
+            mismatch_count += shard._mismatch_count;
+            current_block_count += shard._current_block_count;
+            current_memory_size += shard._current_memory_size;
+        }
 
-        _hook_state._enabled = false; /// 防止内部使用函数造成嵌套
+        auto_hook_depth depth; /// 防止内部使用函数造成嵌套，不影响其他线程
 
         char not_freed_count_buffer[64];
-        sprintf_s(not_freed_count_buffer, "not_freed_count, %d\n", _not_freed_count);
+        sprintf_s(not_freed_count_buffer, "not_freed_count, %d\n", not_freed_count);
         OutputDebugStringA(not_freed_count_buffer);
 
         char delay_free_block_count_buffer[64];
-        sprintf_s(delay_free_block_count_buffer, "delay_free_block_count, %d\n", _delay_free_block);
+        sprintf_s(delay_free_block_count_buffer, "delay_free_block_count, %d\n", delay_free_block);
         OutputDebugStringA(delay_free_block_count_buffer);
 
         char delay_free_memory_size_buffer[64];
-        sprintf_s(delay_free_memory_size_buffer, "delay_free_memory_size, %d\n", _delay_free_memory_size / 1024);
+        sprintf_s(delay_free_memory_size_buffer, "delay_free_memory_size, %lld\n", delay_free_memory_size / 1024);
         OutputDebugStringA(delay_free_memory_size_buffer);
 
+        char large_delay_free_memory_size_buffer[64];
+        sprintf_s(large_delay_free_memory_size_buffer, "large_delay_free_memory_size, %lld\n", large_delay_free_memory_size / 1024);
+        OutputDebugStringA(large_delay_free_memory_size_buffer);
+
+        /// 队列占用预算的比例
+        uint64_t max_memory_size = _delay_free_config._max_memory_size;
+        char delay_free_usage_buffer[64];
+        sprintf_s(delay_free_usage_buffer, "delay_free_usage, %d%%\n",
+            max_memory_size != 0 ? (uint32_t)(delay_free_memory_size * 100 / max_memory_size) : 0);
+        OutputDebugStringA(delay_free_usage_buffer);
+
+        char delay_free_hit_buffer[64];
+        sprintf_s(delay_free_hit_buffer, "delay_free_hit, %d/%d\n", delay_free_hit, delay_free_count);
+        OutputDebugStringA(delay_free_hit_buffer);
+
+        char mismatch_count_buffer[64];
+        sprintf_s(mismatch_count_buffer, "mismatch_count, %d\n", mismatch_count);
+        OutputDebugStringA(mismatch_count_buffer);
+
         char block_count_buffer[64];
-        sprintf_s(block_count_buffer, "block_count, %d\n", _current_block_count);
+        sprintf_s(block_count_buffer, "block_count, %d\n", current_block_count);
         OutputDebugStringA(block_count_buffer);
 
         char memory_size_buffer[64];
-        sprintf_s(memory_size_buffer, "memory_size, %d\n", _current_memory_size / 1024);
+        sprintf_s(memory_size_buffer, "memory_size, %lld\n", current_memory_size / 1024);
         OutputDebugStringA(memory_size_buffer);
 
+        char block_pool_count_buffer[64];
+        sprintf_s(block_pool_count_buffer, "block_pool_count, %d\n", _block_pool.block_count());
+        OutputDebugStringA(block_pool_count_buffer);
+
+        char stack_count_buffer[64];
+        sprintf_s(stack_count_buffer, "stack_count, %d\n", _stack_table.stack_count());
+        OutputDebugStringA(stack_count_buffer);
+
+        char stack_saved_size_buffer[64];
+        sprintf_s(stack_saved_size_buffer, "stack_saved_size, %lld\n", _stack_table.saved_size() / 1024);
+        OutputDebugStringA(stack_saved_size_buffer);
+
+        char stack_frame_buffer[96];
+        sprintf_s(stack_frame_buffer, "stack_frames, %lld, %lld bytes, depth %d\n",
+            (long long)_stack_table.frame_count(), (long long)_stack_table.encoded_size(), _stack_depth);
+        OutputDebugStringA(stack_frame_buffer);
+
+        if (_stack_table.use_trie()) {
+            char stack_node_buffer[64];
+            sprintf_s(stack_node_buffer, "stack_nodes, %d\n", _stack_table.node_count());
+            OutputDebugStringA(stack_node_buffer);
+        }
+
+        char sample_interval_buffer[64];
+        sprintf_s(sample_interval_buffer, "sample_interval, %d\n", _sampler.interval());
+        OutputDebugStringA(sample_interval_buffer);
+
+        char redzone_buffer[64];
+        sprintf_s(redzone_buffer, "redzone, %d/%d, %s\n",
+            _hook_state._redzone._front_size, _rear_size, redzone_kernel());
+        OutputDebugStringA(redzone_buffer);
+
+        char page_guard_buffer[64];
+        sprintf_s(page_guard_buffer, "page_guard, %d/%d\n", _guard_pool.used_pages(), _guard_pool.page_count());
+        OutputDebugStringA(page_guard_buffer);
+
+        auto_pipeline pipeline;
+        if (pipeline.get() != nullptr || _the_stall_count >= 0) {
+            /// 分配线程因为队列满等待后台线程的次数，持续增长说明后台线程跟不上
+            char event_stall_buffer[64];
+            sprintf_s(event_stall_buffer, "event_stall_count, %lld\n",
+                pipeline.get() != nullptr ? (long long)pipeline->stall_count() : (long long)_the_stall_count);
+            OutputDebugStringA(event_stall_buffer);
+        }
+
+        char thread_count_buffer[64];
+        sprintf_s(thread_count_buffer, "thread_count, %d\n", _thread_stats.count());
+        OutputDebugStringA(thread_count_buffer);
+
         char max_block_count_buffer[64];
         sprintf_s(max_block_count_buffer, "max_block_count, %d\n", _max_block_count);
         OutputDebugStringA(max_block_count_buffer);
 
         char max_memory_size_buffer[64];
-        sprintf_s(max_memory_size_buffer, "max_memory_size, %d\n", _max_memory_size / 1024);
+        sprintf_s(max_memory_size_buffer, "max_memory_size, %lld\n", _max_memory_size / 1024);
         OutputDebugStringA(max_memory_size_buffer);
 
-        _hook_state._enabled = true;
     }
 }
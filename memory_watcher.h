@@ -1,20 +1,133 @@
 #pragma once
 #include <stdint.h>
 #include "callstack.h"
+#include "block_index.h"
+#include "block_pool.h"
+#include "stack_table.h"
+#include "heap_sampler.h"
+#include "redzone.h"
+#include "guard_pool.h"
+#include "thread_stats.h"
 
 /// https://github.com/KindDragon/vld
 
+#ifndef SHARD_COUNT
+#define SHARD_COUNT 64 /// 分片数量，按指针的哈希分配；编译时加-DSHARD_COUNT=1可以和单锁比较
+#endif
+
+enum alloc_kind
+{
+    ALLOC_MALLOC, /// malloc/calloc/realloc，用free释放
+
+    ALLOC_NEW, /// operator new，用operator delete释放
+
+    ALLOC_NEW_ARRAY, /// operator new[]，用operator delete[]释放
+};
+
+enum stack_walker
+{
+    STACK_WALKER_SAFE, /// Windows用StackWalk64，Linux用backtrace，能走过没有帧指针的帧
+
+    STACK_WALKER_FAST, /// 沿帧指针回溯，只按线程栈的范围检查，遇到省略帧指针的帧就停止
+
+    STACK_WALKER_CACHED, /// Linux下按.eh_frame回溯并缓存每个返回地址的规则，Windows下同STACK_WALKER_SAFE
+};
+
 struct memory_block
 {
     void* _start_ptr;
 
-    uint32_t _length;
+    size_t _length;
+
+    size_t _sample_size; /// 计入调用点统计的字节数，采样时是加权后的估计
+
+    uint32_t _stack_id; /// stack_table中的id，未采样时为0；realloc不改变
+
+    uint32_t _resize_stack_id; /// 最后一次realloc的堆栈，开启set_resize_stack并且采样到时才有
+
+    bool _delay_free; /// 已释放，仍留在索引中用于检查double free
+
+    uint8_t _kind; /// 见alloc_kind，放在填充字节里，不增加记录大小
+
+    uint16_t _front_size; /// 指针前面的保护区大小，申请到的地址是_start_ptr - _front_size
+
+    memory_block* _next; /// 延迟释放队列；头部模式下也用于存活块的链表
+
+    memory_block* _prev; /// 只在头部模式下使用
+
+    thread_stats* _owner; /// 分配的线程，释放时从它的存活统计里减去
+};
+
+#define HEADER_MAGIC 0x4d574844
+
+#define HEADER_SIZE 32 /// 16的倍数，返回的指针保持对齐
+
+#define HEADER_PAGE_SIZE 4096 /// 最小的页大小，指针离页首不到HEADER_SIZE时头部跨页
+
+/// 头部模式下紧贴在用户指针前面，释放时直接找到记录，不查索引
+struct block_header
+{
+    uint32_t _magic; /// 不对时不是这里分配的指针
+
+    uint32_t _check; /// 其他字段和地址的校验，不对时头部被写坏了
+
+    memory_block* _block; /// 分配事件处理之后才填写
+
+    size_t _length;
+
+    uint32_t _stack_id;
+
+    uint8_t _guard[HEADER_SIZE - 12 - sizeof(memory_block*) - sizeof(size_t)]; /// 填充保护字节，向前越界先写到这里
+};
+
+struct delay_free_config
+{
+    uint64_t _max_memory_size; /// 延迟释放队列的字节上限，超过时按FIFO释放
+
+    uint32_t _max_block_count; /// 延迟释放队列的块数上限
+
+    uint32_t _large_block_size; /// 不小于这个大小的块进入大块队列
+
+    uint64_t _large_max_memory_size; /// 大块队列的字节上限，0表示大块直接释放
+};
+
+struct delay_free_queue
+{
+    memory_block* _head;
+
+    memory_block* _tail;
+
+    uint32_t _block_count;
+
+    uint64_t _memory_size;
+};
+
+/// 每个分片独立加锁，统计信息在读取时合并
+struct __declspec(align(64)) memory_shard
+{
+    CRITICAL_SECTION _mutex;
+
+    block_index _index; /// 以指针为键的索引
+
+    memory_block* _live_blocks; /// 头部模式下不在索引里的块串成链表，用于报告泄漏
 
-    SafeCallStack _call_stack;
+    delay_free_queue _delay_free_queues[2]; /// 普通块和大块分开，普通块的预算按分片平分，大块按所有分片合计
 
-    DWORD _free_time;  /// to check double free
+    uint32_t _not_freed_count;
+
+    uint32_t _delay_free_count; /// 统计信息
+
+    uint32_t _delay_free_hit; /// 在队列中查到的double free
+
+    uint32_t _mismatch_count; /// 分配和释放函数不配对，或sized delete的大小不对
+
+    uint32_t _current_block_count;
+
+    uint32_t _max_block_count; /// 分片内的峰值，超过时刷新全局峰值
+
+    uint64_t _current_memory_size; /// 字节数都用64位，超过4G不回绕
 
-    memory_block* _next;
+    uint64_t _max_memory_size;
 };
 
 class memory_watcher
@@ -22,62 +135,192 @@ class memory_watcher
 public:
     memory_watcher();
 
-    void on_memory_alloc(void* start_ptr, uint32_t length);
+    ~memory_watcher();
+
+    uint32_t capture_stack(size_t length); /// 获取当前堆栈并返回stack_table中的id，未采样时返回0
+
+    void on_memory_alloc(void* start_ptr, size_t length, uint32_t kind = ALLOC_MALLOC, uint32_t front_size = 0);
+
+    void on_memory_alloc(void* start_ptr, size_t length, uint32_t stack_id, uint32_t kind, uint32_t front_size, thread_stats* thread);
+
+    /// 调用原始的realloc之前把记录从旧地址摘下来，旧地址被其他线程重新分配到时不会和它冲突；没有记录时返回nullptr
+    memory_block* begin_realloc(void* old_ptr);
+
+    /// 把摘下来的记录挂到新地址，new_ptr为nullptr表示realloc失败，记录放回旧地址
+    void end_realloc(memory_block* block, void* new_ptr, size_t new_length, uint32_t front_size);
+
+    /// 返回是否是记录过的块，size是sized delete传入的大小，0表示不知道；thread为nullptr时是当前线程
+    bool on_memory_free(void* start_ptr, bool free_untracked = true, uint32_t kind = ALLOC_MALLOC, size_t size = 0, thread_stats* thread = nullptr);
+
+    thread_stats* current_thread() { return _thread_stats.current(); } /// 异步模式下随事件交给后台线程
+
+    void set_async(bool async) { _thread_stats.set_async(async); }
 
-    void on_memory_realloc(void* old_ptr, void* new_ptr, uint32_t new_length);
+    bool find_block(void* start_ptr, memory_block& result); /// 复制一份记录，没有记录时返回false
 
-    void on_memory_free(void* start_ptr);
+    void* guarded_alloc(size_t size); /// 采样到时从保护页池申请，否则返回nullptr
+
+    bool is_guarded(const void* start_ptr) const { return _guard_pool.contains(start_ptr); }
+
+    size_t guarded_size(const void* start_ptr) { return _guard_pool.usable_size(start_ptr); }
+
+    uint32_t rear_size(const void* start_ptr, size_t length) const; /// 块后面的保护区大小
+
+    void free_memory(void* start_ptr, uint32_t front_size); /// 把申请到的内存还回去，不修改记录
+
+    void write_header(void* start_ptr, size_t length); /// 头部模式下由挂钩函数在记录之前调用
+
+    bool header_length(void* start_ptr, size_t& length); /// 不是头部模式或者不是这里分配的指针时返回false
 
     void on_shutdown();
-private:
-    uint32_t find_block(void* start_ptr); /// 查找所在的slot下标
 
-    memory_block* _block_slots[1024 * 1024]; /// 一个孔放置4k内容
+    void set_delay_free_config(const delay_free_config& config);
+
+    void set_sample_interval(uint32_t interval);
+
+    void set_resize_stack(bool enabled); /// realloc时是否另外记录改变大小的堆栈
+
+    void set_stack_walker(uint32_t walker); /// 见stack_walker
+
+    void set_stack_depth(uint32_t depth); /// 获取堆栈的最大帧数，1到CALLSTACKMAXDEPTH
+
+    void set_redzone_config(const redzone_config& config); /// 只能在挂钩之前调用
+
+    void set_page_guard_config(const page_guard_config& config); /// 只能在挂钩之前调用
+
+    void set_inline_header(bool enabled); /// 只能在挂钩之前调用
+
+    void set_stack_trie(bool enabled); /// 只能在挂钩之前调用，见stack_trie
+
+    uint32_t top_stacks(stack_profile* result, uint32_t count); /// 按存活字节数排序的调用点
+
+    void report_top_stacks(uint32_t count);
+
+    bool subtree(const char* function, subtree_profile& result); /// 不是字典树模式时返回false
+
+    void report_subtree(const char* function);
+
+    uint32_t size_classes(size_class_profile* result, uint32_t count) { return _thread_stats.size_classes(result, count); }
+
+    void report_size_classes(); /// 只输出有过分配的档
+
+    bool thread_profile_of(uint32_t tid, thread_profile& result) { return _thread_stats.find(tid, result); }
+
+    void for_each_thread(thread_profile_callback callback, void* context) { _thread_stats.for_each(callback, context); }
+
+    const heap_snapshot* take_snapshot(); /// 失败时返回nullptr
+
+    void release_snapshot(const heap_snapshot* snapshot);
+
+    uint32_t diff(const heap_snapshot* a, const heap_snapshot* b, stack_growth* result, uint32_t count); /// 按增长降序，只返回增长的调用点
+
+    void report_diff(const heap_snapshot* a, const heap_snapshot* b, uint32_t count);
 private:
-    void do_delay_free(bool force = false);
+    memory_shard& find_shard(void* start_ptr); /// 查找所在的分片
 
-    void delay_free_one_block();
+    bool use_index(const void* start_ptr) const; /// 不是头部模式、头部跨页或者在保护页池里
 
-    memory_block* check_is_delay_free(void* ptr);
+    memory_block* find_record(memory_shard& shard, void* start_ptr);
 
-    bool validate_block(memory_block* block);
+    bool insert_record(memory_shard& shard, memory_block* block);
+
+    void update_header(memory_block* block);
+
+    void unlink_record(memory_shard& shard, memory_block* block); /// 从索引或者存活链表中移除
+
+    memory_shard _shards[SHARD_COUNT];
+
+    uint32_t _header_size; /// 头部模式下是HEADER_SIZE，否则为0
 
-    memory_block* _delay_free_head;
+    bool _resize_stack;
 
-    memory_block* _delay_free_tail;
+    uint32_t _stack_walker;
+
+    uint32_t _stack_depth;
 private:
-    void block_pool_init();
+    void do_delay_free(memory_shard& shard, bool force = false);
+
+    void delay_free_one_block(memory_shard& shard, delay_free_queue& queue);
 
-    memory_block* block_pool_alloc();
+    bool validate_block(memory_block* block);
 
-    void block_pool_free(memory_block*);
+    volatile delay_free_config _delay_free_config; /// 各分片不加锁读取，每次调用每个字段只读一次
 
-    memory_block* _block_header; /// 内存块分配的头部
+    volatile LONGLONG _large_delay_free_size; /// 所有分片大块队列的字节数之和
 
-    memory_block _block_pool[1024 * 100]; /// 内存同时使用最大块数
+    uint32_t _rear_size; /// 所有块后面的保护区一样大，前面的按块记录
 private:
-    void output_memory_info(bool force = false);
+    block_pool _block_pool; /// 所有分片共用，按线程缓存
 
-    DWORD _last_output_time;
+    stack_table _stack_table;
 
-    uint32_t _not_freed_count;
+    heap_sampler _sampler;
 
-    uint32_t _delay_free_block; /// 统计信息
+    guard_pool _guard_pool;
 
-    uint32_t _delay_free_memory_size;
+    thread_stats_table _thread_stats;
+private:
+    void update_peak(memory_shard& shard);
 
-    uint32_t _current_block_count;
-    
-    uint32_t _current_memory_size;
+    void output_memory_info(bool force = false);
 
-    uint32_t _max_block_count;
+    volatile LONG _last_output_time;
 
-    uint32_t _max_memory_size;
+    volatile LONG _max_block_count; /// 全局峰值
+
+    volatile LONGLONG _max_memory_size;
 private:
-    void report_heap_corruption(CallStack* call_stack);
+    void report_heap_corruption(uint32_t stack_id);
+
+    void report_mismatch(memory_shard& shard, memory_block* block, uint32_t kind, size_t size);
 
     void report_heap_leak();
 private:
     memory_watcher(const memory_watcher&);
     memory_watcher& operator=(const memory_watcher&);
 };
+
+void hook_state_set_delay_free_config(const delay_free_config& config); /// 运行时调整延迟释放的预算
+
+void hook_state_set_sample_interval(uint32_t interval); /// 平均每分配多少字节获取一次堆栈，0表示全部获取
+
+void hook_state_set_resize_stack(bool enabled); /// 泄漏报告中附带最后一次realloc的堆栈
+
+void hook_state_set_stack_walker(uint32_t walker); /// 程序带帧指针编译时用STACK_WALKER_FAST
+
+void hook_state_set_stack_depth(uint32_t depth); /// 默认CALLSTACKDEFAULTDEPTH帧，只影响之后获取的堆栈
+
+bool hook_state_set_redzone_config(const redzone_config& config); /// 已经挂钩时返回false，大小按16字节取整，异步模式下不使用前置保护区
+
+bool hook_state_set_page_guard_config(const page_guard_config& config); /// 已经挂钩时返回false
+
+bool hook_state_set_inline_header(bool enabled); /// 已经挂钩时返回false，见block_header
+
+bool hook_state_set_stack_trie(bool enabled); /// 已经挂钩时返回false，按调用链共享前缀保存堆栈
+
+bool hook_state_add_skip_range(const void* start, size_t size); /// 已经挂钩时返回false，程序自己的分配包装函数不出现在堆栈里
+
+uint32_t hook_state_top_stacks(stack_profile* result, uint32_t count);
+
+void hook_state_report_top_stacks(uint32_t count);
+
+/// 调用链经过函数名包含function的帧（比如"dispatcher::handle"）的存活内存，需要先开启hook_state_set_stack_trie
+bool hook_state_subtree(const char* function, subtree_profile* result);
+
+void hook_state_report_subtree(const char* function);
+
+uint32_t hook_state_size_classes(size_class_profile* result, uint32_t count); /// 按大小分档的分配次数，最多SIZE_CLASS_COUNT档
+
+void hook_state_report_size_classes();
+
+bool hook_state_get_thread_stats(uint32_t tid, thread_profile* result); /// 没有这个线程的记录时返回false
+
+void hook_state_for_each_thread(thread_profile_callback callback, void* context); /// 包括已退出但分配的块还没有全部释放的线程
+
+const heap_snapshot* hook_state_take_snapshot(); /// 进程不退出时，用两次快照的差找出持续增长的调用点
+
+void hook_state_release_snapshot(const heap_snapshot* snapshot);
+
+uint32_t hook_state_diff_snapshots(const heap_snapshot* a, const heap_snapshot* b, stack_growth* result, uint32_t count);
+
+void hook_state_report_snapshot_diff(const heap_snapshot* a, const heap_snapshot* b, uint32_t count);
@@ -0,0 +1,239 @@
+#pragma once
+
+/// Windows下直接使用系统头文件
+/// 其他平台只提供核心代码用到的那一小部分Win32接口，用pthread和gcc内建函数实现
+
+#ifdef _WIN32
+
+#include <windows.h>
+#include <intrin.h>
+
+#else
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+#include <sys/syscall.h>
+#include <x86intrin.h>
+
+#define WINAPI
+#define __stdcall
+#define __declspec(x) __declspec_##x
+#define __declspec_thread __thread __attribute__((tls_model("initial-exec"))) /// 不经过__tls_get_addr，不会申请内存
+#define __declspec_align(n) __attribute__((aligned(n)))
+
+#define TRUE 1
+#define FALSE 0
+#define INFINITE 0xffffffff
+
+typedef int                BOOL;
+typedef unsigned char      BYTE;
+typedef uint32_t           DWORD;
+typedef int32_t            LONG;
+typedef int64_t            LONGLONG;
+typedef uint32_t           UINT32;
+typedef uint64_t           DWORD64;
+typedef size_t             SIZE_T;
+typedef void               VOID;
+typedef void*              PVOID;
+typedef void*              LPVOID;
+typedef void*              HANDLE;
+typedef char               CHAR;
+typedef wchar_t            WCHAR;
+typedef const char*        LPCSTR;
+typedef const wchar_t*     LPCWSTR;
+
+typedef pthread_mutex_t CRITICAL_SECTION;
+
+inline BOOL InitializeCriticalSectionAndSpinCount(CRITICAL_SECTION* mutex, DWORD)
+{
+    /// 和CRITICAL_SECTION一样允许同一线程重复进入
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    BOOL result = pthread_mutex_init(mutex, &attr) == 0;
+    pthread_mutexattr_destroy(&attr);
+    return result;
+}
+
+inline void EnterCriticalSection(CRITICAL_SECTION* mutex) { pthread_mutex_lock(mutex); }
+
+inline void LeaveCriticalSection(CRITICAL_SECTION* mutex) { pthread_mutex_unlock(mutex); }
+
+inline void DeleteCriticalSection(CRITICAL_SECTION* mutex) { pthread_mutex_destroy(mutex); }
+
+inline LONG InterlockedIncrement(volatile LONG* p) { return __sync_add_and_fetch(p, 1); }
+
+inline LONG InterlockedDecrement(volatile LONG* p) { return __sync_sub_and_fetch(p, 1); }
+
+inline LONG InterlockedExchange(volatile LONG* p, LONG v) { return __sync_lock_test_and_set(p, v); }
+
+inline LONG InterlockedExchangeAdd(volatile LONG* p, LONG v) { return __sync_fetch_and_add(p, v); }
+
+inline LONGLONG InterlockedExchangeAdd64(volatile LONGLONG* p, LONGLONG v) { return __sync_fetch_and_add(p, v); }
+
+inline LONGLONG InterlockedExchange64(volatile LONGLONG* p, LONGLONG v) { return __sync_lock_test_and_set(p, v); }
+
+inline LONGLONG InterlockedCompareExchange64(volatile LONGLONG* p, LONGLONG v, LONGLONG comparand)
+{
+    return __sync_val_compare_and_swap(p, comparand, v);
+}
+
+inline LONG InterlockedCompareExchange(volatile LONG* p, LONG v, LONG comparand)
+{
+    return __sync_val_compare_and_swap(p, comparand, v);
+}
+
+inline PVOID InterlockedExchangePointer(PVOID volatile* p, PVOID v) { return __sync_lock_test_and_set(p, v); }
+
+inline PVOID InterlockedCompareExchangePointer(PVOID volatile* p, PVOID v, PVOID comparand)
+{
+    return __sync_val_compare_and_swap(p, comparand, v);
+}
+
+#define _ReadWriteBarrier() __asm__ __volatile__("" ::: "memory")
+
+#define MemoryBarrier() __sync_synchronize()
+
+/// 和Windows SDK的同名函数一致，单向的屏障，只约束当前线程前后的读写顺序
+inline LONG ReadAcquire(const volatile LONG* p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+
+inline void WriteRelease(volatile LONG* p, LONG v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+
+/// FLS的回调在线程退出时调用，和pthread_key的析构函数一致
+typedef void (WINAPI *PFLS_CALLBACK_FUNCTION)(PVOID);
+
+#define FLS_OUT_OF_INDEXES ((DWORD)0xffffffff)
+#define TLS_OUT_OF_INDEXES ((DWORD)0xffffffff)
+
+inline DWORD FlsAlloc(PFLS_CALLBACK_FUNCTION callback)
+{
+    pthread_key_t key;
+    return pthread_key_create(&key, callback) == 0 ? (DWORD)key : FLS_OUT_OF_INDEXES;
+}
+
+inline BOOL FlsFree(DWORD index) { return pthread_key_delete((pthread_key_t)index) == 0; }
+
+inline BOOL FlsSetValue(DWORD index, PVOID value) { return pthread_setspecific((pthread_key_t)index, value) == 0; }
+
+inline DWORD TlsAlloc() { return FlsAlloc(nullptr); }
+
+inline BOOL TlsFree(DWORD index) { return FlsFree(index); }
+
+inline PVOID TlsGetValue(DWORD index) { return pthread_getspecific((pthread_key_t)index); }
+
+inline BOOL TlsSetValue(DWORD index, PVOID value) { return FlsSetValue(index, value); }
+
+inline DWORD GetTickCount()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (DWORD)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+inline DWORD GetCurrentThreadId() { return (DWORD)syscall(SYS_gettid); }
+
+inline void Sleep(DWORD ms) { usleep(ms * 1000); }
+
+inline BOOL SwitchToThread() { return sched_yield() == 0; }
+
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(LPVOID);
+
+struct thread_start
+{
+    LPTHREAD_START_ROUTINE _start;
+
+    LPVOID _param;
+
+    volatile LONG _started; /// 新线程取走参数之后置1，参数放在创建者的栈上，不申请内存
+};
+
+inline void* thread_trampoline(void* param)
+{
+    thread_start* start = (thread_start*)param;
+    LPTHREAD_START_ROUTINE routine = start->_start;
+    LPVOID routine_param = start->_param;
+    __atomic_store_n(&start->_started, 1, __ATOMIC_RELEASE);
+
+    return (void*)(uintptr_t)routine(routine_param);
+}
+
+/// 线程句柄就是pthread_t，只支持等待线程结束
+inline HANDLE CreateThread(void*, SIZE_T, LPTHREAD_START_ROUTINE start, LPVOID param, DWORD, DWORD*)
+{
+    thread_start context = { start, param, 0 };
+
+    pthread_t thread;
+    if (pthread_create(&thread, nullptr, thread_trampoline, &context) != 0)
+        return nullptr;
+
+    while (__atomic_load_n(&context._started, __ATOMIC_ACQUIRE) == 0) {
+        sched_yield();
+    }
+
+    return (HANDLE)thread;
+}
+
+inline DWORD WaitForSingleObject(HANDLE thread, DWORD)
+{
+    pthread_join((pthread_t)thread, nullptr);
+    return 0;
+}
+
+inline BOOL CloseHandle(HANDLE) { return TRUE; }
+
+/// 调试输出写到stderr，不经过stdio的缓冲，不会申请内存
+inline void OutputDebugStringA(LPCSTR message)
+{
+    ssize_t result = write(2, message, strlen(message));
+    (void)result;
+}
+
+/// 逐个字符转换，缓冲区满了就先写出去，长行不会被截断
+inline void OutputDebugStringW(LPCWSTR message)
+{
+    char buffer[1024];
+    size_t length = 0;
+    mbstate_t state;
+    memset(&state, 0, sizeof(state));
+
+    for (; *message != L'\0'; message++) {
+        if (length + MB_LEN_MAX >= sizeof(buffer)) {
+            buffer[length] = '\0';
+            OutputDebugStringA(buffer);
+            length = 0;
+        }
+
+        size_t result = wcrtomb(buffer + length, *message, &state);
+        if (result == (size_t)-1) {
+            buffer[length] = '?';
+            result = 1;
+            memset(&state, 0, sizeof(state));
+        }
+        length += result;
+    }
+
+    buffer[length] = '\0';
+    OutputDebugStringA(buffer);
+}
+
+template <size_t size>
+inline int sprintf_s(char (&buffer)[size], const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int result = vsnprintf(buffer, size, format, args);
+    va_end(args);
+    return result;
+}
+
+#endif
@@ -0,0 +1,165 @@
+#include "platform.h"
+#include "redzone.h"
+
+#ifdef _WIN32
+#include <immintrin.h>
+#define REDZONE_AVX2_SUPPORTED (_MSC_VER >= 1700)
+#define TARGET_AVX2
+#else
+#include <cpuid.h>
+#include <immintrin.h>
+#define REDZONE_AVX2_SUPPORTED 1
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+typedef void (*redzone_fill_t)(uint8_t* data, size_t size);
+typedef bool (*redzone_check_t)(const uint8_t* data, size_t size);
+
+static void fill_scalar(uint8_t* data, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        data[i] = GUARD_NUM;
+    }
+}
+
+static bool check_scalar(const uint8_t* data, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        if (data[i] != GUARD_NUM)
+            return false;
+    }
+    return true;
+}
+
+/// 保护区不一定对齐，用非对齐读写，最后一段和前面重叠，不需要逐字节处理尾部
+static void fill_sse2(uint8_t* data, size_t size)
+{
+    if (size < 16)
+        return fill_scalar(data, size);
+
+    __m128i guard = _mm_set1_epi8((char)GUARD_NUM);
+    for (size_t i = 0; i + 16 <= size; i += 16) {
+        _mm_storeu_si128((__m128i*)(data + i), guard);
+    }
+    _mm_storeu_si128((__m128i*)(data + size - 16), guard);
+}
+
+static bool check_sse2(const uint8_t* data, size_t size)
+{
+    if (size < 16)
+        return check_scalar(data, size);
+
+    __m128i guard = _mm_set1_epi8((char)GUARD_NUM);
+    __m128i equal = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + size - 16)), guard);
+    for (size_t i = 0; i + 16 <= size; i += 16) {
+        equal = _mm_and_si128(equal, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i)), guard));
+    }
+    return _mm_movemask_epi8(equal) == 0xffff;
+}
+
+#if REDZONE_AVX2_SUPPORTED
+
+TARGET_AVX2 static void fill_avx2(uint8_t* data, size_t size)
+{
+    if (size < 32)
+        return fill_sse2(data, size);
+
+    __m256i guard = _mm256_set1_epi8((char)GUARD_NUM);
+    for (size_t i = 0; i + 32 <= size; i += 32) {
+        _mm256_storeu_si256((__m256i*)(data + i), guard);
+    }
+    _mm256_storeu_si256((__m256i*)(data + size - 32), guard);
+}
+
+TARGET_AVX2 static bool check_avx2(const uint8_t* data, size_t size)
+{
+    if (size < 32)
+        return check_sse2(data, size);
+
+    __m256i guard = _mm256_set1_epi8((char)GUARD_NUM);
+    __m256i equal = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + size - 32)), guard);
+    for (size_t i = 0; i + 32 <= size; i += 32) {
+        equal = _mm256_and_si256(equal, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + i)), guard));
+    }
+    return _mm256_movemask_epi8(equal) == -1;
+}
+
+#endif
+
+static redzone_fill_t _fill_func = fill_scalar;
+
+static redzone_check_t _check_func = check_scalar;
+
+static const char* _kernel_name = "scalar";
+
+static void cpu_features(bool& sse2, bool& avx2)
+{
+    int info[4] = { 0 };
+    sse2 = false;
+    avx2 = false;
+
+#ifdef _WIN32
+    __cpuid(info, 0);
+    int max_leaf = info[0];
+    __cpuid(info, 1);
+#else
+    int max_leaf = __get_cpuid_max(0, nullptr);
+    __cpuid(1, info[0], info[1], info[2], info[3]);
+#endif
+
+    sse2 = (info[3] & (1 << 26)) != 0;
+
+    /// AVX2还要求系统保存YMM寄存器
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || max_leaf < 7)
+        return;
+
+#ifdef _WIN32
+    uint64_t xcr0 = _xgetbv(0);
+    __cpuidex(info, 7, 0);
+#else
+    uint32_t xcr0_low, xcr0_high;
+    __asm__ ("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
+    uint64_t xcr0 = ((uint64_t)xcr0_high << 32) | xcr0_low;
+    __cpuid_count(7, 0, info[0], info[1], info[2], info[3]);
+#endif
+
+    avx2 = (xcr0 & 6) == 6 && (info[1] & (1 << 5)) != 0;
+}
+
+void redzone_initialize()
+{
+    bool sse2, avx2;
+    cpu_features(sse2, avx2);
+
+#if REDZONE_AVX2_SUPPORTED
+    if (avx2) {
+        _fill_func = fill_avx2;
+        _check_func = check_avx2;
+        _kernel_name = "avx2";
+        return;
+    }
+#endif
+
+    if (sse2) {
+        _fill_func = fill_sse2;
+        _check_func = check_sse2;
+        _kernel_name = "sse2";
+    }
+}
+
+const char* redzone_kernel()
+{
+    return _kernel_name;
+}
+
+void redzone_fill(void* data, size_t size)
+{
+    _fill_func((uint8_t*)data, size);
+}
+
+bool redzone_check(const void* data, size_t size)
+{
+    return _check_func((const uint8_t*)data, size);
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#define GUARD_NUM 0xcc
+
+#define REDZONE_ALIGNMENT 16 /// 保护区大小按16字节取整，返回给用户的指针保持malloc的对齐
+
+#define REDZONE_MAX_SIZE (32 * 1024)
+
+struct redzone_config
+{
+    uint32_t _front_size; /// 指针前面的保护区，0表示不检查向前越界
+
+    uint32_t _rear_size; /// 至少16字节
+};
+
+/// 填充和检查保护区，按CPUID在标量、SSE2和AVX2实现之间选择
+void redzone_initialize(); /// 挂钩之前调用一次
+
+const char* redzone_kernel(); /// 当前使用的实现
+
+void redzone_fill(void* data, size_t size);
+
+bool redzone_check(const void* data, size_t size);
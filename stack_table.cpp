@@ -0,0 +1,437 @@
+#include <stddef.h>
+#include <string.h>
+#include "stack_table.h"
+#include "virtual_memory.h"
+
+#define ARENA_SIZE (64 * 1024)
+
+stack_table::stack_table()
+{
+    size_t bucket_size = sizeof(stack_entry*) << STACK_BUCKET_BITS;
+    _buckets = (stack_entry* volatile*)virtual_alloc(bucket_size);
+    _table_size = (LONG)bucket_size;
+    _next_id = 0;
+    _frame_count = 0;
+    _encoded_size = 0;
+    _use_trie = false;
+
+    memset((void*)_pages, 0, sizeof(_pages));
+
+    for (auto& s : _stripes) {
+        InitializeCriticalSectionAndSpinCount(&s._mutex, 100);
+        s._arena = nullptr;
+        s._arena_left = 0;
+        s._chunks = nullptr;
+        s._saved_size = 0;
+    }
+}
+
+stack_table::~stack_table()
+{
+    for (auto& s : _stripes) {
+        while (s._chunks != nullptr) {
+            chunk* next = s._chunks->_next;
+            virtual_free(s._chunks, s._chunks->_size);
+            s._chunks = next;
+        }
+        DeleteCriticalSection(&s._mutex);
+    }
+
+    for (auto page : _pages) {
+        virtual_free(page, sizeof(stack_entry*) << STACK_PAGE_BITS);
+    }
+
+    virtual_free((void*)_buckets, sizeof(stack_entry*) << STACK_BUCKET_BITS);
+}
+
+uint32_t stack_table::hash(const CallStack& call_stack)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (UINT32 i = 0; i < call_stack.size(); i++) {
+        h ^= (uint64_t)call_stack[i];
+        h *= 0x100000001b3ULL;
+    }
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+uint32_t stack_table::encode(const CallStack& call_stack, uint8_t* data)
+{
+    uint8_t* p = data;
+    SIZE_T prev = 0;
+    for (UINT32 i = 0; i < call_stack.size(); i++) {
+        int64_t delta = (int64_t)(call_stack[i] - prev);
+        uint64_t value = ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63);
+        while (value >= 0x80) {
+            *p++ = (uint8_t)(value | 0x80);
+            value >>= 7;
+        }
+        *p++ = (uint8_t)value;
+        prev = call_stack[i];
+    }
+    return (uint32_t)(p - data);
+}
+
+void stack_table::decode(const stack_entry* entry, CallStack& call_stack) const
+{
+    if (_use_trie) {
+        uint32_t node;
+        memcpy(&node, entry->_data, sizeof(node));
+        _trie.decode(node, call_stack);
+        return;
+    }
+
+    const uint8_t* p = entry->_data;
+    SIZE_T prev = 0;
+    for (uint32_t i = 0; i < entry->_size; i++) {
+        uint64_t value = 0;
+        uint32_t shift = 0;
+        uint8_t byte;
+        do {
+            byte = *p++;
+            value |= (uint64_t)(byte & 0x7f) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+
+        prev += (SIZE_T)((value >> 1) ^ (0 - (value & 1)));
+        call_stack.push_back(prev);
+    }
+}
+
+bool stack_table::equal(const stack_entry* entry, uint32_t hash, const uint8_t* data, uint32_t length)
+{
+    /// 编码是确定的，比较字节即可
+    return entry->_hash == hash && entry->_length == length && memcmp(entry->_data, data, length) == 0;
+}
+
+stack_entry* stack_table::lookup(uint32_t bucket, uint32_t hash, const uint8_t* data, uint32_t length) const
+{
+    stack_entry* entry = _buckets[bucket];
+    while (entry != nullptr) {
+        if (equal(entry, hash, data, length))
+            return entry;
+
+        entry = entry->_next;
+    }
+    return nullptr;
+}
+
+uint32_t stack_table::insert(const CallStack& call_stack)
+{
+    if (_buckets == nullptr)
+        return 0;
+
+    uint8_t data[STACK_ENCODED_MAX_SIZE];
+    uint32_t length;
+    uint32_t h;
+    if (_use_trie) {
+        /// 不同的堆栈落在不同的节点上，条目只按节点序号去重
+        uint32_t node = _trie.insert(call_stack);
+        if (node == 0 && call_stack.size() != 0)
+            return 0;
+
+        memcpy(data, &node, sizeof(node));
+        length = sizeof(node);
+        h = node * 0x9e3779b1u;
+    } else {
+        h = hash(call_stack);
+        length = encode(call_stack, data);
+    }
+
+    uint32_t bucket = h & ((1u << STACK_BUCKET_BITS) - 1);
+
+    /// 绝大多数情况下堆栈已经存在，不需要加锁
+    stripe& s = _stripes[bucket % STACK_STRIPE_COUNT];
+    stack_entry* entry = lookup(bucket, h, data, length);
+    if (entry != nullptr) {
+        add_ref(s, entry, 1);
+        return entry->_id;
+    }
+
+    EnterCriticalSection(&s._mutex);
+
+    entry = lookup(bucket, h, data, length);
+    if (entry == nullptr) {
+        entry = alloc_entry(s, length);
+        if (entry != nullptr) {
+            entry->_hash = h;
+            entry->_refcount = 0;
+            entry->_live_count = 0;
+            entry->_live_size = 0;
+            entry->_alloc_size = 0;
+            entry->_free_size = 0;
+            entry->_size = (uint16_t)call_stack.size();
+            entry->_length = (uint16_t)length;
+            memcpy(entry->_data, data, length);
+
+            if (assign_id(entry)) {
+                /// 条目写完之后再挂到桶上，无锁的读者看到的总是完整的条目
+                entry->_next = _buckets[bucket];
+                InterlockedExchangePointer((PVOID volatile*)&_buckets[bucket], entry);
+                InterlockedExchangeAdd64(&_frame_count, entry->_size);
+                InterlockedExchangeAdd64(&_encoded_size, length);
+            } else {
+                entry = nullptr;
+            }
+        }
+    }
+
+    if (entry != nullptr) {
+        add_ref(s, entry, 1);
+    }
+
+    LeaveCriticalSection(&s._mutex);
+
+    return entry != nullptr ? entry->_id : 0;
+}
+
+void stack_table::release(uint32_t id)
+{
+    stack_entry* entry = (stack_entry*)find(id);
+    if (entry != nullptr) {
+        uint32_t bucket = entry->_hash & ((1u << STACK_BUCKET_BITS) - 1);
+        add_ref(_stripes[bucket % STACK_STRIPE_COUNT], entry, -1);
+    }
+}
+
+void stack_table::add_ref(stripe& s, stack_entry* entry, LONG delta)
+{
+    InterlockedExchangeAdd(&entry->_refcount, delta);
+    InterlockedExchangeAdd64(&s._saved_size, (LONGLONG)delta * entry->_size * (LONGLONG)sizeof(SIZE_T));
+}
+
+void stack_table::record_alloc(uint32_t id, size_t size)
+{
+    stack_entry* entry = (stack_entry*)find(id);
+    if (entry != nullptr) {
+        InterlockedIncrement(&entry->_live_count);
+        InterlockedExchangeAdd64(&entry->_live_size, size);
+        InterlockedExchangeAdd64(&entry->_alloc_size, size);
+    }
+}
+
+void stack_table::record_free(uint32_t id, size_t size)
+{
+    stack_entry* entry = (stack_entry*)find(id);
+    if (entry != nullptr) {
+        InterlockedDecrement(&entry->_live_count);
+        InterlockedExchangeAdd64(&entry->_live_size, -(LONGLONG)size);
+        InterlockedExchangeAdd64(&entry->_free_size, size);
+    }
+}
+
+uint32_t stack_table::top(stack_profile* result, uint32_t count) const
+{
+    /// 只遍历不同的调用点，数量远小于内存块数，结果按存活字节数降序
+    uint32_t found = 0;
+    for (uint32_t id = 1; id <= (uint32_t)_next_id && count > 0; id++) {
+        const stack_entry* entry = find(id);
+        if (entry == nullptr || entry->_live_count <= 0)
+            continue;
+
+        int64_t live_size = entry->_live_size;
+        if (found == count && result[found - 1]._live_size >= live_size)
+            continue;
+
+        uint32_t pos = found < count ? found++ : found - 1;
+        while (pos > 0 && result[pos - 1]._live_size < live_size) {
+            result[pos] = result[pos - 1];
+            pos--;
+        }
+
+        result[pos]._stack_id = id;
+        result[pos]._live_count = (uint32_t)entry->_live_count;
+        result[pos]._live_size = live_size;
+        result[pos]._alloc_size = entry->_alloc_size;
+        result[pos]._free_size = entry->_free_size;
+    }
+
+    return found;
+}
+
+uint32_t stack_table::snapshot(snapshot_entry* result, uint32_t count) const
+{
+    /// 计数是原子更新的，逐条读取即可，不会阻塞分配线程
+    uint32_t found = 0;
+    for (uint32_t id = 1; id <= (uint32_t)_next_id && found < count; id++) {
+        const stack_entry* entry = find(id);
+        if (entry == nullptr || entry->_live_count <= 0)
+            continue;
+
+        result[found]._stack_id = id;
+        result[found]._live_count = (uint32_t)entry->_live_count;
+        result[found]._live_size = entry->_live_size;
+        found++;
+    }
+
+    return found;
+}
+
+const stack_entry* stack_table::find(uint32_t id) const
+{
+    if (id == 0 || (id >> STACK_PAGE_BITS) >= STACK_PAGE_COUNT)
+        return nullptr;
+
+    stack_entry** page = _pages[id >> STACK_PAGE_BITS];
+    if (page == nullptr)
+        return nullptr;
+
+    return page[id & ((1u << STACK_PAGE_BITS) - 1)];
+}
+
+void stack_table::dump(uint32_t id) const
+{
+    const stack_entry* entry = find(id);
+    if (entry == nullptr)
+        return;
+
+    FastCallStack call_stack;
+    decode(entry, call_stack);
+    call_stack.dump(FALSE);
+}
+
+int64_t stack_table::encoded_size() const
+{
+    /// 字典树模式下条目里的4字节也算上，和按帧编码比较时口径一致
+    return _encoded_size + (_use_trie ? _trie.node_size() : 0);
+}
+
+bool stack_table::set_trie(bool enabled)
+{
+    if (_next_id != 0)
+        return false;
+
+    _use_trie = enabled && _trie.initialize();
+    return _use_trie == enabled;
+}
+
+/// 同一个返回地址出现在很多调用链上，查过的结果按地址缓存
+#define SUBTREE_CACHE_SIZE 256
+
+bool stack_table::subtree(const char* function, subtree_profile& result) const
+{
+    memset(&result, 0, sizeof(result));
+    if (!_use_trie)
+        return false;
+
+    uint32_t node_count = _trie.node_count();
+    uint8_t* marks = (uint8_t*)virtual_alloc(node_count + 1);
+    if (marks == nullptr)
+        return false;
+
+    SIZE_T cache_pc[SUBTREE_CACHE_SIZE] = { 0 };
+    bool cache_match[SUBTREE_CACHE_SIZE];
+
+    /// 父节点的序号总是小于子节点，按序号走一遍就把匹配传给了整棵子树
+    /// 祖先已经匹配的节点不用再查符号，递归调用也不会重复计数
+    for (uint32_t i = 1; i <= node_count; i++) {
+        const stack_node* node = _trie.find(i);
+        if (node == nullptr)
+            continue;
+
+        if (marks[node->_parent]) {
+            marks[i] = 1;
+            continue;
+        }
+
+        uint32_t slot = (uint32_t)(node->_pc >> 4) % SUBTREE_CACHE_SIZE;
+        if (cache_pc[slot] != node->_pc) {
+            CHAR name[MAXFUNCTIONNAMELENGTH];
+            cache_pc[slot] = node->_pc;
+            cache_match[slot] = getfunctionname(node->_pc, name, sizeof(name)) && strstr(name, function) != nullptr;
+        }
+
+        if (cache_match[slot]) {
+            marks[i] = 1;
+            result._node_count++;
+        }
+    }
+
+    for (uint32_t id = 1; id <= (uint32_t)_next_id; id++) {
+        const stack_entry* entry = find(id);
+        if (entry == nullptr)
+            continue;
+
+        uint32_t node;
+        memcpy(&node, entry->_data, sizeof(node));
+        if (node == 0 || node > node_count || !marks[node])
+            continue;
+
+        result._alloc_size += entry->_alloc_size;
+        if (entry->_live_count > 0) {
+            result._stack_count++;
+            result._live_count += (uint32_t)entry->_live_count;
+            result._live_size += entry->_live_size;
+        }
+    }
+
+    virtual_free(marks, node_count + 1);
+    return true;
+}
+
+int64_t stack_table::saved_size() const
+{
+    /// 每块保存的是捕获到的帧，块里的id不算；引用计数变化时按条带累加，这里不用遍历条目
+    int64_t saved = 0;
+    for (auto& s : _stripes) {
+        saved += s._saved_size;
+    }
+
+    return saved - _table_size;
+}
+
+stack_entry* stack_table::alloc_entry(stripe& s, uint32_t length)
+{
+    size_t entry_size = offsetof(stack_entry, _data) + length;
+    entry_size = (entry_size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+    if (s._arena_left < entry_size) {
+        chunk* header = (chunk*)virtual_alloc(ARENA_SIZE);
+        if (header == nullptr)
+            return nullptr;
+
+        header->_size = ARENA_SIZE;
+        header->_next = s._chunks;
+        s._chunks = header;
+        s._arena = (uint8_t*)(header + 1);
+        s._arena_left = ARENA_SIZE - sizeof(chunk);
+        InterlockedExchangeAdd(&_table_size, ARENA_SIZE);
+    }
+
+    stack_entry* entry = (stack_entry*)s._arena;
+    s._arena += entry_size;
+    s._arena_left -= entry_size;
+    return entry;
+}
+
+bool stack_table::assign_id(stack_entry* entry)
+{
+    /// 多个条带同时插入，先确认页存在再占用id，失败时不消耗id，stack_count只算成功的条目
+    LONG current;
+    uint32_t id;
+    stack_entry** volatile* slot;
+    do {
+        current = _next_id;
+        id = (uint32_t)current + 1;
+        if ((id >> STACK_PAGE_BITS) >= STACK_PAGE_COUNT)
+            return false;
+
+        slot = &_pages[id >> STACK_PAGE_BITS];
+        if (*slot == nullptr) {
+            /// 多个条带可能同时申请同一页
+            size_t page_size = sizeof(stack_entry*) << STACK_PAGE_BITS;
+            stack_entry** page = (stack_entry**)virtual_alloc(page_size);
+            if (page == nullptr)
+                return false;
+
+            if (InterlockedCompareExchangePointer((PVOID volatile*)slot, page, nullptr) != nullptr) {
+                virtual_free(page, page_size);
+            } else {
+                InterlockedExchangeAdd(&_table_size, (LONG)page_size);
+            }
+        }
+    } while (InterlockedCompareExchange(&_next_id, (LONG)id, current) != current);
+
+    entry->_id = id;
+    (*slot)[id & ((1u << STACK_PAGE_BITS) - 1)] = entry;
+    return true;
+}
\ No newline at end of file
@@ -0,0 +1,188 @@
+#pragma once
+#include <stdint.h>
+#include "callstack.h"
+#include "stack_trie.h"
+
+#define STACK_BUCKET_BITS 16 /// 哈希桶数量
+
+#define STACK_STRIPE_COUNT 64 /// 插入锁的条带数
+
+#define STACK_PAGE_BITS 12 /// id目录每页的条目数
+
+#define STACK_PAGE_COUNT 4096 /// id目录页数，最多支持16M条不同的堆栈
+
+#define STACK_ENCODED_MAX_SIZE (CALLSTACKMAXDEPTH * 10) /// 每帧编码后最多10字节
+
+struct stack_entry
+{
+    stack_entry* volatile _next; /// 同一个桶里的下一条
+
+    uint32_t _hash;
+
+    uint32_t _id;
+
+    volatile LONG _refcount; /// 引用这条堆栈的内存块数，包括延迟释放中的
+
+    volatile LONG _live_count; /// 以下是按调用点统计的堆信息
+
+    volatile LONGLONG _live_size;
+
+    volatile LONGLONG _alloc_size;
+
+    volatile LONGLONG _free_size;
+
+    uint16_t _size; /// 帧数
+
+    uint16_t _length; /// _data的字节数
+
+    uint8_t _data[1]; /// 每帧和前一帧的差按zigzag变长编码，第一帧和0比较；同一模块里的相邻帧通常只要2到3字节
+                      /// 字典树模式下只有4字节的叶子节点序号
+};
+
+struct stack_profile
+{
+    uint32_t _stack_id;
+
+    uint32_t _live_count;
+
+    int64_t _live_size;
+
+    int64_t _alloc_size; /// 累计分配的字节数
+
+    int64_t _free_size; /// 累计释放的字节数
+};
+
+struct snapshot_entry
+{
+    uint32_t _stack_id;
+
+    uint32_t _live_count;
+
+    int64_t _live_size;
+};
+
+/// 某一时刻各调用点的存活内存，生成后不再修改，条目按id升序
+struct heap_snapshot
+{
+    DWORD _tick;
+
+    uint32_t _block_count; /// 包括未采样的块
+
+    uint64_t _memory_size;
+
+    uint32_t _entry_count;
+
+    size_t _size; /// 整个快照占用的字节数
+
+    snapshot_entry _entries[1]; /// 实际长度为_entry_count
+};
+
+struct stack_growth
+{
+    uint32_t _stack_id;
+
+    int32_t _count_delta;
+
+    int64_t _size_delta; /// 两个快照之间存活字节数的增长
+};
+
+/// 去重后的调用堆栈表，内存块里只保存32位的id
+/// 条目插入后不会删除，id始终有效，短生命周期的分配也不用反复插入
+/// 查找不加锁，插入新堆栈时只锁住桶所在的条带
+class stack_table
+{
+public:
+    stack_table();
+
+    ~stack_table();
+
+    uint32_t insert(const CallStack& call_stack); /// 返回id并增加引用计数，0表示失败
+
+    void release(uint32_t id);
+
+    void record_alloc(uint32_t id, size_t size);
+
+    void record_free(uint32_t id, size_t size);
+
+    uint32_t top(stack_profile* result, uint32_t count) const; /// 按存活字节数取前count个调用点
+
+    uint32_t snapshot(snapshot_entry* result, uint32_t count) const; /// 按id顺序取有存活内存的调用点，不加锁
+
+    const stack_entry* find(uint32_t id) const;
+
+    void decode(const stack_entry* entry, CallStack& call_stack) const;
+
+    void dump(uint32_t id) const;
+
+    uint32_t stack_count() const { return (uint32_t)_next_id; }
+
+    int64_t saved_size() const; /// 相比每个内存块保存完整堆栈节省的字节数，不遍历条目
+
+    int64_t frame_count() const { return _frame_count; } /// 所有不同堆栈的帧数之和
+
+    int64_t encoded_size() const; /// 这些帧编码后的字节数，字典树模式下是节点占用的字节数
+
+    bool set_trie(bool enabled); /// 只能在插入之前调用，失败时仍然按帧编码保存
+
+    bool use_trie() const { return _use_trie; }
+
+    uint32_t node_count() const { return _trie.node_count(); }
+
+    /// 调用链经过函数名包含function的帧的存活内存，只在字典树模式下可用
+    bool subtree(const char* function, subtree_profile& result) const;
+private:
+    struct chunk
+    {
+        chunk* _next;
+
+        size_t _size;
+    };
+
+    struct __declspec(align(64)) stripe
+    {
+        CRITICAL_SECTION _mutex;
+
+        uint8_t* _arena;
+
+        size_t _arena_left;
+
+        chunk* _chunks;
+
+        volatile LONGLONG _saved_size; /// 桶落在这个条带的条目按引用计数乘以完整堆栈字节数累加
+    };
+
+    static uint32_t hash(const CallStack& call_stack);
+
+    static uint32_t encode(const CallStack& call_stack, uint8_t* data); /// 返回字节数
+
+    static bool equal(const stack_entry* entry, uint32_t hash, const uint8_t* data, uint32_t length);
+
+    stack_entry* lookup(uint32_t bucket, uint32_t hash, const uint8_t* data, uint32_t length) const;
+
+    stack_entry* alloc_entry(stripe& s, uint32_t length);
+
+    bool assign_id(stack_entry* entry);
+
+    static void add_ref(stripe& s, stack_entry* entry, LONG delta); /// 同时更新条目的引用计数和条带的saved_size
+
+    stack_entry* volatile* _buckets;
+
+    stack_entry** volatile _pages[STACK_PAGE_COUNT];
+
+    stripe _stripes[STACK_STRIPE_COUNT];
+
+    volatile LONG _next_id;
+
+    volatile LONG _table_size; /// 表自身占用的字节数
+
+    volatile LONGLONG _frame_count;
+
+    volatile LONGLONG _encoded_size;
+
+    stack_trie _trie;
+
+    bool _use_trie;
+private:
+    stack_table(const stack_table&);
+    stack_table& operator=(const stack_table&);
+};
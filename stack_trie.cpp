@@ -0,0 +1,143 @@
+#include "stack_trie.h"
+#include "virtual_memory.h"
+
+stack_trie::stack_trie()
+{
+    _buckets = nullptr;
+    _node_count = 0;
+
+    memset((void*)_pages, 0, sizeof(_pages));
+
+    for (auto& s : _stripes) {
+        InitializeCriticalSectionAndSpinCount(&s._mutex, 100);
+    }
+}
+
+stack_trie::~stack_trie()
+{
+    for (auto& s : _stripes) {
+        DeleteCriticalSection(&s._mutex);
+    }
+
+    for (auto page : _pages) {
+        virtual_free(page, sizeof(stack_node) << STACK_NODE_PAGE_BITS);
+    }
+
+    virtual_free((void*)_buckets, sizeof(uint32_t) << STACK_NODE_BUCKET_BITS);
+}
+
+bool stack_trie::initialize()
+{
+    if (_buckets == nullptr) {
+        _buckets = (volatile uint32_t*)virtual_alloc(sizeof(uint32_t) << STACK_NODE_BUCKET_BITS);
+    }
+    return _buckets != nullptr;
+}
+
+uint32_t stack_trie::hash(uint32_t parent, SIZE_T pc)
+{
+    uint64_t h = ((uint64_t)pc ^ ((uint64_t)parent << 32)) * 0x9e3779b97f4a7c15ULL;
+    return (uint32_t)(h >> 32);
+}
+
+uint32_t stack_trie::lookup(uint32_t bucket, uint32_t parent, SIZE_T pc) const
+{
+    uint32_t index = _buckets[bucket];
+    while (index != 0) {
+        const stack_node* node = find(index);
+        if (node->_parent == parent && node->_pc == pc)
+            return index;
+
+        index = node->_next;
+    }
+    return 0;
+}
+
+uint32_t stack_trie::insert(const CallStack& call_stack)
+{
+    if (_buckets == nullptr)
+        return 0;
+
+    /// 从最外层的帧往里走，大部分前缀已经存在，每帧只查一次哈希表
+    uint32_t parent = 0;
+    for (UINT32 i = call_stack.size(); i > 0; i--) {
+        SIZE_T pc = call_stack[i - 1];
+        uint32_t bucket = hash(parent, pc) & ((1u << STACK_NODE_BUCKET_BITS) - 1);
+
+        uint32_t index = lookup(bucket, parent, pc);
+        if (index == 0) {
+            stripe& s = _stripes[bucket % STACK_NODE_STRIPE_COUNT];
+            EnterCriticalSection(&s._mutex);
+
+            index = lookup(bucket, parent, pc);
+            if (index == 0) {
+                index = alloc_node();
+                if (index != 0) {
+                    stack_node* node = (stack_node*)find(index);
+                    node->_pc = pc;
+                    node->_parent = parent;
+
+                    /// 节点写完之后再挂到桶上，无锁的读者看到的总是完整的节点
+                    node->_next = _buckets[bucket];
+                    InterlockedExchange((volatile LONG*)&_buckets[bucket], (LONG)index);
+                }
+            }
+
+            LeaveCriticalSection(&s._mutex);
+
+            if (index == 0)
+                return 0;
+        }
+
+        parent = index;
+    }
+
+    return parent;
+}
+
+void stack_trie::decode(uint32_t node, CallStack& call_stack) const
+{
+    /// 叶子到根正好是CallStack里从内到外的顺序
+    while (node != 0) {
+        const stack_node* entry = find(node);
+        if (entry == nullptr)
+            break;
+
+        call_stack.push_back(entry->_pc);
+        node = entry->_parent;
+    }
+}
+
+const stack_node* stack_trie::find(uint32_t node) const
+{
+    if (node == 0 || (node >> STACK_NODE_PAGE_BITS) >= STACK_NODE_PAGE_COUNT)
+        return nullptr;
+
+    stack_node* page = _pages[node >> STACK_NODE_PAGE_BITS];
+    if (page == nullptr)
+        return nullptr;
+
+    return &page[node & ((1u << STACK_NODE_PAGE_BITS) - 1)];
+}
+
+uint32_t stack_trie::alloc_node()
+{
+    uint32_t index = (uint32_t)InterlockedIncrement(&_node_count);
+    if ((index >> STACK_NODE_PAGE_BITS) >= STACK_NODE_PAGE_COUNT)
+        return 0;
+
+    stack_node* volatile* slot = &_pages[index >> STACK_NODE_PAGE_BITS];
+    if (*slot == nullptr) {
+        /// 多个条带可能同时申请同一页
+        size_t page_size = sizeof(stack_node) << STACK_NODE_PAGE_BITS;
+        stack_node* page = (stack_node*)virtual_alloc(page_size);
+        if (page == nullptr)
+            return 0;
+
+        if (InterlockedCompareExchangePointer((PVOID volatile*)slot, page, nullptr) != nullptr) {
+            virtual_free(page, page_size);
+        }
+    }
+
+    return index;
+}
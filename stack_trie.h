@@ -0,0 +1,78 @@
+#pragma once
+#include <stdint.h>
+#include "callstack.h"
+
+#define STACK_NODE_BUCKET_BITS 16 /// 哈希桶数量，桶里存节点序号
+
+#define STACK_NODE_STRIPE_COUNT 64 /// 插入锁的条带数
+
+#define STACK_NODE_PAGE_BITS 12 /// 每页的节点数，每页64KB
+
+#define STACK_NODE_PAGE_COUNT 4096 /// 最多16M个节点
+
+struct stack_node
+{
+    SIZE_T _pc;
+
+    uint32_t _parent; /// 调用者的节点，最外层的帧为0
+
+    volatile uint32_t _next; /// 同一个桶里的下一个节点
+};
+
+struct subtree_profile
+{
+    uint32_t _node_count; /// 函数名匹配的节点数，同一个函数出现在不同的调用链上时有多个
+
+    uint32_t _stack_count; /// 这些节点下面有存活内存的堆栈数
+
+    uint32_t _live_count;
+
+    int64_t _live_size;
+
+    int64_t _alloc_size;
+};
+
+/// 按调用关系组织的堆栈字典树，根方向是最外层的帧（线程入口），叶子方向是被调用者
+/// 共同的调用链只保存一次，一条堆栈用最内层帧的节点表示，沿_parent走到根就是整条堆栈
+/// 子节点按(父节点, 返回地址)放在一张哈希表里，查找不加锁；节点只增不删，父节点的序号总是小于子节点
+class stack_trie
+{
+public:
+    stack_trie();
+
+    ~stack_trie();
+
+    bool initialize(); /// 申请哈希桶，不使用字典树时不占内存
+
+    uint32_t insert(const CallStack& call_stack); /// 返回最内层帧的节点，空堆栈或失败时返回0
+
+    void decode(uint32_t node, CallStack& call_stack) const;
+
+    const stack_node* find(uint32_t node) const;
+
+    uint32_t node_count() const { return (uint32_t)_node_count; }
+
+    int64_t node_size() const { return (int64_t)_node_count * sizeof(stack_node); }
+private:
+    struct __declspec(align(64)) stripe
+    {
+        CRITICAL_SECTION _mutex;
+    };
+
+    static uint32_t hash(uint32_t parent, SIZE_T pc);
+
+    uint32_t lookup(uint32_t bucket, uint32_t parent, SIZE_T pc) const;
+
+    uint32_t alloc_node(); /// 返回序号，页已经申请好
+
+    volatile uint32_t* _buckets;
+
+    stack_node* volatile _pages[STACK_NODE_PAGE_COUNT];
+
+    stripe _stripes[STACK_NODE_STRIPE_COUNT];
+
+    volatile LONG _node_count;
+private:
+    stack_trie(const stack_trie&);
+    stack_trie& operator=(const stack_trie&);
+};
@@ -0,0 +1,294 @@
+#include "thread_stats.h"
+#include "virtual_memory.h"
+
+/// 记录按块向系统申请，不经过被挂钩的malloc
+struct thread_stats_chunk
+{
+    thread_stats _records[THREAD_STATS_CHUNK_SIZE];
+
+    thread_stats_chunk* _next;
+
+    uint32_t _used;
+};
+
+static __declspec(thread) thread_stats* _thread_stats;
+
+static uint32_t highest_bit(uint64_t value)
+{
+#ifdef _WIN32
+    unsigned long index;
+    if (_BitScanReverse(&index, (unsigned long)(value >> 32)))
+        return index + 32;
+
+    _BitScanReverse(&index, (unsigned long)value);
+    return index;
+#else
+    return 63 - __builtin_clzll(value);
+#endif
+}
+
+/// 最高位决定2的幂区间，紧接着的两位决定区间里的档，相邻两档相差不超过25%
+static uint32_t size_class(uint64_t size)
+{
+    const uint32_t sub_count = 1 << SIZE_CLASS_SUB_BITS;
+    if (size < sub_count)
+        return (uint32_t)size;
+
+    uint32_t shift = highest_bit(size) - SIZE_CLASS_SUB_BITS;
+    uint32_t sub = (uint32_t)(size >> shift) & (sub_count - 1);
+    return sub_count + shift * sub_count + sub;
+}
+
+static uint64_t size_class_min_size(uint32_t index)
+{
+    const uint32_t sub_count = 1 << SIZE_CLASS_SUB_BITS;
+    if (index < sub_count)
+        return index;
+
+    uint32_t shift = (index - sub_count) / sub_count;
+    uint32_t sub = (index - sub_count) % sub_count;
+    return (uint64_t)(sub_count + sub) << shift;
+}
+
+thread_stats_table::thread_stats_table()
+{
+    _threads = nullptr;
+    _chunks = nullptr;
+    _async = false;
+    InitializeCriticalSectionAndSpinCount(&_mutex, 100);
+    _fls_index = FlsAlloc(on_thread_exit);
+}
+
+thread_stats_table::~thread_stats_table()
+{
+    if (_fls_index != FLS_OUT_OF_INDEXES) {
+        FlsFree(_fls_index);
+    }
+
+    while (_chunks != nullptr) {
+        thread_stats_chunk* next = _chunks->_next;
+        virtual_free(_chunks, sizeof(thread_stats_chunk));
+        _chunks = next;
+    }
+
+    DeleteCriticalSection(&_mutex);
+}
+
+thread_stats* thread_stats_table::current()
+{
+    thread_stats* thread = _thread_stats;
+    if (thread == nullptr) {
+        thread = acquire();
+    }
+    return thread;
+}
+
+void thread_stats_table::add(volatile LONGLONG* counter, LONGLONG value) const
+{
+    /// 查询的线程读到旧值也没关系
+    if (_async) {
+        InterlockedExchangeAdd64(counter, value);
+    } else {
+        *counter = *counter + value;
+    }
+}
+
+void thread_stats_table::record_alloc(thread_stats* thread, size_t length)
+{
+    if (thread == nullptr)
+        return;
+
+    add(&thread->_alloc_count, 1);
+    add(&thread->_alloc_size, length);
+    InterlockedExchangeAdd64(&thread->_live_count, 1);
+    InterlockedExchangeAdd64(&thread->_live_size, length);
+
+    size_class_stats& stats = thread->_size_classes[size_class(length)];
+    add(&stats._alloc_count, 1);
+    InterlockedExchangeAdd64(&stats._live_count, 1);
+}
+
+void thread_stats_table::record_free(thread_stats* thread, thread_stats* owner, size_t length)
+{
+    if (thread != nullptr) {
+        add(&thread->_free_count, 1);
+        add(&thread->_free_size, length);
+
+        if (owner != thread) {
+            add(&thread->_remote_free_count, 1);
+            add(&thread->_remote_free_size, length);
+        }
+    }
+
+    if (owner != nullptr) {
+        InterlockedExchangeAdd64(&owner->_live_count, -1);
+        InterlockedExchangeAdd64(&owner->_live_size, -(LONGLONG)length);
+        InterlockedExchangeAdd64(&owner->_size_classes[size_class(length)]._live_count, -1);
+    }
+}
+
+void thread_stats_table::record_realloc(thread_stats* thread, thread_stats* owner, size_t old_length, size_t new_length)
+{
+    /// 块归到调用realloc的线程
+    if (thread != nullptr) {
+        add(&thread->_realloc_count, 1);
+        add(&thread->_alloc_size, new_length);
+        add(&thread->_free_size, old_length);
+        InterlockedExchangeAdd64(&thread->_live_count, 1);
+        InterlockedExchangeAdd64(&thread->_live_size, new_length);
+
+        size_class_stats& stats = thread->_size_classes[size_class(new_length)];
+        add(&stats._alloc_count, 1);
+        InterlockedExchangeAdd64(&stats._live_count, 1);
+    }
+
+    if (owner != nullptr) {
+        InterlockedExchangeAdd64(&owner->_live_count, -1);
+        InterlockedExchangeAdd64(&owner->_live_size, -(LONGLONG)old_length);
+        InterlockedExchangeAdd64(&owner->_size_classes[size_class(old_length)]._live_count, -1);
+    }
+}
+
+bool thread_stats_table::find(uint32_t tid, thread_profile& result)
+{
+    bool found = false;
+    for (thread_stats* thread = _threads; thread != nullptr; thread = thread->_next) {
+        if (thread->_tid != tid)
+            continue;
+
+        copy(thread, result);
+        found = true;
+        if (!result._exited)
+            break;
+    }
+    return found;
+}
+
+void thread_stats_table::for_each(thread_profile_callback callback, void* context)
+{
+    thread_profile profile;
+    for (thread_stats* thread = _threads; thread != nullptr; thread = thread->_next) {
+        copy(thread, profile);
+        callback(profile, context);
+    }
+}
+
+uint32_t thread_stats_table::size_classes(size_class_profile* result, uint32_t count)
+{
+    if (count > SIZE_CLASS_COUNT) { count = SIZE_CLASS_COUNT; }
+
+    for (uint32_t i = 0; i < count; i++) {
+        result[i]._min_size = size_class_min_size(i);
+        result[i]._alloc_count = 0;
+        result[i]._live_count = 0;
+    }
+
+    /// 不加锁读取，和其他统计一样只是近似值
+    for (thread_stats* thread = _threads; thread != nullptr; thread = thread->_next) {
+        for (uint32_t i = 0; i < count; i++) {
+            result[i]._alloc_count += thread->_size_classes[i]._alloc_count;
+            result[i]._live_count += thread->_size_classes[i]._live_count;
+        }
+    }
+
+    return count;
+}
+
+uint32_t thread_stats_table::count() const
+{
+    uint32_t count = 0;
+    for (thread_stats* thread = _threads; thread != nullptr; thread = thread->_next) {
+        count++;
+    }
+    return count;
+}
+
+thread_stats* thread_stats_table::acquire()
+{
+    thread_stats* thread = nullptr;
+    EnterCriticalSection(&_mutex);
+
+    /// 优先复用已退出、分配的块也都释放了的记录，仍然留在链表里
+    for (thread_stats* it = _threads; it != nullptr; it = it->_next) {
+        if (it->_exited && it->_live_count == 0) {
+            thread = it;
+            break;
+        }
+    }
+
+    bool reused = thread != nullptr;
+    if (!reused) {
+        if (_chunks == nullptr || _chunks->_used == THREAD_STATS_CHUNK_SIZE) {
+            thread_stats_chunk* chunk = (thread_stats_chunk*)virtual_alloc(sizeof(thread_stats_chunk));
+            if (chunk == nullptr) {
+                LeaveCriticalSection(&_mutex);
+                return nullptr;
+            }
+
+            chunk->_next = _chunks;
+            chunk->_used = 0;
+            _chunks = chunk;
+        }
+
+        thread = &_chunks->_records[_chunks->_used++];
+    }
+
+    thread->_tid = GetCurrentThreadId();
+    thread->_alloc_count = 0;
+    thread->_alloc_size = 0;
+    thread->_free_count = 0;
+    thread->_free_size = 0;
+    thread->_realloc_count = 0;
+    thread->_remote_free_count = 0;
+    thread->_remote_free_size = 0;
+    thread->_live_count = 0;
+    thread->_live_size = 0;
+    for (uint32_t i = 0; i < SIZE_CLASS_COUNT; i++) {
+        thread->_size_classes[i]._alloc_count = 0;
+        thread->_size_classes[i]._live_count = 0;
+    }
+    thread->_exited = FALSE;
+
+    if (!reused) {
+        /// 查询时不加锁遍历，记录填好之后再挂到链表上
+        thread->_next = _threads;
+        InterlockedExchangePointer((PVOID volatile*)&_threads, thread);
+    }
+
+    LeaveCriticalSection(&_mutex);
+
+    _thread_stats = thread;
+    if (_fls_index != FLS_OUT_OF_INDEXES) {
+        FlsSetValue(_fls_index, thread);
+    }
+
+    return thread;
+}
+
+void WINAPI thread_stats_table::on_thread_exit(PVOID data)
+{
+    thread_stats* thread = (thread_stats*)data;
+    if (thread == nullptr)
+        return;
+
+    if (thread->_tid == GetCurrentThreadId()) {
+        _thread_stats = nullptr;
+    }
+
+    InterlockedExchange(&thread->_exited, TRUE);
+}
+
+void thread_stats_table::copy(const thread_stats* thread, thread_profile& result)
+{
+    result._tid = thread->_tid;
+    result._exited = thread->_exited != FALSE;
+    result._alloc_count = thread->_alloc_count;
+    result._alloc_size = thread->_alloc_size;
+    result._free_count = thread->_free_count;
+    result._free_size = thread->_free_size;
+    result._realloc_count = thread->_realloc_count;
+    result._remote_free_count = thread->_remote_free_count;
+    result._remote_free_size = thread->_remote_free_size;
+    result._live_count = thread->_live_count;
+    result._live_size = thread->_live_size;
+}
@@ -0,0 +1,135 @@
+#pragma once
+#include <stdint.h>
+#include "platform.h"
+
+#define THREAD_STATS_CHUNK_SIZE 64 /// 每次向系统申请的记录数
+
+#define SIZE_CLASS_SUB_BITS 2 /// 每个2的幂区间再平分成4档
+
+#define SIZE_CLASS_COUNT 256 /// 覆盖64位的全部大小，小于4的大小各占一档
+
+struct size_class_stats
+{
+    volatile LONGLONG _alloc_count; /// 累计分配次数，realloc按新的大小计入
+
+    volatile LONGLONG _live_count;
+};
+
+/// 一个线程的分配统计，只由本线程修改（异步模式下由后台线程代为修改）
+/// 只有释放其他线程分配的块时才写别人的记录，查询时再汇总，分配路径上没有共享的缓存行
+/// 存活计数会被释放块的线程减少，总是用原子操作；其余计数同步模式下只有本线程写，直接加
+struct __declspec(align(64)) thread_stats
+{
+    thread_stats* volatile _next; /// 所有记录串成链表，只增不减
+
+    DWORD _tid;
+
+    volatile LONG _exited; /// 线程已退出，存活块都释放后记录可以给新线程复用
+
+    volatile LONGLONG _alloc_count; /// 本线程的调用次数和字节数
+
+    volatile LONGLONG _alloc_size;
+
+    volatile LONGLONG _free_count;
+
+    volatile LONGLONG _free_size;
+
+    volatile LONGLONG _realloc_count; /// 字节数按释放旧块、分配新块计入
+
+    volatile LONGLONG _remote_free_count; /// 释放了其他线程分配的块
+
+    volatile LONGLONG _remote_free_size;
+
+    volatile LONGLONG _live_count; /// 本线程分配、还没有释放的块，不管由哪个线程释放
+
+    volatile LONGLONG _live_size;
+
+    size_class_stats _size_classes[SIZE_CLASS_COUNT]; /// 存活的块记在分配它的线程名下
+};
+
+struct thread_profile
+{
+    uint32_t _tid;
+
+    bool _exited;
+
+    uint64_t _alloc_count;
+
+    uint64_t _alloc_size;
+
+    uint64_t _free_count;
+
+    uint64_t _free_size;
+
+    uint64_t _realloc_count;
+
+    uint64_t _remote_free_count;
+
+    uint64_t _remote_free_size;
+
+    int64_t _live_count;
+
+    int64_t _live_size;
+};
+
+struct size_class_profile
+{
+    uint64_t _min_size; /// 这一档是[_min_size, 下一档的_min_size)
+
+    uint64_t _alloc_count;
+
+    int64_t _live_count;
+};
+
+struct thread_stats_chunk;
+
+typedef void (*thread_profile_callback)(const thread_profile& profile, void* context);
+
+/// 按线程的统计，记录在线程第一次分配时创建，线程退出后保留到它分配的块都释放
+class thread_stats_table
+{
+public:
+    thread_stats_table();
+
+    ~thread_stats_table();
+
+    thread_stats* current(); /// 本线程的记录，申请不到时返回nullptr
+
+    void record_alloc(thread_stats* thread, size_t length);
+
+    /// owner是分配这个块的线程
+    void record_free(thread_stats* thread, thread_stats* owner, size_t length);
+
+    void record_realloc(thread_stats* thread, thread_stats* owner, size_t old_length, size_t new_length);
+
+    bool find(uint32_t tid, thread_profile& result); /// 同一个tid有多条记录时取没有退出的
+
+    void for_each(thread_profile_callback callback, void* context);
+
+    uint32_t size_classes(size_class_profile* result, uint32_t count); /// 合并所有线程，返回填写的档数
+
+    uint32_t count() const; /// 包括已退出的线程
+
+    void set_async(bool async) { _async = async; } /// 异步模式下后台线程和realloc的同步路径会同时写一个线程的记录
+private:
+    thread_stats* acquire();
+
+    void add(volatile LONGLONG* counter, LONGLONG value) const;
+
+    static void WINAPI on_thread_exit(PVOID data);
+
+    static void copy(const thread_stats* thread, thread_profile& result);
+
+    thread_stats* volatile _threads;
+
+    thread_stats_chunk* _chunks;
+
+    CRITICAL_SECTION _mutex; /// 只在申请记录时使用
+
+    DWORD _fls_index;
+
+    volatile bool _async;
+private:
+    thread_stats_table(const thread_stats_table&);
+    thread_stats_table& operator=(const thread_stats_table&);
+};
@@ -0,0 +1,702 @@
+#ifndef _WIN32
+
+#include <link.h>
+#include "unwind_cache.h"
+
+#define UNWIND_MAX_MODULES 1024 /// 超过的模块不查找，回溯到那里为止
+
+#define UNWIND_MAX_STATES 8 /// DW_CFA_remember_state的嵌套层数
+
+#define UNWIND_MAX_RANGES 64 /// 一次刷新最多按范围清除的模块数，超过时清空整个表
+
+/// .eh_frame里指针的编码方式
+#define DW_EH_PE_absptr   0x00
+#define DW_EH_PE_uleb128  0x01
+#define DW_EH_PE_udata2   0x02
+#define DW_EH_PE_udata4   0x03
+#define DW_EH_PE_udata8   0x04
+#define DW_EH_PE_sleb128  0x09
+#define DW_EH_PE_sdata2   0x0a
+#define DW_EH_PE_sdata4   0x0b
+#define DW_EH_PE_sdata8   0x0c
+#define DW_EH_PE_pcrel    0x10
+#define DW_EH_PE_datarel  0x30
+#define DW_EH_PE_omit     0xff
+
+/// x86-64的DWARF寄存器编号
+#define DW_REG_RBP 6
+#define DW_REG_RSP 7
+
+enum register_rule
+{
+    RULE_SAME, /// 和调用者相同
+    RULE_OFFSET, /// 保存在CFA + offset
+    RULE_UNDEFINED, /// 返回地址未定义表示栈底
+    RULE_OTHER, /// 其他保存方式，这里不支持
+};
+
+/// 执行CFA指令时的一行规则，只跟踪回溯需要的CFA、rbp和返回地址
+struct cfa_row
+{
+    uint32_t _cfa_reg;
+
+    int64_t _cfa_offset;
+
+    bool _cfa_expression; /// CFA由表达式计算，不支持
+
+    uint8_t _bp_rule;
+
+    int64_t _bp_offset;
+
+    uint8_t _ra_rule;
+
+    int64_t _ra_offset;
+};
+
+struct cie_info
+{
+    uint64_t _code_align;
+
+    int64_t _data_align;
+
+    uint64_t _ra_reg;
+
+    uint8_t _fde_encoding;
+
+    bool _signal_frame;
+
+    bool _has_aug_data;
+
+    const uint8_t* _instructions;
+
+    const uint8_t* _end;
+};
+
+struct unwind_module
+{
+    SIZE_T _start; /// 所有PT_LOAD段覆盖的范围
+
+    SIZE_T _end;
+
+    const uint8_t* _hdr; /// .eh_frame_hdr，没有或者格式不支持时二分查找表为空
+
+    const int32_t* _table; /// (起始地址, FDE地址)对，都是相对_hdr的偏移，按起始地址排序
+
+    uint32_t _fde_count;
+};
+
+struct module_list
+{
+    unwind_module _modules[UNWIND_MAX_MODULES];
+
+    uint32_t _count;
+};
+
+struct module_counters
+{
+    unsigned long long _adds;
+
+    unsigned long long _subs;
+};
+
+volatile uint64_t _unwind_cache[UNWIND_CACHE_SIZE];
+
+/// 模块表只在未命中时加锁访问，两份轮换，刷新时和上一份比较找出变化的模块
+static module_list _module_lists[2];
+
+static uint32_t _current_list;
+
+static module_counters _counters; /// 上次扫描时的加载和卸载次数
+
+static CRITICAL_SECTION _mutex;
+
+static bool _initialized;
+
+template <typename T>
+static T read_value(const uint8_t*& p)
+{
+    T value;
+    memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+    return value;
+}
+
+static uint64_t read_uleb128(const uint8_t*& p)
+{
+    uint64_t value = 0;
+    uint32_t shift = 0;
+    uint8_t byte;
+    do {
+        byte = *p++;
+        if (shift < 64) { value |= (uint64_t)(byte & 0x7f) << shift; }
+        shift += 7;
+    } while (byte & 0x80);
+    return value;
+}
+
+static int64_t read_sleb128(const uint8_t*& p)
+{
+    int64_t value = 0;
+    uint32_t shift = 0;
+    uint8_t byte;
+    do {
+        byte = *p++;
+        if (shift < 64) { value |= (int64_t)(byte & 0x7f) << shift; }
+        shift += 7;
+    } while (byte & 0x80);
+
+    if (shift < 64 && (byte & 0x40)) { value |= -((int64_t)1 << shift); }
+    return value;
+}
+
+/// 只支持绝对、pcrel和datarel，不解引用间接指针，个性函数的地址只需要跳过
+static bool read_encoded(const uint8_t*& p, uint8_t encoding, SIZE_T data_base, SIZE_T& value)
+{
+    const uint8_t* start = p;
+    switch (encoding & 0x0f) {
+    case DW_EH_PE_absptr:  value = read_value<SIZE_T>(p); break;
+    case DW_EH_PE_uleb128: value = (SIZE_T)read_uleb128(p); break;
+    case DW_EH_PE_udata2:  value = read_value<uint16_t>(p); break;
+    case DW_EH_PE_udata4:  value = read_value<uint32_t>(p); break;
+    case DW_EH_PE_udata8:  value = (SIZE_T)read_value<uint64_t>(p); break;
+    case DW_EH_PE_sleb128: value = (SIZE_T)read_sleb128(p); break;
+    case DW_EH_PE_sdata2:  value = (SIZE_T)(int64_t)read_value<int16_t>(p); break;
+    case DW_EH_PE_sdata4:  value = (SIZE_T)(int64_t)read_value<int32_t>(p); break;
+    case DW_EH_PE_sdata8:  value = (SIZE_T)read_value<int64_t>(p); break;
+    default:
+        return false;
+    }
+
+    switch (encoding & 0x70) {
+    case 0:
+        break;
+    case DW_EH_PE_pcrel:
+        value += (SIZE_T)start;
+        break;
+    case DW_EH_PE_datarel:
+        value += data_base;
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+static int collect_module(struct dl_phdr_info* info, size_t, void* data)
+{
+    module_list* list = (module_list*)data;
+    if (list->_count == UNWIND_MAX_MODULES)
+        return 1;
+
+    unwind_module& module = list->_modules[list->_count];
+    module._start = ~(SIZE_T)0;
+    module._end = 0;
+    module._hdr = nullptr;
+    module._table = nullptr;
+    module._fde_count = 0;
+
+    for (uint32_t i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+        SIZE_T start = info->dlpi_addr + phdr.p_vaddr;
+        if (phdr.p_type == PT_LOAD) {
+            if (start < module._start) { module._start = start; }
+            if (start + phdr.p_memsz > module._end) { module._end = start + phdr.p_memsz; }
+        }
+        else if (phdr.p_type == PT_GNU_EH_FRAME) {
+            module._hdr = (const uint8_t*)start;
+        }
+    }
+
+    if (module._end <= module._start)
+        return 0;
+
+    /// 版本、eh_frame_ptr的编码、fde_count的编码、查找表的编码，查找表只支持datarel|sdata4
+    const uint8_t* p = module._hdr;
+    if (p != nullptr && p[0] == 1 && p[2] != DW_EH_PE_omit && p[3] == (DW_EH_PE_datarel | DW_EH_PE_sdata4)) {
+        uint8_t eh_frame_encoding = p[1];
+        uint8_t count_encoding = p[2];
+        p += 4;
+
+        SIZE_T eh_frame = 0;
+        SIZE_T fde_count = 0;
+        if (read_encoded(p, eh_frame_encoding, (SIZE_T)module._hdr, eh_frame) &&
+            read_encoded(p, count_encoding, (SIZE_T)module._hdr, fde_count)) {
+            module._table = (const int32_t*)p;
+            module._fde_count = (uint32_t)fde_count;
+        }
+    }
+
+    list->_count++;
+    return 0;
+}
+
+static int read_counters(struct dl_phdr_info* info, size_t size, void* data)
+{
+    module_counters* counters = (module_counters*)data;
+    if (size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+        counters->_adds = info->dlpi_adds;
+        counters->_subs = info->dlpi_subs;
+    }
+    return 1; /// 计数在每个模块里都一样，看第一个就够了
+}
+
+static bool modules_changed()
+{
+    module_counters counters = _counters;
+    dl_iterate_phdr(read_counters, &counters);
+    return counters._adds != _counters._adds || counters._subs != _counters._subs;
+}
+
+static bool same_module(const unwind_module& a, const unwind_module& b)
+{
+    return a._start == b._start && a._end == b._end && a._hdr == b._hdr;
+}
+
+/// 在另一份表里找不到的模块，范围写进ranges，返回新的个数，超过上限时返回UNWIND_MAX_RANGES + 1
+static uint32_t diff_modules(const module_list& a, const module_list& b, SIZE_T (*ranges)[2], uint32_t count)
+{
+    for (uint32_t i = 0; i < a._count && count <= UNWIND_MAX_RANGES; i++) {
+        bool found = false;
+        for (uint32_t j = 0; j < b._count; j++) {
+            if (same_module(a._modules[i], b._modules[j])) {
+                found = true;
+                break;
+            }
+        }
+
+        if (found)
+            continue;
+
+        if (count < UNWIND_MAX_RANGES) {
+            ranges[count][0] = a._modules[i]._start;
+            ranges[count][1] = a._modules[i]._end;
+        }
+        count++;
+    }
+    return count;
+}
+
+/// 只清除范围内的表项，其他模块的规则不受影响
+static void invalidate(SIZE_T (*ranges)[2], uint32_t count)
+{
+    for (uint32_t i = 0; i < UNWIND_CACHE_SIZE; i++) {
+        uint64_t entry = _unwind_cache[i];
+        if (entry == 0)
+            continue;
+
+        SIZE_T check = (SIZE_T)(entry >> UNWIND_RULE_BITS);
+        SIZE_T pc = (check << UNWIND_CACHE_BITS) | ((i ^ check) & (UNWIND_CACHE_SIZE - 1));
+
+        bool hit = count > UNWIND_MAX_RANGES;
+        for (uint32_t j = 0; j < count && !hit; j++) {
+            hit = pc >= ranges[j][0] && pc < ranges[j][1];
+        }
+
+        if (hit) {
+            _unwind_cache[i] = 0;
+        }
+    }
+}
+
+/// 重新扫描模块，卸载的模块的地址可能被新加载的模块复用，两边的范围都要清除
+static void rescan()
+{
+    dl_iterate_phdr(read_counters, &_counters);
+
+    module_list& old_list = _module_lists[_current_list];
+    module_list& new_list = _module_lists[_current_list ^ 1];
+    new_list._count = 0;
+    dl_iterate_phdr(collect_module, &new_list);
+
+    SIZE_T ranges[UNWIND_MAX_RANGES][2];
+    uint32_t count = diff_modules(old_list, new_list, ranges, 0);
+    count = diff_modules(new_list, old_list, ranges, count);
+    if (count != 0) {
+        invalidate(ranges, count);
+    }
+
+    _current_list ^= 1;
+}
+
+static const unwind_module* find_module(SIZE_T pc)
+{
+    const module_list& list = _module_lists[_current_list];
+    for (uint32_t i = 0; i < list._count; i++) {
+        if (pc >= list._modules[i]._start && pc < list._modules[i]._end)
+            return &list._modules[i];
+    }
+    return nullptr;
+}
+
+/// 最后一个起始地址不大于pc的FDE，是否覆盖pc由调用者检查
+static const uint8_t* find_fde(const unwind_module& module, SIZE_T pc)
+{
+    int64_t target = (int64_t)(pc - (SIZE_T)module._hdr);
+    uint32_t low = 0;
+    uint32_t high = module._fde_count;
+    while (low < high) {
+        uint32_t mid = (low + high) / 2;
+        if (module._table[mid * 2] <= target) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+
+    if (low == 0)
+        return nullptr;
+
+    return module._hdr + module._table[(low - 1) * 2 + 1];
+}
+
+static bool parse_cie(const uint8_t* p, cie_info& info)
+{
+    uint64_t length = read_value<uint32_t>(p);
+    if (length == 0xffffffff) { length = read_value<uint64_t>(p); }
+    if (length == 0)
+        return false;
+
+    info._end = p + length;
+    if (read_value<uint32_t>(p) != 0)
+        return false;
+
+    uint8_t version = *p++;
+    if (version != 1 && version != 3)
+        return false;
+
+    const char* augmentation = (const char*)p;
+    p += strlen(augmentation) + 1;
+    if (augmentation[0] != 0 && augmentation[0] != 'z')
+        return false;
+
+    info._code_align = read_uleb128(p);
+    info._data_align = read_sleb128(p);
+    info._ra_reg = version == 1 ? *p++ : read_uleb128(p);
+    info._fde_encoding = DW_EH_PE_absptr;
+    info._signal_frame = false;
+    info._has_aug_data = augmentation[0] == 'z';
+
+    if (info._has_aug_data) {
+        uint64_t aug_length = read_uleb128(p);
+        const uint8_t* aug_end = p + aug_length;
+        for (const char* c = augmentation + 1; *c != 0; c++) {
+            if (*c == 'R') {
+                info._fde_encoding = *p++;
+            }
+            else if (*c == 'L') {
+                p++;
+            }
+            else if (*c == 'P') {
+                uint8_t encoding = *p++;
+                SIZE_T personality;
+                if (!read_encoded(p, encoding & 0x7f, 0, personality))
+                    return false;
+            }
+            else if (*c == 'S') {
+                info._signal_frame = true;
+            }
+            else {
+                break; /// 不认识的字符之后的数据按长度跳过
+            }
+        }
+        p = aug_end;
+    }
+
+    info._instructions = p;
+    return true;
+}
+
+static void set_rule(cfa_row& row, const cie_info& cie, uint64_t reg, uint8_t rule, int64_t offset)
+{
+    if (reg == DW_REG_RBP) {
+        row._bp_rule = rule;
+        row._bp_offset = offset;
+    }
+    else if (reg == cie._ra_reg) {
+        row._ra_rule = rule;
+        row._ra_offset = offset;
+    }
+}
+
+static void restore_rule(cfa_row& row, const cfa_row& initial, const cie_info& cie, uint64_t reg)
+{
+    if (reg == DW_REG_RBP) {
+        row._bp_rule = initial._bp_rule;
+        row._bp_offset = initial._bp_offset;
+    }
+    else if (reg == cie._ra_reg) {
+        row._ra_rule = initial._ra_rule;
+        row._ra_offset = initial._ra_offset;
+    }
+}
+
+/// 执行CFA指令直到地址超过target，不支持的指令返回false
+static bool execute(const uint8_t* p, const uint8_t* end, const cie_info& cie, SIZE_T target,
+                    SIZE_T& loc, cfa_row& row, const cfa_row& initial)
+{
+    cfa_row states[UNWIND_MAX_STATES];
+    uint32_t depth = 0;
+    uint64_t reg;
+    uint64_t delta;
+    SIZE_T address;
+
+    while (p < end && loc <= target) {
+        uint8_t op = *p++;
+        switch (op & 0xc0) {
+        case 0x40: /// DW_CFA_advance_loc
+            loc += (op & 0x3f) * cie._code_align;
+            continue;
+        case 0x80: /// DW_CFA_offset
+            set_rule(row, cie, op & 0x3f, RULE_OFFSET, (int64_t)read_uleb128(p) * cie._data_align);
+            continue;
+        case 0xc0: /// DW_CFA_restore
+            restore_rule(row, initial, cie, op & 0x3f);
+            continue;
+        }
+
+        switch (op) {
+        case 0x00: /// DW_CFA_nop
+            break;
+        case 0x01: /// DW_CFA_set_loc
+            if (!read_encoded(p, cie._fde_encoding, 0, address))
+                return false;
+            loc = address;
+            break;
+        case 0x02: /// DW_CFA_advance_loc1
+            loc += read_value<uint8_t>(p) * cie._code_align;
+            break;
+        case 0x03: /// DW_CFA_advance_loc2
+            loc += read_value<uint16_t>(p) * cie._code_align;
+            break;
+        case 0x04: /// DW_CFA_advance_loc4
+            loc += read_value<uint32_t>(p) * cie._code_align;
+            break;
+        case 0x05: /// DW_CFA_offset_extended
+            reg = read_uleb128(p);
+            set_rule(row, cie, reg, RULE_OFFSET, (int64_t)read_uleb128(p) * cie._data_align);
+            break;
+        case 0x06: /// DW_CFA_restore_extended
+            restore_rule(row, initial, cie, read_uleb128(p));
+            break;
+        case 0x07: /// DW_CFA_undefined
+            set_rule(row, cie, read_uleb128(p), RULE_UNDEFINED, 0);
+            break;
+        case 0x08: /// DW_CFA_same_value
+            set_rule(row, cie, read_uleb128(p), RULE_SAME, 0);
+            break;
+        case 0x09: /// DW_CFA_register
+            reg = read_uleb128(p);
+            read_uleb128(p);
+            set_rule(row, cie, reg, RULE_OTHER, 0);
+            break;
+        case 0x0a: /// DW_CFA_remember_state
+            if (depth == UNWIND_MAX_STATES)
+                return false;
+            states[depth++] = row;
+            break;
+        case 0x0b: /// DW_CFA_restore_state
+            if (depth == 0)
+                return false;
+            row = states[--depth];
+            break;
+        case 0x0c: /// DW_CFA_def_cfa
+            row._cfa_reg = (uint32_t)read_uleb128(p);
+            row._cfa_offset = (int64_t)read_uleb128(p);
+            row._cfa_expression = false;
+            break;
+        case 0x0d: /// DW_CFA_def_cfa_register
+            row._cfa_reg = (uint32_t)read_uleb128(p);
+            row._cfa_expression = false;
+            break;
+        case 0x0e: /// DW_CFA_def_cfa_offset
+            row._cfa_offset = (int64_t)read_uleb128(p);
+            break;
+        case 0x0f: /// DW_CFA_def_cfa_expression
+            delta = read_uleb128(p);
+            p += delta;
+            row._cfa_expression = true;
+            break;
+        case 0x10: /// DW_CFA_expression
+            reg = read_uleb128(p);
+            delta = read_uleb128(p);
+            p += delta;
+            set_rule(row, cie, reg, RULE_OTHER, 0);
+            break;
+        case 0x11: /// DW_CFA_offset_extended_sf
+            reg = read_uleb128(p);
+            set_rule(row, cie, reg, RULE_OFFSET, read_sleb128(p) * cie._data_align);
+            break;
+        case 0x12: /// DW_CFA_def_cfa_sf
+            row._cfa_reg = (uint32_t)read_uleb128(p);
+            row._cfa_offset = read_sleb128(p) * cie._data_align;
+            row._cfa_expression = false;
+            break;
+        case 0x13: /// DW_CFA_def_cfa_offset_sf
+            row._cfa_offset = read_sleb128(p) * cie._data_align;
+            break;
+        case 0x14: /// DW_CFA_val_offset
+            reg = read_uleb128(p);
+            read_uleb128(p);
+            set_rule(row, cie, reg, RULE_OTHER, 0);
+            break;
+        case 0x15: /// DW_CFA_val_offset_sf
+            reg = read_uleb128(p);
+            read_sleb128(p);
+            set_rule(row, cie, reg, RULE_OTHER, 0);
+            break;
+        case 0x16: /// DW_CFA_val_expression
+            reg = read_uleb128(p);
+            delta = read_uleb128(p);
+            p += delta;
+            set_rule(row, cie, reg, RULE_OTHER, 0);
+            break;
+        case 0x2e: /// DW_CFA_GNU_args_size
+            read_uleb128(p);
+            break;
+        case 0x2f: /// DW_CFA_GNU_negative_offset_extended
+            reg = read_uleb128(p);
+            set_rule(row, cie, reg, RULE_OFFSET, -(int64_t)read_uleb128(p) * cie._data_align);
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+/// 只有CFA = rsp或rbp加偏移、返回地址在CFA - 8、rbp不变或者保存在CFA下面的规则能压缩
+static uint32_t pack_rule(const cfa_row& row)
+{
+    if (row._cfa_expression || (row._cfa_reg != DW_REG_RSP && row._cfa_reg != DW_REG_RBP))
+        return UNWIND_RULE_END;
+
+    if (row._cfa_offset < (int64_t)sizeof(SIZE_T) || row._cfa_offset > UNWIND_RULE_OFFSET_MASK)
+        return UNWIND_RULE_END;
+
+    if (row._ra_rule != RULE_OFFSET || row._ra_offset != -(int64_t)sizeof(SIZE_T))
+        return UNWIND_RULE_END;
+
+    uint32_t rule = (uint32_t)row._cfa_offset;
+    if (row._cfa_reg == DW_REG_RBP) {
+        rule |= UNWIND_RULE_CFA_BP;
+    }
+
+    if (row._bp_rule == RULE_OFFSET) {
+        int64_t slot = -row._bp_offset / (int64_t)sizeof(SIZE_T);
+        if (row._bp_offset >= 0 || row._bp_offset % (int64_t)sizeof(SIZE_T) != 0 || slot > UNWIND_RULE_BP_MASK)
+            return UNWIND_RULE_END;
+
+        rule |= (uint32_t)slot << UNWIND_RULE_BP_SHIFT;
+    }
+    else if (row._bp_rule != RULE_SAME) {
+        return UNWIND_RULE_END;
+    }
+    return rule;
+}
+
+/// target是返回地址减1，调用指令可能是函数的最后一条指令
+static uint32_t compute_rule(const unwind_module& module, SIZE_T target)
+{
+    const uint8_t* p = find_fde(module, target);
+    if (p == nullptr)
+        return UNWIND_RULE_END;
+
+    uint64_t length = read_value<uint32_t>(p);
+    if (length == 0xffffffff) { length = read_value<uint64_t>(p); }
+    if (length == 0)
+        return UNWIND_RULE_END;
+
+    const uint8_t* end = p + length;
+    const uint8_t* cie_pointer = p;
+    uint32_t cie_offset = read_value<uint32_t>(p);
+    if (cie_offset == 0)
+        return UNWIND_RULE_END;
+
+    cie_info cie;
+    if (!parse_cie(cie_pointer - cie_offset, cie) || cie._signal_frame)
+        return UNWIND_RULE_END;
+
+    SIZE_T pc_begin;
+    SIZE_T pc_range;
+    if (!read_encoded(p, cie._fde_encoding, 0, pc_begin) || !read_encoded(p, cie._fde_encoding & 0x0f, 0, pc_range))
+        return UNWIND_RULE_END;
+
+    if (target < pc_begin || target - pc_begin >= pc_range)
+        return UNWIND_RULE_END;
+
+    if (cie._has_aug_data) {
+        uint64_t aug_length = read_uleb128(p);
+        p += aug_length;
+    }
+
+    /// CIE的初始指令之前CFA未定义，返回地址未定义时回溯到此为止
+    cfa_row row;
+    row._cfa_reg = DW_REG_RSP;
+    row._cfa_offset = 0;
+    row._cfa_expression = false;
+    row._bp_rule = RULE_SAME;
+    row._bp_offset = 0;
+    row._ra_rule = RULE_UNDEFINED;
+    row._ra_offset = 0;
+
+    SIZE_T loc = pc_begin;
+    if (!execute(cie._instructions, cie._end, cie, target, loc, row, row))
+        return UNWIND_RULE_END;
+
+    cfa_row initial = row;
+    if (!execute(p, end, cie, target, loc, row, initial))
+        return UNWIND_RULE_END;
+
+    return pack_rule(row);
+}
+
+uint32_t unwind_cache_fill(SIZE_T pc)
+{
+    if (!_initialized)
+        return UNWIND_RULE_END;
+
+    EnterCriticalSection(&_mutex);
+
+    /// 不在已知的模块里时才检查有没有新加载的模块，JIT代码之类的地址每次都会走到这里，所以不缓存
+    const unwind_module* module = find_module(pc);
+    if (module == nullptr && modules_changed()) {
+        rescan();
+        module = find_module(pc);
+    }
+
+    uint32_t rule = UNWIND_RULE_END;
+    if (module != nullptr) {
+        if (module->_table != nullptr) {
+            rule = compute_rule(*module, pc - 1);
+        }
+        _unwind_cache[unwind_cache_index(pc)] = ((uint64_t)(pc >> UNWIND_CACHE_BITS) << UNWIND_RULE_BITS) | rule;
+    }
+
+    LeaveCriticalSection(&_mutex);
+    return rule;
+}
+
+void unwind_cache_initialize()
+{
+    if (_initialized)
+        return;
+
+    InitializeCriticalSectionAndSpinCount(&_mutex, 100);
+    rescan();
+    _initialized = true;
+}
+
+void unwind_cache_refresh()
+{
+    if (!_initialized)
+        return;
+
+    EnterCriticalSection(&_mutex);
+    if (modules_changed()) {
+        rescan();
+    }
+    LeaveCriticalSection(&_mutex);
+}
+
+#endif
@@ -0,0 +1,48 @@
+#pragma once
+#include <stdint.h>
+#include "platform.h"
+
+/// 只在Linux x86-64下使用，按.eh_frame里的CFI规则回溯，不依赖帧指针
+/// 每个返回地址的规则第一次用到时从.eh_frame_hdr的二分查找表里找到FDE、执行CFA指令算出，
+/// 压缩成24位存进按返回地址直接映射的表，之后每一帧只读一次表项
+
+#define UNWIND_CACHE_BITS 14 /// 表项数的对数，每项8字节，共128KB
+
+#define UNWIND_CACHE_SIZE (1 << UNWIND_CACHE_BITS)
+
+#define UNWIND_RULE_END 0 /// 没有FDE或者规则表示不了，回溯到这一帧为止
+
+#define UNWIND_RULE_OFFSET_MASK 0xffff /// CFA相对基准寄存器的偏移
+
+#define UNWIND_RULE_CFA_BP 0x10000 /// 基准寄存器是rbp，否则是rsp
+
+#define UNWIND_RULE_BP_SHIFT 17 /// rbp保存在CFA - 8 * n，n为0表示rbp不变
+
+#define UNWIND_RULE_BP_MASK 0x3f
+
+#define UNWIND_RULE_BITS 24
+
+/// 表项的高位是返回地址右移UNWIND_CACHE_BITS，和下标一起唯一确定返回地址，低24位是规则
+/// 一次64位读写，不需要加锁，读到别的返回地址的表项时校验不过，当作未命中
+extern volatile uint64_t _unwind_cache[UNWIND_CACHE_SIZE];
+
+uint32_t unwind_cache_fill(SIZE_T pc); /// 未命中时查找并填写，返回规则
+
+inline uint32_t unwind_cache_index(SIZE_T pc)
+{
+    return (uint32_t)((pc ^ (pc >> UNWIND_CACHE_BITS)) & (UNWIND_CACHE_SIZE - 1));
+}
+
+/// pc是返回地址，返回调用它的那一帧的规则
+inline uint32_t unwind_cache_rule(SIZE_T pc)
+{
+    uint64_t entry = _unwind_cache[unwind_cache_index(pc)];
+    if ((entry >> UNWIND_RULE_BITS) == (uint64_t)(pc >> UNWIND_CACHE_BITS))
+        return (uint32_t)entry & ((1 << UNWIND_RULE_BITS) - 1);
+
+    return unwind_cache_fill(pc);
+}
+
+void unwind_cache_initialize(); /// 挂钩之前调用一次
+
+void unwind_cache_refresh(); /// dlclose之后调用，清掉卸载和新加载的模块范围内的表项
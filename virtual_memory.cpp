@@ -0,0 +1,67 @@
+#include "platform.h"
+#include "virtual_memory.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+void* virtual_alloc(size_t size)
+{
+#ifdef _WIN32
+    return VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+    void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return ptr != MAP_FAILED ? ptr : nullptr;
+#endif
+}
+
+void virtual_free(void* ptr, size_t size)
+{
+    if (ptr != nullptr) {
+#ifdef _WIN32
+        VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+        munmap(ptr, size); /// munmap需要大小，所以接口一直带着size
+#endif
+    }
+}
+
+void* virtual_reserve(size_t size)
+{
+#ifdef _WIN32
+    return VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS);
+#else
+    void* ptr = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return ptr != MAP_FAILED ? ptr : nullptr;
+#endif
+}
+
+bool virtual_commit(void* ptr, size_t size)
+{
+#ifdef _WIN32
+    return VirtualAlloc(ptr, size, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+    return mprotect(ptr, size, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+void virtual_decommit(void* ptr, size_t size)
+{
+#ifdef _WIN32
+    VirtualFree(ptr, size, MEM_DECOMMIT);
+#else
+    /// 用新的映射覆盖，物理页面立即释放，再次提交时内容为0
+    mmap(ptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+#endif
+}
+
+size_t virtual_page_size()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+#else
+    return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include <stddef.h>
+
+/// 直接向系统申请内存，不经过被挂钩的malloc，避免重入
+void* virtual_alloc(size_t size);
+
+void virtual_free(void* ptr, size_t size);
+
+/// 保留一段不可访问的地址空间，不占用物理内存
+void* virtual_reserve(size_t size);
+
+bool virtual_commit(void* ptr, size_t size); /// 在保留的地址空间里提交可读写的页面，内容为0
+
+void virtual_decommit(void* ptr, size_t size); /// 页面还给系统并且不可访问，地址空间仍然保留
+
+size_t virtual_page_size();